@@ -0,0 +1,291 @@
+#include "excludes.h"
+
+#include <algorithm>
+#include <cctype>
+
+using namespace std;
+
+namespace {
+    struct Atom {
+        bool any;
+        uint8_t byte;
+    };
+
+    bool isContinuationByte(uint8_t byte) {
+        return (byte & 0xC0) == 0x80;
+    }
+
+    bool hasBackreference(const string &pattern) {
+        for (size_t i = 0; i + 1 < pattern.size(); i++) {
+            if (pattern[i] == '\\') {
+                if (pattern[i + 1] >= '1' && pattern[i + 1] <= '9') {
+                    return true;
+                }
+                // Skip the escaped character.
+                i++;
+            }
+        }
+        return false;
+    }
+
+    // Whether a pattern can match a path's ancestor without matching the path: only if it
+    // looks at where the string ends, with $ or a lookahead. Anything else that matches an
+    // ancestor matches the path too, as the ancestor is a prefix of it.
+    bool needsAncestors(const string &pattern) {
+        for (size_t i = 0; i < pattern.size(); i++) {
+            if (pattern[i] == '\\') {
+                i++;
+                continue;
+            }
+            if (pattern[i] == '$' || pattern.compare(i, 3, "(?=") == 0 || pattern.compare(i, 3, "(?!") == 0) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Decodes UTF-8 without going through the locale, which is often just "C" for a daemon.
+    // Malformed bytes are passed through as-is.
+    wstring widen(string_view str) {
+        wstring result;
+        result.reserve(str.size());
+        for (size_t i = 0; i < str.size(); ) {
+            uint8_t lead = str[i];
+            size_t len = lead < 0x80 ? 1 : (lead >> 5) == 0x6 ? 2 : (lead >> 4) == 0xE ? 3 : (lead >> 3) == 0x1E ? 4 : 0;
+            bool valid = len > 0 && i + len <= str.size();
+            for (size_t j = 1; valid && j < len; j++) {
+                valid = isContinuationByte(str[i + j]);
+            }
+            if (!valid) {
+                result.push_back(lead);
+                i++;
+                continue;
+            }
+
+            wchar_t cp = len == 1 ? lead : lead & (0x7F >> len);
+            for (size_t j = 1; j < len; j++) {
+                cp = (cp << 6) | (str[i + j] & 0x3F);
+            }
+            result.push_back(cp);
+            i += len;
+        }
+        return result;
+    }
+
+    // One search over an alternation beats N searches, but alternation renumbers groups.
+    vector<wregex> combine(const vector<string> &patterns) {
+        vector<wregex> result;
+        if (patterns.size() > 1 && none_of(patterns.begin(), patterns.end(), hasBackreference)) {
+            string combined;
+            for (const string &pattern : patterns) {
+                combined += (combined.empty() ? "(?:" : "|(?:") + pattern + ")";
+            }
+            result.push_back(wregex(widen(combined)));
+            return result;
+        }
+        for (const string &pattern : patterns) {
+            result.push_back(wregex(widen(pattern)));
+        }
+        return result;
+    }
+}
+
+ExcludeSet::ExcludeSet(const vector<string> &patterns) : sources(patterns) {
+    vector<string> complex, complexAtEnd;
+    for (const string &pattern : patterns) {
+        if (!this->compile(pattern)) {
+            // Throws regex_error on a malformed pattern, same as before compilation existed.
+            wregex checked(widen(pattern));
+            (needsAncestors(pattern) ? complexAtEnd : complex).push_back(pattern);
+        }
+    }
+
+    this->fallbacks = combine(complex);
+    this->ancestorFallbacks = combine(complexAtEnd);
+}
+
+bool ExcludeSet::compile(const string &pattern) {
+    // Returns false if the pattern is not a plain sequence of literals and `.`.
+    vector<Atom> atoms;
+    bool anchored = false, anchoredEnd = false;
+
+    for (size_t i = 0; i < pattern.size(); i++) {
+        char c = pattern[i];
+        switch (c) {
+        case '^':
+            if (i != 0) {
+                return false;
+            }
+            anchored = true;
+            break;
+        case '$':
+            if (i != pattern.size() - 1) {
+                return false;
+            }
+            anchoredEnd = true;
+            break;
+        case '.':
+            atoms.push_back({ true, 0 });
+            break;
+        case '\\':
+            // Identity escapes only; \d, \b, \1 and friends need a real regex engine.
+            if (i + 1 == pattern.size() || isalnum(static_cast<unsigned char>(pattern[i + 1]))) {
+                return false;
+            }
+            atoms.push_back({ false, static_cast<uint8_t>(pattern[++i]) });
+            break;
+        case '*': case '+': case '?': case '(': case ')':
+        case '[': case ']': case '{': case '}': case '|':
+            return false;
+        default:
+            atoms.push_back({ false, static_cast<uint8_t>(c) });
+            break;
+        }
+    }
+
+    uint32_t node = anchored ? 0 : 1;
+    for (const Atom &atom : atoms) {
+        node = atom.any ? this->anyChild(node) : this->child(node, atom.byte);
+    }
+    if (anchoredEnd) {
+        this->nodes[node].acceptAtEnd = true;
+    } else {
+        this->nodes[node].accept = true;
+    }
+
+    if (!anchored) {
+        this->anyFloating = true;
+        if (!atoms.empty() && !atoms.front().any) {
+            this->floatingFirst[atoms.front().byte] = true;
+        }
+    }
+
+    return true;
+}
+
+uint32_t ExcludeSet::child(uint32_t node, uint8_t byte) {
+    auto &edges = this->nodes[node].edges;
+    auto it = lower_bound(edges.begin(), edges.end(), make_pair(byte, static_cast<uint32_t>(0)));
+    if (it != edges.end() && it->first == byte) {
+        return it->second;
+    }
+
+    uint32_t result = this->nodes.size();
+    edges.insert(it, { byte, result });
+    // May reallocate nodes, so no references into it are held across this.
+    this->nodes.emplace_back();
+    return result;
+}
+
+uint32_t ExcludeSet::anyChild(uint32_t node) {
+    if (this->nodes[node].any == 0) {
+        uint32_t result = this->nodes.size();
+        this->nodes.emplace_back();
+        this->nodes[node].any = result;
+    }
+    return this->nodes[node].any;
+}
+
+bool ExcludeSet::walk(uint32_t node, string_view relpath, size_t pos) const {
+    const Node &n = this->nodes[node];
+    if (n.accept) {
+        return true;
+    }
+    // A $-anchored pattern matching an ancestor excludes the descendants too.
+    if (n.acceptAtEnd && (pos == relpath.size() || relpath[pos] == '/')) {
+        return true;
+    }
+    if (pos == relpath.size()) {
+        return false;
+    }
+
+    uint8_t byte = relpath[pos];
+
+    auto it = lower_bound(n.edges.begin(), n.edges.end(), make_pair(byte, static_cast<uint32_t>(0)));
+    if (it != n.edges.end() && it->first == byte && this->walk(it->second, relpath, pos + 1)) {
+        return true;
+    }
+
+    // `.` matches any one code point except a line terminator, like wregex does.
+    if (n.any != 0 && byte != '\n' && byte != '\r') {
+        size_t next = pos + 1;
+        while (next < relpath.size() && isContinuationByte(relpath[next])) {
+            next++;
+        }
+        if (this->walk(n.any, relpath, next)) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+bool ExcludeSet::matchesTrie(string_view relpath) const {
+    if (this->walk(0, relpath, 0)) {
+        return true;
+    }
+    if (!this->anyFloating) {
+        return false;
+    }
+
+    const Node &floating = this->nodes[1];
+    bool everyPos = floating.any != 0 || floating.accept || floating.acceptAtEnd;
+
+    for (size_t pos = 0; pos < relpath.size(); pos++) {
+        uint8_t byte = relpath[pos];
+        if (isContinuationByte(byte)) {
+            continue;
+        }
+        if (!everyPos && !this->floatingFirst[byte]) {
+            continue;
+        }
+        if (this->walk(1, relpath, pos)) {
+            return true;
+        }
+    }
+
+    return everyPos && this->walk(1, relpath, relpath.size());
+}
+
+bool ExcludeSet::matchesFallback(string_view relpath) const {
+    wstring wrelpath = widen(relpath);
+
+    for (const wregex &r : this->fallbacks) {
+        if (regex_search(wrelpath, r)) {
+            return true;
+        }
+    }
+
+    for (const wregex &r : this->ancestorFallbacks) {
+        // Try each ancestor, then the path itself.
+        for (size_t pos = 0; pos <= wrelpath.size(); pos++) {
+            if (pos != wrelpath.size() && wrelpath[pos] != L'/') {
+                continue;
+            }
+            if (regex_search(wrelpath.cbegin(), wrelpath.cbegin() + pos, r)) {
+                return true;
+            }
+        }
+    }
+
+    return false;
+}
+
+uint64_t ExcludeSet::fingerprint() const {
+    uint64_t result = 0;
+    for (const string &pattern : this->sources) {
+        for (char c : pattern) {
+            result = result * 101 + static_cast<uint8_t>(c);
+        }
+        // Separator, so that ["ab"] and ["a", "b"] differ.
+        result = result * 101 + 1;
+    }
+    return result;
+}
+
+bool ExcludeSet::excludes(string_view relpath) const {
+    if (this->matchesTrie(relpath)) {
+        return true;
+    }
+    return (!this->fallbacks.empty() || !this->ancestorFallbacks.empty()) && this->matchesFallback(relpath);
+}
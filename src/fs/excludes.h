@@ -0,0 +1,69 @@
+#ifndef FS_EXCLUDES_H
+#define FS_EXCLUDES_H
+
+#include <cstdint>
+#include <regex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+/**
+ * ExcludeSet is the compiled form of the --exclude regexes.
+ *
+ * Patterns that are plain sequences of literals and `.`, optionally anchored with ^ and/or $
+ * (e.g. `^.git`, `\.DS_Store$`, `node_modules`), are compiled together into a single trie
+ * which is walked directly over the UTF-8 bytes of a relative path, without allocating.
+ * Anything fancier falls back to std::wregex, combined into one alternation where possible.
+ *
+ * A path is excluded if it, or any of its ancestor directories, matches. This means an
+ * excluded directory always takes its whole subtree with it, so callers can prune there.
+ */
+class ExcludeSet {
+	struct Node {
+		// Sorted by byte for binary search.
+		std::vector<std::pair<uint8_t, uint32_t>> edges;
+		// Child for `.`, which consumes one code point. 0 if none (root is never a child).
+		uint32_t any = 0;
+		// A pattern ends here.
+		bool accept = false;
+		// A $-anchored pattern ends here.
+		bool acceptAtEnd = false;
+	};
+
+public:
+	ExcludeSet() = default;
+	ExcludeSet(const std::vector<std::string> &patterns);
+
+	// relpath is relative to the sync root, '/'-separated and UTF-8 encoded.
+	bool excludes(std::string_view relpath) const;
+	bool empty() const { return this->sources.empty(); }
+	// Patterns as given, in order.
+	const std::vector<std::string>& patterns() const { return this->sources; }
+	// Identifies the pattern list, so peers can cheaply tell whether they agree. 0 if empty.
+	uint64_t fingerprint() const;
+
+private:
+	bool compile(const std::string &pattern);
+	uint32_t child(uint32_t node, uint8_t byte);
+	uint32_t anyChild(uint32_t node);
+	// Does some trie pattern starting at node match relpath[pos..]?
+	bool walk(uint32_t node, std::string_view relpath, size_t pos) const;
+	bool matchesTrie(std::string_view relpath) const;
+	bool matchesFallback(std::string_view relpath) const;
+
+	std::vector<std::string> sources;
+
+	// nodes[0] is the root for ^-anchored patterns, nodes[1] for floating ones.
+	std::vector<Node> nodes = std::vector<Node>(2);
+	bool anyFloating = false;
+	// Bytes that can start a floating match; only consulted when floating root has no `.` edge.
+	bool floatingFirst[256] = {};
+
+	// Searched once over the whole path.
+	std::vector<std::wregex> fallbacks;
+	// Patterns that look at where the string ends, so have to be searched over each ancestor
+	// too.
+	std::vector<std::wregex> ancestorFallbacks;
+};
+
+#endif
@@ -1,4 +1,8 @@
 #include "scanner.h"
+
+#include <map>
+#include <vector>
+
 #include "../util/log.h"
 
 using namespace std;
@@ -27,30 +31,86 @@ void scanSingle(const std::filesystem::path &path, function<void (const FileReco
 // performFullScan //
 /////////////////////
 
-void performFullScan(
-    const Directory &dir,
-    struct dirent *dp,
-    function<void (const FileRecord&)> callback,
-    function<bool (const std::filesystem::path &)> filterFn
-);
+namespace {
+    // Content hashes of inodes seen so far in a scan, so that hard links are hashed once.
+    typedef map<pair<uint64_t, uint64_t>, HashT> LinkHashes;
 
-void processFile(
-    const File &f,
-    function<void (const FileRecord&)> callback,
-    function<bool (const std::filesystem::path &)> filterFn
-) {
-    if (!filterFn(f.path)) {
-        return;
-    }
+    void scanTree(
+        const std::filesystem::path &path,
+        function<void (const FileRecord&)> callback,
+        function<bool (const std::filesystem::path &)> filterFn,
+        LinkHashes &linkHashes
+    );
+
+    void processFile(
+        const File &f,
+        function<void (const FileRecord&)> callback,
+        function<bool (const std::filesystem::path &)> filterFn,
+        LinkHashes &linkHashes
+    ) {
+        // Already filtered by scanTree, before we paid for the stat.
+
+        if (f.links > 1 && std::filesystem::is_regular_file(f.statbuf)) {
+            auto key = make_pair(f.device, f.inode);
+            auto it = linkHashes.find(key);
+            if (it != linkHashes.end()) {
+                StatusLine::Add("linksSkipped", 1);
+                callback(FileRecord(f, it->second));
+                return;
+            }
+
+            FileRecord filerec(f);
+            linkHashes[key] = filerec.version;
+            callback(filerec);
+            return;
+        }
+
+        FileRecord filerec(f);
+        if (!f.isDir()) {
+            callback(filerec);
+            return;
+        }
 
-    FileRecord filerec(f);
-    callback(filerec);
-    
-    if (f.isDir()) {
+        // Listed before the directory is indexed, so that the index knows whether it's complete.
         Directory subdir(f);
-        subdir.forEach([&callback, &filterFn] (const std::filesystem::directory_entry& entry) {
-            performFullScan(entry.path(), callback, filterFn);
-        });
+        vector<std::filesystem::path> entries;
+        try {
+            subdir.forEach([&entries] (const std::filesystem::directory_entry& entry) {
+                entries.push_back(entry.path());
+            });
+        } catch (const std::filesystem::filesystem_error &e) {
+            // Usually EACCES. Marked rather than giving up on the whole scan, so that replicas
+            // keep what they have under it instead of taking it for empty.
+            StatusLine::Add("unreadableDirs", 1);
+            ERR("Can't read " << e.path1() << ": " << e.code().message() << ", skipping what's in it.");
+            filerec.unreadable = true;
+        }
+        callback(filerec);
+
+        for (const std::filesystem::path &entry : entries) {
+            scanTree(entry, callback, filterFn, linkHashes);
+        }
+    }
+
+    void scanTree(
+        const std::filesystem::path &path,
+        function<void (const FileRecord&)> callback,
+        function<bool (const std::filesystem::path &)> filterFn,
+        LinkHashes &linkHashes
+    ) {
+        // An excluded directory takes its whole subtree with it, so we never enter it.
+        if (!filterFn(path)) {
+            return;
+        }
+
+        try {
+            File f(path);
+            processFile(f, callback, filterFn, linkHashes);
+        } catch (does_not_exist_error e) {
+            // Sometimes a file is gone by the time we get to it, and that's fine.
+            FileRecord filerec(FileRecord::Type::DOES_NOT_EXIST, NULL_HASH, path);
+            callback(filerec);
+        }
     }
 }
 
@@ -59,16 +119,6 @@ void performFullScan(
     function<void (const FileRecord&)> callback,
     function<bool (const std::filesystem::path &)> filterFn
 ) {
-    if (!filterFn(path)) {
-        return;
-    }
-
-    try {
-        File f(path);
-        processFile(f, callback, filterFn);
-    } catch (does_not_exist_error e) {
-        // Sometimes a file is gone by the time we get to it, and that's fine.
-        FileRecord filerec(FileRecord::Type::DOES_NOT_EXIST, NULL_HASH, path);
-        callback(filerec);
-    }
+    LinkHashes linkHashes;
+    scanTree(path, callback, filterFn, linkHashes);
 }
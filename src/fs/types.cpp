@@ -35,6 +35,14 @@ HashT HashString(const string &s) {
 ////////////////
 
 FileRecord::FileRecord(const File &f) {
+    this->init(f, nullptr);
+}
+
+FileRecord::FileRecord(const File &f, HashT version) {
+    this->init(f, &version);
+}
+
+void FileRecord::init(const File &f, const HashT *knownVersion) {
     HashT version = NULL_HASH;
 
     FileRecord::Type type;
@@ -43,7 +51,10 @@ FileRecord::FileRecord(const File &f) {
         version = 0;
     } else if (std::filesystem::is_regular_file(f.statbuf)) {
         type = Type::FILE;
-        version = f.hash();
+        version = knownVersion ? *knownVersion : f.hash();
+        this->device = f.device;
+        this->inode = f.inode;
+        this->links = f.links;
     } else if (std::filesystem::is_symlink(f.statbuf)) {
         type = Type::SYMLINK;
         this->targetPath = std::filesystem::read_symlink(f.path);
@@ -105,16 +116,60 @@ std::wostream& operator<<(std::wostream &os, const FileRecord::Type &type) {
     return os;
 }
 
-void serialize(std::ostream &stream, const FileRecord::Type &val) {
+void serialize(Writer &stream, const FileRecord::Type &val) {
     serialize(stream, static_cast<uint8_t>(val));
 }
 
-void deserialize(std::istream &stream, FileRecord::Type &val) {
+void deserialize(Reader &stream, FileRecord::Type &val) {
     uint8_t tmp;
     deserialize(stream, tmp);
     val = static_cast<FileRecord::Type>(tmp);
 }
 
+////////////
+// Extent //
+////////////
+
+vector<Extent> dataExtents(int fd, uint64_t size) {
+    vector<Extent> result;
+    if (size == 0) {
+        return result;
+    }
+
+#ifdef SEEK_DATA
+    // A file that has all its blocks allocated has no holes, and most files are like that.
+    struct stat statbuf;
+    if (fstat(fd, &statbuf) == 0 && static_cast<uint64_t>(statbuf.st_blocks) * 512 < size) {
+        off_t pos = 0;
+        while (static_cast<uint64_t>(pos) < size) {
+            off_t data = lseek(fd, pos, SEEK_DATA);
+            if (data < 0) {
+                if (errno == ENXIO) {
+                    // Nothing but a hole from pos to the end.
+                    return result;
+                }
+                // Not supported here after all.
+                result.clear();
+                break;
+            }
+            off_t hole = lseek(fd, data, SEEK_HOLE);
+            if (hole < 0 || static_cast<uint64_t>(hole) > size) {
+                hole = size;
+            }
+            result.push_back({ static_cast<uint64_t>(data), static_cast<uint64_t>(hole - data) });
+            pos = hole;
+        }
+        if (!result.empty()) {
+            return result;
+        }
+    }
+#endif
+
+    result.push_back({ 0, size });
+    return result;
+}
+
+
 ///////////////
 // Directory //
 ///////////////
@@ -168,14 +223,32 @@ File::File(const std::filesystem::path& path) {
 }
 
 void File::init(const std::filesystem::path& path) {
-    std::filesystem::file_status statbuf = std::filesystem::symlink_status(path);
-    if (!std::filesystem::exists(statbuf)) {
-        throw does_not_exist_error("File does not exist: " + path.string());
+    // One lstat gets us both what symlink_status would and the inode identity.
+    struct stat st;
+    if (lstat(path.c_str(), &st) != 0) {
+        if (errno == ENOENT || errno == ENOTDIR) {
+            throw does_not_exist_error("File does not exist: " + path.string());
+        }
+        throw runtime_error("Could not stat " + path.string() + ": " + strerror(errno));
+    }
+
+    std::filesystem::file_type type = std::filesystem::file_type::unknown;
+    switch (st.st_mode & S_IFMT) {
+        case S_IFREG: type = std::filesystem::file_type::regular; break;
+        case S_IFDIR: type = std::filesystem::file_type::directory; break;
+        case S_IFLNK: type = std::filesystem::file_type::symlink; break;
+        case S_IFBLK: type = std::filesystem::file_type::block; break;
+        case S_IFCHR: type = std::filesystem::file_type::character; break;
+        case S_IFIFO: type = std::filesystem::file_type::fifo; break;
+        case S_IFSOCK: type = std::filesystem::file_type::socket; break;
     }
 
     // Commit
     this->path = path;
-    this->statbuf = statbuf;
+    this->statbuf = std::filesystem::file_status(type, static_cast<std::filesystem::perms>(st.st_mode & 07777));
+    this->device = st.st_dev;
+    this->inode = st.st_ino;
+    this->links = st.st_nlink;
 }
 
 // Hash timing:
@@ -184,34 +257,75 @@ void File::init(const std::filesystem::path& path) {
 // - xxhash64: sometimes same as xxhash32, sometimes 3.426s (1.895u+0.813s). puzzling.
 
 HashT File::hash() const {
-    const size_t BLOCK_SIZE = 1024;
-    unsigned char buf[BLOCK_SIZE];
-
-    ifstream f(this->path, ifstream::binary);
+    const size_t BLOCK_SIZE = 64 * 1024;
+    // Holes are hashed as the zeros they read as, so a sparse file and a dense copy of it match.
+    static const unsigned char zeros[BLOCK_SIZE] = {};
+    vector<unsigned char> buf(BLOCK_SIZE);
+
+    int fd = open(this->path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        if (errno == ENOENT) {
+            throw does_not_exist_error("File does not exist: " + this->path.string());
+        }
+        throw runtime_error("Could not open " + this->path.string() + ": " + strerror(errno));
+    }
 
     XXH64_state_t st;
     if (XXH64_reset(&st, 0) == XXH_ERROR) {
+        close(fd);
         throw runtime_error("Could not reset xxhash state for file: " + this->path.string());
     }
 
-    f.seekg(0, f.end);
-    int len = f.tellg();
-    f.seekg(0, f.beg);
-
-    while (len) {
-        size_t sz = len > BLOCK_SIZE ? BLOCK_SIZE : len;
-        f.read((char*)buf, sz);
-
-        if (XXH64_update(&st, buf, sz) == XXH_ERROR) {
+    auto update = [this, &st, fd] (const void *data, size_t len) {
+        if (XXH64_update(&st, data, len) == XXH_ERROR) {
+            close(fd);
             throw runtime_error("Could not update xxhash for file: " + this->path.string());
         }
-        
-        len -= sz;
+    };
+    auto updateZeros = [&update] (uint64_t len) {
+        while (len) {
+            size_t sz = len > BLOCK_SIZE ? BLOCK_SIZE : len;
+            update(zeros, sz);
+            len -= sz;
+        }
+    };
+
+    struct stat statbuf;
+    if (fstat(fd, &statbuf) != 0) {
+        close(fd);
+        throw runtime_error("Could not stat " + this->path.string() + ": " + strerror(errno));
     }
 
-    HashT result = XXH64_digest(&st);
+    uint64_t pos = 0;
+    for (const Extent &extent : dataExtents(fd, statbuf.st_size)) {
+        if (extent.offset > pos) {
+            updateZeros(extent.offset - pos);
+            StatusLine::Add("holeBytesHashed", extent.offset - pos);
+        }
+        pos = extent.offset;
+
+        uint64_t end = extent.offset + extent.length;
+        while (pos < end) {
+            size_t sz = end - pos > BLOCK_SIZE ? BLOCK_SIZE : end - pos;
+            ssize_t n = pread(fd, buf.data(), sz, pos);
+            if (n < 0) {
+                close(fd);
+                throw runtime_error("Could not read " + this->path.string() + ": " + strerror(errno));
+            }
+            if (n == 0) {
+                // Shrunk since the stat. Whatever it is now will come through as another change.
+                break;
+            }
+            update(buf.data(), n);
+            pos += n;
+        }
+    }
+    if (static_cast<uint64_t>(statbuf.st_size) > pos) {
+        updateZeros(statbuf.st_size - pos);
+    }
 
-    return result;
+    close(fd);
+    return XXH64_digest(&st);
 }
 
 bool File::isDir() const {
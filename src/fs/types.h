@@ -6,6 +6,7 @@
 #include <functional>
 #include <string>
 #include <sys/stat.h>
+#include <vector>
 #include "../util/serialize.h"
 
 //////////////////
@@ -17,6 +18,9 @@ typedef std::filesystem::path Relpath;
 typedef std::filesystem::path Abspath;
 const HashT NULL_HASH = 0;
 
+// xxhash64 of s.
+HashT HashString(const std::string &s);
+
 class File;
 
 class FileRecord {
@@ -29,6 +33,8 @@ public:
 	};
 
 	FileRecord(const File &f);
+	// For when the content hash is already known, e.g. from another hard link to the same inode.
+	FileRecord(const File &f, HashT version);
 	FileRecord(Type type, HashT version, Abspath path, std::filesystem::perms mode=std::filesystem::perms::none);
 
 	Type type;
@@ -36,13 +42,25 @@ public:
 	HashT version;
 	Abspath path;
 	std::filesystem::path targetPath;  // only for symlinks
+
+	// Only for files, so that hard links to the same inode can be grouped.
+	uint64_t device = 0;
+	uint64_t inode = 0;
+	uint64_t links = 1;
+
+	// Only for directories: listing it failed, e.g. with EACCES, so what's in it is unknown.
+	bool unreadable = false;
+
+private:
+	void init(const File &f, const HashT *version);
 };
 
 std::ostream& operator<<(std::ostream &os, const FileRecord::Type &type);
 std::wostream& operator<<(std::wostream &os, const FileRecord::Type &type);
 
-void serialize(std::ostream &stream, const FileRecord::Type &val);
-void deserialize(std::istream &stream, FileRecord::Type &val);
+template <> struct FixedWireSize<FileRecord::Type> : FixedWireSizeOf<1> {};
+void serialize(Writer &stream, const FileRecord::Type &val);
+void deserialize(Reader &stream, FileRecord::Type &val);
 
 
 class Directory {
@@ -60,6 +78,16 @@ public:
 	std::filesystem::path path;
 };
 
+// A run of a regular file's data. Whatever lies between extents is a hole, which reads as zeros.
+struct Extent {
+	uint64_t offset;
+	uint64_t length;
+};
+
+// Finds the data extents of an open regular file of the given size using SEEK_DATA/SEEK_HOLE.
+// Where those aren't supported, the whole file is one extent.
+std::vector<Extent> dataExtents(int fd, uint64_t size);
+
 class File {
 	void init(const std::filesystem::path& path);
 public:
@@ -80,6 +108,9 @@ public:
 	// std::wstring path;
 	std::filesystem::path path;
     std::filesystem::file_status statbuf;
+	uint64_t device = 0;
+	uint64_t inode = 0;
+	uint64_t links = 1;
 };
 
 
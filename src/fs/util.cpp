@@ -5,21 +5,61 @@
 
 using namespace std;
 
-bool filterPath(const std::filesystem::path &root, const vector<wregex> excludes, const std::filesystem::path &path) {
+bool filterPath(const std::filesystem::path &root, const ExcludeSet &excludes, const std::filesystem::path &path) {
     // Scanner's ignoring these anyway since it doesn't want to infinitely recurse into .,
     // but the watcher doesn't ignore these so we ignore them here.
 
+    if (excludes.empty()) {
+        return true;
+    }
+
+    // Paths from the scanner and watcher are spelled root/relpath, so we can usually
+    // slice the relpath out of the native string instead of building a new path.
+    const string &native = path.native();
+    const string &rootStr = root.native();
+    size_t n = rootStr.size();
+    bool rootHasSep = n > 0 && rootStr[n - 1] == '/';
+    if (native.size() > n && native.compare(0, n, rootStr) == 0 && (rootHasSep || native[n] == '/')) {
+        return !excludes.excludes(string_view(native).substr(rootHasSep ? n : n + 1));
+    }
+
     if (path == root) {
         return true;
     }
 
-    wstring relpath = path.lexically_relative(root).wstring();
+    string relpath = path.lexically_relative(root).string();
+    return !excludes.excludes(relpath);
+}
+
+bool renamePreservesExcludes(
+    const std::filesystem::path &root, const ExcludeSet &excludes,
+    const std::filesystem::path &from, const std::filesystem::path &to
+) {
+    if (excludes.empty()) {
+        return true;
+    }
+    if (filterPath(root, excludes, from) != filterPath(root, excludes, to)) {
+        return false;
+    }
+
+    error_code ec;
+    if (!std::filesystem::is_directory(std::filesystem::symlink_status(to, ec))) {
+        return true;
+    }
 
-    for (const wregex &r : excludes) {
-        if (regex_search(relpath, r)) {
+    std::filesystem::recursive_directory_iterator it(to, ec), end;
+    for (; !ec && it != end; it.increment(ec)) {
+        const std::filesystem::path &path = it->path();
+        bool included = filterPath(root, excludes, path);
+        if (included != filterPath(root, excludes, from / path.lexically_relative(to))) {
             return false;
         }
+        if (!included) {
+            // Anything below is excluded at both ends too.
+            it.disable_recursion_pending();
+        }
     }
 
-    return true;
+    // If we couldn't walk it, don't claim anything.
+    return !ec;
 }
@@ -2,10 +2,16 @@
 #define FS_UTIL_H
 
 #include <filesystem>
-#include <regex>
 #include <string>
-#include <vector>
 
-bool filterPath(const std::filesystem::path &root, const std::vector<std::wregex> excludes, const std::filesystem::path &path);
+#include "excludes.h"
+
+bool filterPath(const std::filesystem::path &root, const ExcludeSet &excludes, const std::filesystem::path &path);
+// Whether everything now at to was excluded (or not) exactly as it was at from, in which case
+// an indexed subtree can be moved over as-is. Walks to, but reads no file contents.
+bool renamePreservesExcludes(
+	const std::filesystem::path &root, const ExcludeSet &excludes,
+	const std::filesystem::path &from, const std::filesystem::path &to
+);
 
 #endif
@@ -1,6 +1,8 @@
 #include "watcher.h"
 
+#include <algorithm>
 #include <iostream>
+#include <map>
 #include <sstream>
 #include <string>
 
@@ -28,8 +30,14 @@ void eventCallback(
     }
 }
 
-Watcher::Watcher(const std::filesystem::path &root, std::function<void (const FileRecord &rec)> callback)
-    : callback(callback) {
+Watcher::Watcher(
+    const std::filesystem::path &root,
+    std::function<void (const FileRecord &rec)> callback,
+    std::function<void (const std::filesystem::path &from, const std::filesystem::path &to)> renameFn,
+    std::function<bool (const std::filesystem::path &)> filterFn,
+    WatcherBackend backend,
+    std::function<void ()> overflowFn
+) : callback(callback), renameFn(renameFn), filterFn(filterFn), overflowFn(overflowFn) {
     FSEventStreamContext context = {0, this, NULL, NULL, NULL};
     CFStringRef mypath = CFStringCreateWithCString(NULL, root.string().c_str(), kCFStringEncodingUTF8);
     CFArrayRef pathsToWatch = CFArrayCreate(NULL, (const void **)&mypath, 1, NULL);
@@ -76,10 +84,551 @@ Watcher::~Watcher() {
 }
 
 void Watcher::onEvent(const std::filesystem::path& path) {
+    if (!this->filterFn(path)) {
+        return;
+    }
     scanSingle(path, callback);
 }
+#elif defined(__linux__)
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/fanotify.h>
+#include <sys/inotify.h>
+#include <system_error>
+#include <unistd.h>
+
+namespace {
+    const uint32_t INOTIFY_MASK =
+        IN_CREATE | IN_DELETE | IN_MODIFY | IN_ATTRIB | IN_MOVED_FROM | IN_MOVED_TO |
+        IN_ONLYDIR | IN_DONT_FOLLOW;
+    const uint64_t FANOTIFY_MASK =
+        FAN_CREATE | FAN_DELETE | FAN_MODIFY | FAN_ATTRIB | FAN_MOVED_FROM | FAN_MOVED_TO | FAN_ONDIR;
+#ifdef FAN_RENAME
+    // Linux 5.17+. One event naming both ends of a move, alongside the MOVED_FROM/MOVED_TO pair.
+    const uint64_t FANOTIFY_RENAME_MASK = FAN_RENAME;
+#else
+    const uint64_t FANOTIFY_RENAME_MASK = 0;
+#endif
+    const size_t EVENT_BUF_SIZE = 64 * 1024;
+    const size_t HANDLE_CACHE_MAX = 64 * 1024;
+    // How often the watch thread checks whether it should stop.
+    const int POLL_TIMEOUT_MS = 250;
+
+    // Waits for fd to become readable. Returns false on timeout.
+    bool awaitReadable(int fd) {
+        struct pollfd pfd = { fd, POLLIN, 0 };
+        int ready = poll(&pfd, 1, POLL_TIMEOUT_MS);
+        if (ready == -1 && errno != EINTR) {
+            throw system_error(errno, system_category(), "poll");
+        }
+        return ready > 0;
+    }
+
+    bool isWithin(const std::filesystem::path &dir, const std::filesystem::path &path) {
+        return std::mismatch(dir.begin(), dir.end(), path.begin(), path.end()).first == dir.end();
+    }
+
+    std::filesystem::path rebase(
+        const std::filesystem::path &path, const std::filesystem::path &from, const std::filesystem::path &to
+    ) {
+        return path == from ? to : to / path.lexically_relative(from);
+    }
+
+    // Records a rename, carrying anything seen earlier in the batch under from over to to,
+    // since that's where it lives by the time we scan.
+    void noteRename(
+        vector<pair<std::filesystem::path, std::filesystem::path>> &renames,
+        map<std::filesystem::path, bool> &changed,
+        const std::filesystem::path &from,
+        const std::filesystem::path &to
+    ) {
+        map<std::filesystem::path, bool> moved;
+        for (auto it = changed.begin(); it != changed.end(); ) {
+            if (isWithin(from, it->first)) {
+                moved[rebase(it->first, from, to)] = it->second;
+                it = changed.erase(it);
+            } else {
+                ++it;
+            }
+        }
+        for (const auto &[path, recurse] : moved) {
+            changed[path] = changed[path] || recurse;
+        }
+
+        renames.emplace_back(from, to);
+    }
+}
+
+Watcher::Watcher(
+    const std::filesystem::path &root,
+    std::function<void (const FileRecord &rec)> callback,
+    std::function<void (const std::filesystem::path &from, const std::filesystem::path &to)> renameFn,
+    std::function<bool (const std::filesystem::path &)> filterFn,
+    WatcherBackend backend,
+    std::function<void ()> overflowFn
+) : callback(callback), renameFn(renameFn), filterFn(filterFn), overflowFn(overflowFn), root(root), backend(backend) {
+    if (this->backend == WatcherBackend::FANOTIFY && !this->initFanotify()) {
+        this->backend = WatcherBackend::INOTIFY;
+    }
+    if (this->backend == WatcherBackend::INOTIFY) {
+        this->initInotify();
+    }
+
+    this->watch_thread.reset(new thread([this] () {
+        try {
+            if (this->backend == WatcherBackend::FANOTIFY) {
+                this->runFanotify();
+            } else {
+                this->runInotify();
+            }
+        } catch (const exception &e) {
+            LOG_EXCEPTION(e, "Watcher");
+        }
+    }));
+}
+
+Watcher::~Watcher() {
+    this->stop_requested.store(true);
+    if (this->watch_thread) {
+        this->watch_thread->join();
+    }
+    if (this->fd != -1) {
+        close(this->fd);
+    }
+    if (this->mountFd != -1) {
+        close(this->mountFd);
+    }
+}
+
+void Watcher::onEvent(const std::filesystem::path& path) {
+    if (!this->filterFn(path)) {
+        return;
+    }
+    scanSingle(path, callback);
+}
+
+void Watcher::dispatch(
+    const vector<pair<std::filesystem::path, std::filesystem::path>> &renames,
+    const map<std::filesystem::path, bool> &changed
+) {
+    // One path failing mustn't stop the watch loop, and with it every change after.
+    for (const auto &[from, to] : renames) {
+        try {
+            if (this->renameFn) {
+                this->renameFn(from, to);
+            } else {
+                this->onEvent(from);
+                performFullScan(to, this->callback, this->filterFn);
+            }
+        } catch (const exception &e) {
+            StatusLine::Add("watcherErrors", 1);
+            LOG_EXCEPTION(e, "Watcher rename " << from << " -> " << to);
+        }
+    }
+
+    for (const auto &[path, recurse] : changed) {
+        try {
+            if (recurse) {
+                performFullScan(path, this->callback, this->filterFn);
+            } else {
+                this->onEvent(path);
+            }
+        } catch (const exception &e) {
+            StatusLine::Add("watcherErrors", 1);
+            LOG_EXCEPTION(e, "Watcher " << path);
+        }
+    }
+}
+
+void Watcher::recover() {
+    if (this->backend == WatcherBackend::INOTIFY) {
+        // Directories created meanwhile went unwatched. Existing watches are kept as they are.
+        this->addWatches(this->root);
+    } else {
+        // Renames may have gone by unseen.
+        this->handleCache.clear();
+    }
+
+    try {
+        if (this->overflowFn) {
+            this->overflowFn();
+        } else {
+            performFullScan(this->root, this->callback, this->filterFn);
+        }
+    } catch (const exception &e) {
+        StatusLine::Add("watcherErrors", 1);
+        LOG_EXCEPTION(e, "Watcher rescan");
+    }
+}
+
+bool Watcher::initFanotify() {
+    // EPERM without CAP_SYS_ADMIN, EINVAL on kernels older than 5.9 (no FAN_REPORT_DFID_NAME).
+    int fd = fanotify_init(FAN_CLASS_NOTIF | FAN_CLOEXEC | FAN_NONBLOCK | FAN_REPORT_DFID_NAME, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        ERR("fanotify_init: " << strerror(errno) << ". Falling back to inotify.");
+        return false;
+    }
+
+    // Mount marks don't get create/delete/move events, so we mark the whole filesystem.
+    // Kernels without FAN_RENAME reject it with EINVAL, and then moves are a delete + create.
+    this->renameEvents = FANOTIFY_RENAME_MASK != 0;
+    int marked = fanotify_mark(fd, FAN_MARK_ADD | FAN_MARK_FILESYSTEM, FANOTIFY_MASK | FANOTIFY_RENAME_MASK, AT_FDCWD, this->root.c_str());
+    if (marked == -1 && errno == EINVAL && this->renameEvents) {
+        this->renameEvents = false;
+        marked = fanotify_mark(fd, FAN_MARK_ADD | FAN_MARK_FILESYSTEM, FANOTIFY_MASK, AT_FDCWD, this->root.c_str());
+    }
+    if (marked == -1) {
+        ERR("fanotify_mark: " << strerror(errno) << ". Falling back to inotify.");
+        close(fd);
+        return false;
+    }
+
+    int mountFd = open(this->root.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (mountFd == -1) {
+        ERR("open " << this->root << ": " << strerror(errno) << ". Falling back to inotify.");
+        close(fd);
+        return false;
+    }
+
+    // Resolving event handles also needs CAP_DAC_READ_SEARCH, so try it once on root.
+    alignas(struct file_handle) unsigned char handleBuf[sizeof(struct file_handle) + MAX_HANDLE_SZ];
+    struct file_handle *rootHandle = reinterpret_cast<struct file_handle *>(handleBuf);
+    rootHandle->handle_bytes = MAX_HANDLE_SZ;
+    int mountId;
+    int probeFd = -1;
+    if (name_to_handle_at(AT_FDCWD, this->root.c_str(), rootHandle, &mountId, 0) == 0) {
+        probeFd = open_by_handle_at(mountFd, rootHandle, O_PATH | O_CLOEXEC);
+    }
+    if (probeFd == -1) {
+        ERR("open_by_handle_at: " << strerror(errno) << ". Falling back to inotify.");
+        close(mountFd);
+        close(fd);
+        return false;
+    }
+    close(probeFd);
+
+    this->fd = fd;
+    this->mountFd = mountFd;
+    this->canonicalRoot = std::filesystem::canonical(this->root).string();
+
+    LOG("Watching the filesystem containing " << this->root << " with fanotify.");
+    return true;
+}
+
+void Watcher::initInotify() {
+    this->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (this->fd == -1) {
+        throw system_error(errno, system_category(), "inotify_init1");
+    }
+
+    this->addWatches(this->root);
+
+    LOG("Watching " << this->watches.size() << " directories with inotify.");
+}
+
+void Watcher::addWatches(const std::filesystem::path &dir) {
+    int wd = inotify_add_watch(this->fd, dir.c_str(), INOTIFY_MASK);
+    if (wd == -1) {
+        if (errno == ENOSPC) {
+            StatusLine::Add("unwatchedDirs", 1);
+            if (!this->watchLimitHit) {
+                ERR("Reached fs.inotify.max_user_watches at " << dir << ", changes below it will be missed. Consider --watcher=fanotify.");
+                this->watchLimitHit = true;
+            }
+            return;
+        }
+        if (errno == ENOENT || errno == ENOTDIR) {
+            // Gone already, or replaced by a file. Its parent's events cover that.
+            return;
+        }
+        // Usually EACCES. Only this directory is affected, so carry on with the rest.
+        StatusLine::Add("unwatchedDirs", 1);
+        ERR("inotify_add_watch " << dir << ": " << strerror(errno) << ", changes below it will be missed.");
+        return;
+    }
+
+    // A directory that moved keeps its wd, so this also serves to update its path.
+    this->watches[wd] = dir;
+
+    error_code ec;
+    for (const auto &entry : std::filesystem::directory_iterator(dir, ec)) {
+        if (entry.is_directory(ec) && !entry.is_symlink(ec) && this->filterFn(entry.path())) {
+            this->addWatches(entry.path());
+        }
+    }
+}
+
+void Watcher::removeWatches(const std::filesystem::path &dir) {
+    for (auto it = this->watches.begin(); it != this->watches.end(); ) {
+        if (isWithin(dir, it->second)) {
+            inotify_rm_watch(this->fd, it->first);
+            it = this->watches.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+void Watcher::moveWatches(const std::filesystem::path &from, const std::filesystem::path &to) {
+    for (auto &[wd, watched] : this->watches) {
+        if (isWithin(from, watched)) {
+            watched = rebase(watched, from, to);
+        }
+    }
+}
+
+void Watcher::runInotify() {
+    alignas(struct inotify_event) char buf[EVENT_BUF_SIZE];
+
+    while (!this->stop_requested.load()) {
+        if (!awaitReadable(this->fd)) {
+            continue;
+        }
+
+        ssize_t len = read(this->fd, buf, sizeof buf);
+        if (len == -1) {
+            if (errno == EAGAIN || errno == EINTR) {
+                continue;
+            }
+            throw system_error(errno, system_category(), "read inotify");
+        }
+
+        // Coalesce the batch, so a file written in many chunks is only hashed once.
+        // Sorted order also puts parents before their children. Value is whether to
+        // scan the whole subtree.
+        map<std::filesystem::path, bool> changed;
+        vector<pair<std::filesystem::path, std::filesystem::path>> renames;
+        // IN_MOVED_FROM awaiting the IN_MOVED_TO with the same cookie, and whether it's a dir.
+        // The pair is adjacent in practice; one split across reads degrades to delete + create.
+        map<uint32_t, pair<std::filesystem::path, bool>> movedFrom;
+        bool overflowed = false;
+
+        for (char *p = buf; p < buf + len; ) {
+            const struct inotify_event *ev = reinterpret_cast<const struct inotify_event *>(p);
+            p += sizeof(struct inotify_event) + ev->len;
+
+            if (ev->mask & IN_Q_OVERFLOW) {
+                ERR("inotify queue overflowed, rescanning.");
+                StatusLine::Add("watcherOverflow", 1);
+                overflowed = true;
+                continue;
+            }
+            if (ev->mask & IN_IGNORED) {
+                this->watches.erase(ev->wd);
+                continue;
+            }
+
+            auto watched = this->watches.find(ev->wd);
+            if (watched == this->watches.end()) {
+                continue;
+            }
+            std::filesystem::path path = ev->len > 0 ? watched->second / ev->name : watched->second;
+
+            bool isDir = ev->mask & IN_ISDIR;
+            if (ev->mask & IN_MOVED_FROM) {
+                movedFrom[ev->cookie] = { path, isDir };
+                continue;
+            }
+
+            auto from = movedFrom.end();
+            if (ev->mask & IN_MOVED_TO) {
+                from = movedFrom.find(ev->cookie);
+            }
+            if (from != movedFrom.end()) {
+                if (isDir) {
+                    // Watches follow the directory, only their paths are stale.
+                    if (this->filterFn(path)) {
+                        this->moveWatches(from->second.first, path);
+                    } else {
+                        this->removeWatches(from->second.first);
+                    }
+                }
+                noteRename(renames, changed, from->second.first, path);
+                movedFrom.erase(from);
+                continue;
+            }
+
+            // Watch before scanning, so nothing created in between slips through.
+            bool isNewDir = isDir && (ev->mask & (IN_CREATE | IN_MOVED_TO));
+            if (isNewDir && this->filterFn(path)) {
+                this->addWatches(path);
+            }
+
+            changed[path] = changed[path] || isNewDir;
+        }
+
+        // Moved out of root, as far as we can tell.
+        for (const auto &[cookie, from] : movedFrom) {
+            if (from.second) {
+                this->removeWatches(from.first);
+            }
+            changed[from.first] = changed[from.first] || false;
+        }
+
+        this->dispatch(renames, changed);
+        if (overflowed) {
+            this->recover();
+        }
+    }
+}
+
+std::filesystem::path Watcher::resolveHandle(const void *handle, size_t len) {
+    string key(static_cast<const char *>(handle), len);
+    auto cached = this->handleCache.find(key);
+    if (cached != this->handleCache.end()) {
+        return cached->second;
+    }
+
+    std::filesystem::path result;
+
+    int dirFd = open_by_handle_at(this->mountFd, static_cast<struct file_handle *>(const_cast<void *>(handle)), O_PATH | O_CLOEXEC);
+    if (dirFd == -1) {
+        // ESTALE if the directory is gone already. Not cached, the handle won't come back.
+        return result;
+    }
+
+    char target[PATH_MAX];
+    string link = "/proc/self/fd/" + to_string(dirFd);
+    ssize_t n = readlink(link.c_str(), target, sizeof target);
+    close(dirFd);
+
+    if (n > 0) {
+        string_view dir(target, n);
+        const string &r = this->canonicalRoot;
+        if (dir == r) {
+            result = this->root;
+        } else if (dir.size() > r.size() && dir.compare(0, r.size(), r) == 0 && dir[r.size()] == '/') {
+            result = this->root / dir.substr(r.size() + 1);
+        }
+    }
+
+    // Directories outside root are cached too (as ""), which is what keeps a
+    // whole-filesystem mark cheap.
+    if (this->handleCache.size() >= HANDLE_CACHE_MAX) {
+        this->handleCache.clear();
+    }
+    this->handleCache[key] = result;
+
+    return result;
+}
+
+void Watcher::runFanotify() {
+    alignas(struct fanotify_event_metadata) char buf[EVENT_BUF_SIZE];
+
+    while (!this->stop_requested.load()) {
+        if (!awaitReadable(this->fd)) {
+            continue;
+        }
+
+        ssize_t len = read(this->fd, buf, sizeof buf);
+        if (len == -1) {
+            if (errno == EAGAIN || errno == EINTR) {
+                continue;
+            }
+            throw system_error(errno, system_category(), "read fanotify");
+        }
+
+        // Same as for inotify: coalesced, parents first, value is whether to recurse.
+        map<std::filesystem::path, bool> changed;
+        vector<pair<std::filesystem::path, std::filesystem::path>> renames;
+        bool overflowed = false;
+
+        const struct fanotify_event_metadata *md = reinterpret_cast<const struct fanotify_event_metadata *>(buf);
+        for (; FAN_EVENT_OK(md, len); md = FAN_EVENT_NEXT(md, len)) {
+            if (md->vers != FANOTIFY_METADATA_VERSION) {
+                throw runtime_error("Unexpected fanotify metadata version.");
+            }
+            if (md->mask & FAN_Q_OVERFLOW) {
+                ERR("fanotify queue overflowed, rescanning.");
+                StatusLine::Add("watcherOverflow", 1);
+                overflowed = true;
+                continue;
+            }
+
+            bool isDir = md->mask & FAN_ONDIR;
+            if (isDir && (md->mask & (FAN_MOVED_FROM | FAN_MOVED_TO | FAN_DELETE | FANOTIFY_RENAME_MASK))) {
+                // Cached paths of anything below it are now wrong.
+                this->handleCache.clear();
+            }
+
+            // Each record names a directory handle plus an entry within it. Renames carry two.
+            std::filesystem::path path, from, to;
+            bool named = false;
+            const char *end = reinterpret_cast<const char *>(md) + md->event_len;
+            const char *p = reinterpret_cast<const char *>(md + 1);
+            while (p + sizeof(struct fanotify_event_info_fid) <= end) {
+                const struct fanotify_event_info_fid *info = reinterpret_cast<const struct fanotify_event_info_fid *>(p);
+                if (info->hdr.len == 0) {
+                    break;
+                }
+                p += info->hdr.len;
+
+                std::filesystem::path *target = nullptr;
+                switch (info->hdr.info_type) {
+                case FAN_EVENT_INFO_TYPE_DFID_NAME: target = &path; break;
+#ifdef FAN_RENAME
+                case FAN_EVENT_INFO_TYPE_OLD_DFID_NAME: target = &from; break;
+                case FAN_EVENT_INFO_TYPE_NEW_DFID_NAME: target = &to; break;
+#endif
+                default: continue;
+                }
+                named = true;
+
+                const struct file_handle *handle = reinterpret_cast<const struct file_handle *>(info->handle);
+                const char *name = reinterpret_cast<const char *>(handle->f_handle + handle->handle_bytes);
+
+                std::filesystem::path dir = this->resolveHandle(handle, sizeof(*handle) + handle->handle_bytes);
+                if (!dir.empty()) {
+                    *target = strcmp(name, ".") == 0 ? dir : dir / name;
+                }
+            }
+            if (!named) {
+                continue;
+            }
+
+            if (this->renameEvents && (md->mask & FANOTIFY_RENAME_MASK)) {
+                if (!from.empty() && !to.empty()) {
+                    noteRename(renames, changed, from, to);
+                } else if (!from.empty()) {
+                    // Moved out of root.
+                    changed[from] = changed[from] || false;
+                } else if (!to.empty()) {
+                    // Moved in from elsewhere on the filesystem.
+                    changed[to] = changed[to] || isDir;
+                }
+                continue;
+            }
+            if (this->renameEvents && !(md->mask & ~(FAN_MOVED_FROM | FAN_MOVED_TO | FAN_ONDIR))) {
+                // The matching FAN_RENAME covers it.
+                continue;
+            }
+            if (path.empty()) {
+                continue;
+            }
+
+            // A whole-filesystem mark already covers new directories, but anything moved in
+            // from elsewhere arrives with contents we've never seen.
+            bool isNewDir = isDir && (md->mask & (FAN_CREATE | FAN_MOVED_TO));
+            changed[path] = changed[path] || isNewDir;
+        }
+
+        this->dispatch(renames, changed);
+        if (overflowed) {
+            this->recover();
+        }
+    }
+}
 #else
-Watcher::Watcher(const std::filesystem::path &root, std::function<void (const FileRecord &rec)> callback) { }
+Watcher::Watcher(
+    const std::filesystem::path &root,
+    std::function<void (const FileRecord &rec)> callback,
+    std::function<void (const std::filesystem::path &from, const std::filesystem::path &to)> renameFn,
+    std::function<bool (const std::filesystem::path &)> filterFn,
+    WatcherBackend backend,
+    std::function<void ()> overflowFn
+) { }
 Watcher::~Watcher() { }
 void Watcher::onEvent(const std::filesystem::path& path) { }
 #endif
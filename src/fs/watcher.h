@@ -5,9 +5,12 @@
 #include <condition_variable>
 #include <filesystem>
 #include <functional>
+#include <map>
 #include <memory>
 #include <mutex>
 #include <string>
+#include <thread>
+#include <unordered_map>
 #include <vector>
 
 #include "scanner.h"
@@ -17,18 +20,42 @@
 #include <dispatch/dispatch.h>
 #endif
 
+// Which Linux facility the Watcher uses. Ignored on macOS, which always uses FSEvents.
+enum class WatcherBackend {
+	// One watch per directory. Setup cost and max_user_watches scale with the tree.
+	INOTIFY,
+	// One mark for the whole filesystem, filtered down to the root. Needs CAP_SYS_ADMIN,
+	// and falls back to INOTIFY without it.
+	FANOTIFY
+};
+
 // Watcher monitors the file system for changes.
-// Only supported on macOS, no-op on other platforms.
+// Supported on macOS (FSEvents) and Linux (inotify or fanotify), no-op on other platforms.
 class Watcher {
 public:
 	Watcher() = delete;
-	Watcher(const std::filesystem::path &root, std::function<void (const FileRecord &rec)> callback);
+	Watcher(
+		const std::filesystem::path &root,
+		std::function<void (const FileRecord &rec)> callback,
+		std::function<void (const std::filesystem::path &from, const std::filesystem::path &to)> renameFn,
+		std::function<bool (const std::filesystem::path &)> filterFn,
+		WatcherBackend backend=WatcherBackend::INOTIFY,
+		std::function<void ()> overflowFn=nullptr
+	);
 	~Watcher();
 
 	void onEvent(const std::filesystem::path& path);
 private:
 
 	std::function<void (const FileRecord &rec)> callback;
+	// Called instead of scanning both sides when a rename within root is seen as one event
+	// (Linux only). Whatever is at to should be treated as having been at from.
+	std::function<void (const std::filesystem::path &from, const std::filesystem::path &to)> renameFn;
+	// Excluded paths are neither scanned nor (for inotify) watched.
+	std::function<bool (const std::filesystem::path &)> filterFn;
+	// Called when the kernel dropped events, so that any change may have been missed. Without
+	// one, the whole of root is rescanned through callback.
+	std::function<void ()> overflowFn;
 
     std::atomic<bool> stop_requested{false};
     std::unique_ptr<std::thread> watch_thread;
@@ -37,6 +64,41 @@ private:
     FSEventStreamRef stream;
     dispatch_queue_t queue;
 	dispatch_semaphore_t semaphore = NULL;
+#elif defined(__linux__)
+	bool initFanotify();
+	void initInotify();
+	void runFanotify();
+	void runInotify();
+	// Adds inotify watches for dir and every non-excluded directory below it.
+	void addWatches(const std::filesystem::path &dir);
+	// Drops inotify watches for dir and everything below it, e.g. when it moves away.
+	void removeWatches(const std::filesystem::path &dir);
+	// Repoints inotify watches for from and everything below it at to, when it moves within root.
+	void moveWatches(const std::filesystem::path &from, const std::filesystem::path &to);
+	// Maps a fanotify directory handle to a path, or "" if outside root.
+	std::filesystem::path resolveHandle(const void *handle, size_t len);
+	// After events were dropped: rewatches what needs it and calls overflowFn.
+	void recover();
+	// Hands a batch of events on: renames first, then scans of whatever else changed.
+	void dispatch(
+		const std::vector<std::pair<std::filesystem::path, std::filesystem::path>> &renames,
+		const std::map<std::filesystem::path, bool> &changed
+	);
+
+	std::filesystem::path root;
+	// fanotify reports resolved paths, which may not be spelled like root.
+	std::string canonicalRoot;
+	WatcherBackend backend;
+	int fd = -1;
+	// fanotify only: any fd on the watched filesystem, for open_by_handle_at.
+	int mountFd = -1;
+	// fanotify only: FAN_RENAME is marked, so moves arrive as one event with both ends.
+	bool renameEvents = false;
+	// inotify only: watch descriptor -> directory.
+	std::map<int, std::filesystem::path> watches;
+	bool watchLimitHit = false;
+	// fanotify only: raw directory handle -> path, dropped whenever a directory moves.
+	std::unordered_map<std::string, std::filesystem::path> handleCache;
 #endif
 };
 
@@ -26,6 +26,28 @@ HashT Index::hash(Relpath path) {
 	return this->paths[path].hash;
 }
 
+HashT Index::version(const Relpath &path) {
+	lock_guard<recursive_mutex> lock(this->stateMutex);
+	auto it = this->paths.find(path);
+	return it == this->paths.end() ? NULL_HASH : it->second.version;
+}
+
+Relpath Index::linkSource(const Relpath &path) {
+	lock_guard<recursive_mutex> lock(this->stateMutex);
+	auto it = this->paths.find(path);
+	if (it == this->paths.end() || it->second.inode == 0) {
+		return Relpath();
+	}
+
+	const set<Relpath, LinkOrder> &group = this->links[make_pair(it->second.device, it->second.inode)];
+	return group.size() < 2 ? Relpath() : *group.begin();
+}
+
+vector<Relpath> Index::unreadable() {
+	lock_guard<recursive_mutex> lock(this->stateMutex);
+	return vector<Relpath>(this->unreadablePaths.begin(), this->unreadablePaths.end());
+}
+
 size_t Index::size() {
 	lock_guard<recursive_mutex> lock(this->stateMutex);
 	return this->paths.size();
@@ -47,6 +69,13 @@ void Index::update(const FileRecord &rec) {
 	}
 
 	this->paths[path].type = rec.type;
+	// Rejoined below if it's still linked.
+	this->unlink(path);
+	if (rec.type == FileRecord::Type::DIRECTORY && rec.unreadable) {
+		this->unreadablePaths.insert(path);
+	} else {
+		this->unreadablePaths.erase(path);
+	}
 
 	switch (rec.type) {
 	case FileRecord::Type::DOES_NOT_EXIST:
@@ -72,24 +101,98 @@ void Index::update(const FileRecord &rec) {
 		this->paths[path].version = rec.version;
 		this->paths[path].targetPath = rec.targetPath;  // only used by symlinks
 		this->paths[parent].children.insert(path);
+
+		if (rec.type == FileRecord::Type::FILE) {
+			// Every file, since a later link to it only produces an event for the new name.
+			this->paths[path].device = rec.device;
+			this->paths[path].inode = rec.inode;
+			set<Relpath, LinkOrder> &group = this->links[make_pair(rec.device, rec.inode)];
+			group.insert(path);
+
+			// A write through one link only produces an event for that one. Checking links too
+			// keeps a reused inode from dragging along a path whose removal we haven't seen yet.
+			for (const Relpath &other : group) {
+				if (rec.links > 1 && other != path && this->paths[other].version != rec.version) {
+					this->paths[other].version = rec.version;
+					if (!this->rebuildInProgress) {
+						this->updateHash(other);
+						this->updateAncestorHashes(other);
+					}
+				}
+			}
+		}
 		break;
 	}
 
 	if (this->rebuildInProgress) {
 		// In this case we'll perform an optimized full rebuild after the updates stop coming in.
 	} else {
-		this->updateHash(path);
+		if (rec.type != FileRecord::Type::DOES_NOT_EXIST) {
+			// Otherwise this would bring back the entry we just erased.
+			this->updateHash(path);
+		}
+		this->updateAncestorHashes(path);
+	}
+}
+
+bool Index::rename(const Relpath &from, const Relpath &to) {
+	lock_guard<recursive_mutex> lock(this->stateMutex);
+
+	if (from.empty() || to.empty() || from == to) {
+		return false;
+	}
+	if (this->paths.find(from) == this->paths.end() || this->paths.find(to.parent_path()) == this->paths.end()) {
+		return false;
+	}
+
+	// Whatever the rename replaced is gone.
+	if (this->paths.find(to) != this->paths.end()) {
+		this->update(FileRecord(FileRecord::Type::DOES_NOT_EXIST, NULL_HASH, this->root / to));
+	}
 
-		// Now that index is locally updated, make sure all parents' hashes are updated.
-		list<std::filesystem::path> parents = pathParents(path);
-		// We can rely on pathParents' ordering guarantees (more nested -> less nested).
-		for (auto parent : parents) {
-			this->updateHash(parent);
+	auto rebase = [&from, &to] (const Relpath &path) {
+		return path == from ? to : to / path.lexically_relative(from);
+	};
+
+	list<Relpath> subtree;
+	this->forEach(from, [&subtree] (const Relpath &path, const IndexEntry &entry) {
+		subtree.push_back(path);
+		return true;
+	});
+
+	for (const Relpath &path : subtree) {
+		IndexEntry entry = std::move(this->paths[path]);
+		this->paths.erase(path);
+
+		if (this->unreadablePaths.erase(path) > 0) {
+			this->unreadablePaths.insert(rebase(path));
+		}
+		if (entry.inode != 0) {
+			set<Relpath, LinkOrder> &group = this->links[make_pair(entry.device, entry.inode)];
+			group.erase(path);
+			group.insert(rebase(path));
 		}
 
-		STATUSGLOBAL("H(index)", this->hash());
-		StatusLine::Set("|index|", this->size());
+		set<Relpath> children;
+		for (const Relpath &child : entry.children) {
+			children.insert(rebase(child));
+		}
+		entry.children = std::move(children);
+
+		this->paths[rebase(path)] = std::move(entry);
+	}
+
+	this->paths[from.parent_path()].children.erase(from);
+	this->paths[to.parent_path()].children.insert(to);
+
+	if (!this->rebuildInProgress) {
+		// Paths are part of every hash in the subtree, but versions aren't, so no file is reread.
+		this->rebuildIndex(to);
+		this->updateAncestorHashes(to);
+		this->updateAncestorHashes(from);
 	}
+
+	return true;
 }
 
 void Index::rebuildBlock(std::function<void ()> fn) {
@@ -106,40 +209,163 @@ void Index::rebuildBlock(std::function<void ()> fn) {
 	StatusLine::Set("|index|", this->size());
 }
 
+void Index::setExcludes(HashT fingerprint, function<bool (const Abspath &)> filterFn) {
+	lock_guard<recursive_mutex> lock(this->stateMutex);
+
+	this->excludesFp = fingerprint;
+
+	list<Relpath> excluded;
+	this->forEach(L"", [this, &filterFn, &excluded] (const Relpath &path, const IndexEntry &entry) {
+		if (!path.empty() && !filterFn(this->root / path)) {
+			excluded.push_back(path);
+			// Children go with it.
+			return false;
+		}
+		return true;
+	});
+
+	for (const Relpath &path : excluded) {
+		this->update(FileRecord(FileRecord::Type::DOES_NOT_EXIST, NULL_HASH, this->root / path));
+	}
+
+	if (!this->rebuildInProgress) {
+		this->updateHash(L"");
+		STATUSGLOBAL("H(index)", this->hash());
+	}
+
+	LOG("Excludes " << fingerprint << " dropped " << excluded.size() << " subtrees from the index.");
+}
+
+void Index::retain(const set<Abspath> &seen) {
+	lock_guard<recursive_mutex> lock(this->stateMutex);
+
+	set<Relpath> kept;
+	for (const Abspath &path : seen) {
+		kept.insert(path.lexically_relative(this->root));
+	}
+
+	list<Relpath> gone;
+	this->forEach(L"", [&kept, &gone] (const Relpath &path, const IndexEntry &entry) {
+		if (!path.empty() && path != L"." && kept.count(path) == 0) {
+			gone.push_back(path);
+			// Children go with it.
+			return false;
+		}
+		return true;
+	});
+
+	for (const Relpath &path : gone) {
+		this->update(FileRecord(FileRecord::Type::DOES_NOT_EXIST, NULL_HASH, this->root / path));
+	}
+
+	LOG("Rescan dropped " << gone.size() << " subtrees from the index.");
+}
+
+HashT Index::excludesFingerprint() {
+	lock_guard<recursive_mutex> lock(this->stateMutex);
+	return this->excludesFp;
+}
+
 void Index::diff(
 	function<deque<Relpath> (const deque<Relpath> &)> oracleFn,
-	function<void (const PolicyFile &)> emitFn
+	function<void (const PolicyFile &)> emitFn,
+	function<size_t (size_t, size_t)> lookaheadFn,
+	function<map<Relpath, vector<Relpath>> (const vector<Relpath> &)> reconcileFn,
+	DiffProgress *progress
 ) {
 	lock_guard<recursive_mutex> lock(this->stateMutex);
 
+	DiffProgress local;
+	if (progress == nullptr) {
+		progress = &local;
+	}
+	if (progress->hash != this->hash()) {
+		*progress = DiffProgress();
+		progress->hash = this->hash();
+	}
+
 	deque<Relpath> seen;
 	deque<Relpath> processing;
-
-	seen.push_back(L"");
+	// Answers to speculative queries, true if the path differs, kept until its level comes up.
+	map<Relpath, bool> &ahead = progress->ahead;
+	// Children that reconcileFn found to differ, which need no asking.
+	set<Relpath> &reconciled = progress->reconciled;
+	size_t speculated = 0;
+	size_t used = 0;
+
+	if (progress->level.empty()) {
+		seen.push_back(L"");
+	} else {
+		LOG("Resuming diff at " << progress->level.size() << " paths, " << progress->answered.size() << " of them answered.");
+		seen = progress->level;
+		ahead.insert(progress->answered.begin(), progress->answered.end());
+	}
 
 	// For each level
 	while (!seen.empty()) {
-		std::map<Relpath, int> tests; // 1 if diff was EQUIVALENT, 0 if diff was DIFFERENT
-		for (Relpath path : seen) {
-			tests[path]++;
+		progress->level = seen;
+		progress->answered.clear();
+
+		deque<Relpath> queries;
+		for (const Relpath &path : seen) {
+			if (ahead.count(path) == 0 && reconciled.count(path) == 0) {
+				queries.push_back(path);
+			}
 		}
 
-		// We need to filter seen to only contain paths that failed diff.
-		seen = oracleFn(seen);
+		// Paths that failed diff this round. If the last round's speculation answered every
+		// path on this level, there's no round to make.
+		set<Relpath> different;
+		if (!queries.empty()) {
+			size_t asked = queries.size();
+			size_t lookahead = lookaheadFn ? lookaheadFn(speculated, used) : 0;
+			speculated = 0;
+			used = 0;
+			for (size_t i = 0; i < queries.size() && speculated < lookahead; i++) {
+				const set<Relpath> &children = this->paths[queries[i]].children;
+				if (reconcileFn && children.size() >= RECONCILE_MIN_CHILDREN) {
+					// Reconciled instead, should it differ.
+					continue;
+				}
+				for (const Relpath &childKey : children) {
+					if (speculated == lookahead) {
+						break;
+					}
+					queries.push_back(childKey);
+					speculated++;
+				}
+			}
 
-		for (Relpath path : seen) {
-			tests[path]--;
+			for (Relpath path : oracleFn(queries)) {
+				different.insert(path);
+			}
+			for (size_t i = asked; i < queries.size(); i++) {
+				ahead[queries[i]] = different.count(queries[i]) > 0;
+			}
 		}
-		
-		for (const auto& [path, val] : tests) {
-			if (val == 0) {
-				// diff is DIFFERENT
+
+		for (const Relpath &path : seen) {
+			bool differs;
+			auto search = ahead.find(path);
+			if (reconciled.erase(path) > 0) {
+				differs = true;
+			} else if (search != ahead.end()) {
+				differs = search->second;
+				ahead.erase(search);
+				used++;
+			} else {
+				differs = different.count(path) > 0;
+			}
+
+			if (differs) {
 				this->repeatOffenders[path]++;
+				// We need to filter seen to only contain paths that failed diff.
+				processing.push_back(path);
 			} else {
-				// diff is EQUIVALENT
 				this->repeatOffenders.erase(path);
 			}
 		}
+		seen.clear();
 
 		for (const auto& [path, val] : this->repeatOffenders) {
 			if (val == 10) {
@@ -147,23 +373,51 @@ void Index::diff(
 			}
 		}
 
-		// processing is empty
-		swap(processing, seen);
-		// now seen is empty, processing is full
-
 		// For each item of said level
+		vector<Relpath> bigDirs;
 		for (; !processing.empty(); processing.pop_front()) {
 			Relpath path = processing.front();
 			
 			PolicyFile policyFile = { path, this->paths[path].targetPath, this->paths[path].type };
+			policyFile.linkTo = this->linkSource(path);
+			policyFile.version = this->paths[path].version;
 			emitFn(policyFile);
 
+			const set<Relpath> &children = this->paths[path].children;
+			if (reconcileFn && children.size() >= RECONCILE_MIN_CHILDREN) {
+				bigDirs.push_back(path);
+				continue;
+			}
+
 			// Push each child
-			for (Relpath childKey : this->paths[path].children) {
+			for (Relpath childKey : children) {
 				seen.push_back(childKey);
 			}
 		}
+
+		if (!bigDirs.empty()) {
+			map<Relpath, vector<Relpath>> different = reconcileFn(bigDirs);
+			for (const Relpath &path : bigDirs) {
+				auto search = different.find(path);
+				if (search == different.end()) {
+					for (Relpath childKey : this->paths[path].children) {
+						seen.push_back(childKey);
+					}
+					continue;
+				}
+				for (const Relpath &childKey : search->second) {
+					seen.push_back(childKey);
+					reconciled.insert(childKey);
+				}
+			}
+		}
 	}
+
+	*progress = DiffProgress();
+}
+
+uint64_t Index::ReconcileKey(const Relpath &child) {
+	return HashString(child.filename().string());
 }
 
 void Index::setEpoch(const Relpath &path, uint64_t epoch) {
@@ -171,6 +425,14 @@ void Index::setEpoch(const Relpath &path, uint64_t epoch) {
 	this->paths[path].epoch = epoch;
 }
 
+HashT Index::expect(const Relpath &path, uint64_t epoch, HashT expectedHash) {
+	lock_guard<recursive_mutex> lock(this->stateMutex);
+	IndexEntry &entry = this->paths[path];
+	entry.epoch = epoch;
+	entry.expectedHash = expectedHash;
+	return entry.hash;
+}
+
 void Index::setExpectedHash(const Relpath &path, HashT expectedHash) {
 	lock_guard<recursive_mutex> lock(this->stateMutex);
 	this->paths[path].expectedHash = expectedHash;
@@ -181,10 +443,61 @@ HashT Index::expectedHash(const Relpath &path) {
 	return this->paths[path].expectedHash;
 }
 
-list<Relpath> Index::commit(uint64_t epoch) {
+bool Index::reconcile(const Relpath &dir, uint64_t epoch, Iblt &sketch, vector<uint64_t> &different) {
+	lock_guard<recursive_mutex> lock(this->stateMutex);
+	auto search = this->paths.find(dir);
+	if (search == this->paths.end()) {
+		return false;
+	}
+
+	Iblt ours(sketch.size());
+	map<uint64_t, Relpath> byKey;
+	for (const Relpath &childKey : search->second.children) {
+		uint64_t key = ReconcileKey(childKey);
+		if (!byKey.emplace(key, childKey).second) {
+			// Two names with one key can't be told apart.
+			return false;
+		}
+		ours.insert(key, this->paths[childKey].hash);
+	}
+
+	vector<pair<uint64_t, uint64_t>> theirsOnly, oursOnly;
+	sketch.subtract(ours);
+	if (!sketch.decode(theirsOnly, oursOnly)) {
+		return false;
+	}
+
+	map<uint64_t, HashT> expected;
+	for (const auto &[key, hash] : theirsOnly) {
+		expected[key] = hash;
+		different.push_back(key);
+	}
+	set<uint64_t> stale;
+	for (const auto &[key, hash] : oursOnly) {
+		stale.insert(key);
+	}
+	for (const auto &[key, childKey] : byKey) {
+		IndexEntry &entry = this->paths[childKey];
+		auto theirs = expected.find(key);
+		if (theirs != expected.end()) {
+			entry.epoch = epoch;
+			entry.expectedHash = theirs->second;
+		} else if (stale.count(key) == 0) {
+			entry.epoch = epoch;
+			entry.expectedHash = entry.hash;
+		}
+		// Otherwise the primary doesn't have it, and commit deletes it.
+	}
+	return true;
+}
+
+list<Relpath> Index::commit(uint64_t epoch, const set<Relpath> &keep) {
 	lock_guard<recursive_mutex> lock(this->stateMutex);
 	list<Relpath> result;
-	this->forEach(L"", [epoch,&result] (const Relpath &path, const IndexEntry &entry) {
+	this->forEach(L"", [epoch,&result,&keep] (const Relpath &path, const IndexEntry &entry) {
+		if (keep.count(path) > 0) {
+			return false;
+		}
 		if (entry.epoch == epoch && entry.expectedHash == entry.hash) {
 			// This node was a match, so all its descendants are fine.
 			return false;
@@ -232,6 +545,9 @@ void Index::rebuildIndex(const Relpath &path) {
 
 	result = hashCombine(result, path);
 	result = hashCombine(result, this->paths[path].version);
+	if (path.empty() && this->excludesFp != NULL_HASH) {
+		result = hashCombine(result, this->excludesFp);
+	}
 
 	for (Relpath childKey : this->paths[path].children) {
 		this->rebuildIndex(childKey);
@@ -243,6 +559,44 @@ void Index::rebuildIndex(const Relpath &path) {
 	this->paths[path].hash = result;
 }
 
+bool Index::LinkOrder::operator()(const Relpath &lhs, const Relpath &rhs) const {
+	auto lhsDepth = distance(lhs.begin(), lhs.end());
+	auto rhsDepth = distance(rhs.begin(), rhs.end());
+	return lhsDepth < rhsDepth || (lhsDepth == rhsDepth && lhs < rhs);
+}
+
+void Index::unlink(const Relpath &path) {
+	// Pre-condition: we assume that a lock has already been captured by the caller.
+
+	IndexEntry &entry = this->paths[path];
+	if (entry.inode == 0) {
+		return;
+	}
+
+	auto key = make_pair(entry.device, entry.inode);
+	this->links[key].erase(path);
+	if (this->links[key].empty()) {
+		this->links.erase(key);
+	}
+	entry.device = 0;
+	entry.inode = 0;
+}
+
+void Index::updateAncestorHashes(const Relpath &path) {
+	// Pre-condition: we assume that a lock has already been captured by the caller.
+
+	list<std::filesystem::path> parents = pathParents(path);
+	// We can rely on pathParents' ordering guarantees (more nested -> less nested).
+	for (auto parent : parents) {
+		this->updateHash(parent);
+	}
+	// pathParents stops short of the root, whose hash is what replicas get compared on.
+	this->updateHash(L"");
+
+	STATUSGLOBAL("H(index)", this->hash());
+	StatusLine::Set("|index|", this->size());
+}
+
 void Index::updateHash(const Relpath &path) {
 	// Pre-condition: we assume that a lock has already been captured by the caller.
 	// Update a path's hash based on descendants' hashes.
@@ -254,6 +608,9 @@ void Index::updateHash(const Relpath &path) {
 
 	result = hashCombine(result, path);
 	result = hashCombine(result, this->paths[path].version);
+	if (path.empty() && this->excludesFp != NULL_HASH) {
+		result = hashCombine(result, this->excludesFp);
+	}
 
 	for (Relpath childKey : this->paths[path].children) {
 		result = hashCombine(result, childKey);
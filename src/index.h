@@ -10,9 +10,11 @@
 #include <mutex>
 #include <set>
 #include <string>
+#include <vector>
 
 #include "fs/scanner.h"
 #include "process/policy/policy.h"
+#include "util/iblt.h"
 
 class Index {
 	struct IndexEntry {
@@ -22,6 +24,9 @@ class Index {
 		HashT version = 0;
 		std::set<Relpath> children;
 		std::filesystem::path targetPath;  // for symlinks
+		// For files, 0 otherwise.
+		uint64_t device = 0;
+		uint64_t inode = 0;
 
 		// Merkle tree node value
 		HashT hash;
@@ -34,27 +39,86 @@ class Index {
 	};
 
 public:
+	// Where a diff had got to, so that one cut short can pick up from there. Everything above
+	// level has been asked about, and what differed emitted.
+	struct DiffProgress {
+		// The index's hash when the diff started. Progress against any other is thrown away.
+		HashT hash = 0;
+		// Paths the next round asks about. Empty if the diff hasn't started, or has finished.
+		std::deque<Relpath> level;
+		// Answers to speculative queries, true if the path differs.
+		std::map<Relpath, bool> ahead;
+		// Paths on level that reconciling their parents found to differ.
+		std::set<Relpath> reconciled;
+		// For oracleFn to fill in as answers come, so that a round cut short needn't ask
+		// again what it already has. Cleared at the start of each round.
+		std::map<Relpath, bool> answered;
+	};
+
 	Index() = delete;
 	Index(const Abspath &root);
 	void update(const FileRecord &rec);
+	// Moves an indexed subtree without rescanning it. Returns false if from isn't indexed
+	// (or to's parent isn't), in which case the caller should scan to instead.
+	bool rename(const Relpath &from, const Relpath &to);
 	HashT hash(Relpath path=L"");
+	// Content hash of a file, or NULL_HASH if path isn't indexed.
+	HashT version(const Relpath &path);
+	// The first indexed path that is a hard link to the same file as path, which may be path
+	// itself. Empty if path has no other indexed links.
+	Relpath linkSource(const Relpath &path);
+	// Directories whose last scan couldn't list them, so their indexed children may be missing.
+	std::vector<Relpath> unreadable();
 	size_t size();
 	~Index();
 
 	// For optimized full rebuild
 	void rebuildBlock(std::function<void ()> fn);
-	// For diffing two indexes
+	// Drops entries that filterFn rejects, and folds the exclusion set's fingerprint into
+	// the root hash so that indexes built with different excludes never look equal.
+	void setExcludes(HashT fingerprint, std::function<bool (const Abspath &)> filterFn);
+	HashT excludesFingerprint();
+	// Drops every indexed path that isn't in seen, e.g. after a rescan on top of what's
+	// indexed, which only reports what still exists.
+	void retain(const std::set<Abspath> &seen);
+	// For diffing two indexes. Goes a level per round: oracleFn is asked about the paths whose
+	// parents were found to differ, and returns those that differ too. It is also asked about
+	// up to lookaheadFn(speculated, used) of their descendants, breadth-first, so that changes
+	// deep down take fewer rounds to reach. speculated and used say how many such queries the
+	// last round asked, and how many have been needed since.
+	//
+	// Directories with at least RECONCILE_MIN_CHILDREN children that differ go to reconcileFn
+	// instead, which returns the children that differ of each it could compare in one go. The
+	// rest have their children asked about one by one.
+	//
+	// If progress is given, the diff carries on from it and keeps it up to date, so that when
+	// one of the functions throws it can be passed to the next diff against the same replica.
 	void diff(
 		std::function<std::deque<Relpath> (const std::deque<Relpath> &)> oracleFn,
-		std::function<void (const PolicyFile &)> emitFn
+		std::function<void (const PolicyFile &)> emitFn,
+		std::function<size_t (size_t speculated, size_t used)> lookaheadFn = nullptr,
+		std::function<std::map<Relpath, std::vector<Relpath>> (const std::vector<Relpath> &)> reconcileFn = nullptr,
+		DiffProgress *progress = nullptr
 	);
+	static const size_t RECONCILE_MIN_CHILDREN = 4096;
+	// What reconciliation knows a child by: HashString of its name.
+	static uint64_t ReconcileKey(const Relpath &child);
 
 	/////////////////////////////////
 	// Used by replica for diffing //
 	/////////////////////////////////
 	void setEpoch(const Relpath &path, uint64_t epoch);
-	// returns list of files to delete
-	std::list<Abspath> commit(uint64_t epoch);
+	// The primary has path at expectedHash as of epoch. Does what setEpoch, setExpectedHash
+	// and hash would, with one lookup, and returns our hash for path.
+	HashT expect(const Relpath &path, uint64_t epoch, HashT expectedHash);
+	// The primary has dir's children at the (ReconcileKey, hash) pairs in sketch, as of epoch.
+	// If what's left of sketch once ours are taken away decodes, expects each child we have at
+	// the primary's hash, or at ours if it's the same, and fills different with the keys of the
+	// primary's children we don't have at its hash. Otherwise returns false.
+	bool reconcile(const Relpath &dir, uint64_t epoch, Iblt &sketch, std::vector<uint64_t> &different);
+	// returns list of files to delete. Nothing under keep is, since the primary couldn't say
+	// what's in those.
+	std::list<Abspath> commit(uint64_t epoch, const std::set<Relpath> &keep = {});
 
 
 	//////////////////////////////
@@ -67,8 +131,12 @@ public:
 private:
 	// Update Merkle tree upward from path.
 	void updateHash(const Relpath &path);
+	// Update hashes of path's ancestors, up to and including the root.
+	void updateAncestorHashes(const Relpath &path);
 	// Optimized full index rebuild, for use after updateDefer.
 	void rebuildIndex(const Relpath &path);
+	// Drops path from the group of hard links it's in, if any.
+	void unlink(const Relpath &path);
 
 	// Traversal function returns false to prevent recursion into a branch.
 	void forEach(
@@ -78,8 +146,16 @@ private:
 
 	Abspath root;
 	std::map<Relpath, IndexEntry> paths;
+	// Shallowest first, the order diff() visits them in, so that linkSource is sent first.
+	struct LinkOrder {
+		bool operator()(const Relpath &lhs, const Relpath &rhs) const;
+	};
+	// (device, inode) -> paths, for every indexed file. Links are the groups with more than one.
+	std::map<std::pair<uint64_t, uint64_t>, std::set<Relpath, LinkOrder>> links;
+	std::set<Relpath> unreadablePaths;
 	std::recursive_mutex stateMutex;
 	bool rebuildInProgress = false;
+	HashT excludesFp = 0;
 	std::map<Relpath, int> repeatOffenders;
     //leveldb::DB* db;
 };
@@ -0,0 +1,74 @@
+#include "journal.h"
+
+#include <map>
+#include <random>
+
+using namespace std;
+
+namespace {
+	uint64_t randomId() {
+		random_device rd;
+		uint64_t result = 0;
+		while (result == 0) {
+			// 0 is what replicas report before they've heard of any journal.
+			result = (static_cast<uint64_t>(rd()) << 32) | rd();
+		}
+		return result;
+	}
+}
+
+ChangeJournal::ChangeJournal(size_t capacity) : journalId(randomId()), capacity(capacity) {
+}
+
+uint64_t ChangeJournal::append(const PolicyFile &file) {
+	lock_guard<mutex> lock(this->m);
+
+	uint64_t seq = this->nextSeq++;
+	this->entries.push_back({ seq, file });
+	this->entries.back().file.seq = seq;
+	if (this->entries.size() > this->capacity) {
+		this->entries.pop_front();
+	}
+	return seq;
+}
+
+bool ChangeJournal::since(uint64_t seq, function<void (const PolicyFile &)> fn) {
+	lock_guard<mutex> lock(this->m);
+
+	uint64_t firstSeq = this->entries.empty() ? this->nextSeq : this->entries.front().seq;
+	if (seq + 1 < firstSeq) {
+		return false;
+	}
+
+	// A file saved 100 times while the replica was away only needs sending once.
+	map<Relpath, size_t> latest;
+	for (size_t i = 0; i < this->entries.size(); i++) {
+		if (this->entries[i].seq > seq) {
+			latest[this->entries[i].file.path] = i;
+		}
+	}
+
+	for (size_t i = 0; i < this->entries.size(); i++) {
+		const Entry &entry = this->entries[i];
+		// A rename also takes its source away, which a later change to its destination
+		// doesn't, so it's always sent.
+		bool rename = !entry.file.renamedFrom.empty();
+		if (entry.seq > seq && (rename || latest[entry.file.path] == i)) {
+			fn(entry.file);
+		}
+	}
+	return true;
+}
+
+void ChangeJournal::reset() {
+	lock_guard<mutex> lock(this->m);
+
+	this->entries.clear();
+	// Skipped, so that even replicas that were all caught up can't reach back past here.
+	this->nextSeq++;
+}
+
+uint64_t ChangeJournal::lastSeq() {
+	lock_guard<mutex> lock(this->m);
+	return this->nextSeq - 1;
+}
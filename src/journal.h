@@ -0,0 +1,55 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+
+#include "process/policy/policy.h"
+
+/**
+ * ChangeJournal remembers the last N changes the primary sent out, numbered 1, 2, 3...
+ *
+ * Replicas are told how far along the journal they've applied, and report it back. A
+ * replica that missed some changes can then be sent just those, instead of going through a
+ * full Merkle diff. Once a replica falls further behind than the journal reaches, or the
+ * journal it knows about is from a previous run of the primary, it's back to diffing.
+ *
+ * The journal lives in memory only. A primary always rescans and diffs after starting up,
+ * since it can't know what changed while it wasn't watching.
+ */
+class ChangeJournal {
+	struct Entry {
+		uint64_t seq;
+		PolicyFile file;
+	};
+
+public:
+	static const size_t DEFAULT_CAPACITY = 64 * 1024;
+
+	ChangeJournal(size_t capacity=DEFAULT_CAPACITY);
+
+	// Records a change, returning its sequence number.
+	uint64_t append(const PolicyFile &file);
+	// Calls fn for each rename after seq and the latest change to each path after seq, oldest
+	// first, with file.seq set.
+	// Returns false without calling fn if changes after seq have already been dropped.
+	bool since(uint64_t seq, std::function<void (const PolicyFile &)> fn);
+	// Forgets everything so far, e.g. when the watcher dropped changes that never made it in
+	// here, so that every replica diffs instead of replaying.
+	void reset();
+
+	// Random per run, so that sequence numbers from a previous run are never mistaken for ours.
+	uint64_t id() const { return this->journalId; }
+	uint64_t lastSeq();
+
+private:
+	const uint64_t journalId;
+	const size_t capacity;
+	std::deque<Entry> entries;
+	uint64_t nextSeq = 1;
+	std::mutex m;
+};
+
+#endif
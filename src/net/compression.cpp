@@ -0,0 +1,325 @@
+#include "compression.h"
+
+#include <cmath>
+#include <initializer_list>
+#include <cstring>
+#include <stdexcept>
+#include <snappy.h>
+
+#ifdef SYNC_WITH_LZ4
+#include <lz4.h>
+#endif
+#ifdef SYNC_WITH_ZSTD
+#include <zstd.h>
+#endif
+
+#include "../util/log.h"
+
+using namespace std;
+
+namespace {
+	bool forced = false;
+	Codec forcedCodec = Codec::SNAPPY;
+	int zstdLevel = 1;
+
+	// Frames smaller than this go out as they are, since codec overhead would eat any gain.
+	const size_t MIN_COMPRESS_LENGTH = 128;
+	// One in this many frames tries the least-measured codec instead of the best one.
+	const uint64_t EXPLORE_EVERY = 64;
+	// A send that takes at least this long was held up by the link, not by us.
+	const double BLOCKED_SEND_SECONDS = 0.001;
+	// This many sends in a row without blocking, and the link is considered not to be the
+	// bottleneck at all.
+	const uint64_t UNBLOCKED_SENDS_FOR_FAST_LINK = 256;
+	const double EWMA_WEIGHT = 0.1;
+
+	void ewma(double &avg, double sample, uint64_t samples) {
+		avg = samples == 0 ? sample : avg + EWMA_WEIGHT * (sample - avg);
+	}
+}
+
+std::ostream& operator<<(std::ostream &os, Codec codec) {
+	switch (codec) {
+	case Codec::NONE:   return os << "none";
+	case Codec::SNAPPY: return os << "snappy";
+	case Codec::LZ4:    return os << "lz4";
+	case Codec::ZSTD:   return os << "zstd";
+	}
+	return os;
+}
+
+bool codecAvailable(Codec codec) {
+	switch (codec) {
+	case Codec::NONE:
+	case Codec::SNAPPY:
+		return true;
+	case Codec::LZ4:
+#ifdef SYNC_WITH_LZ4
+		return true;
+#else
+		return false;
+#endif
+	case Codec::ZSTD:
+#ifdef SYNC_WITH_ZSTD
+		return true;
+#else
+		return false;
+#endif
+	}
+	return false;
+}
+
+uint8_t availableCodecs() {
+	uint8_t result = 0;
+	for (Codec codec : { Codec::NONE, Codec::SNAPPY, Codec::LZ4, Codec::ZSTD }) {
+		if (codecAvailable(codec)) {
+			result |= 1 << int(codec);
+		}
+	}
+	return result;
+}
+
+size_t maxCompressedLength(Codec codec, size_t length) {
+	switch (codec) {
+	case Codec::NONE:
+		return length;
+	case Codec::SNAPPY:
+		return snappy::MaxCompressedLength(length);
+#ifdef SYNC_WITH_LZ4
+	case Codec::LZ4:
+		return LZ4_compressBound(length);
+#endif
+#ifdef SYNC_WITH_ZSTD
+	case Codec::ZSTD:
+		return ZSTD_compressBound(length);
+#endif
+	default:
+		break;
+	}
+	throw invalid_argument("Codec not available in this build.");
+}
+
+size_t compress(Codec codec, int level, const char *in, size_t length, char *out) {
+	switch (codec) {
+	case Codec::NONE:
+		memcpy(out, in, length);
+		return length;
+	case Codec::SNAPPY: {
+		size_t result;
+		snappy::RawCompress(in, length, out, &result);
+		return result;
+	}
+#ifdef SYNC_WITH_LZ4
+	case Codec::LZ4: {
+		int result = LZ4_compress_default(in, out, length, LZ4_compressBound(length));
+		if (result <= 0) {
+			throw runtime_error("lz4 compression failed.");
+		}
+		return result;
+	}
+#endif
+#ifdef SYNC_WITH_ZSTD
+	case Codec::ZSTD: {
+		// Contexts are expensive to set up, and each thread has its own sockets.
+		thread_local unique_ptr<ZSTD_CCtx, size_t (*)(ZSTD_CCtx*)> ctx(ZSTD_createCCtx(), ZSTD_freeCCtx);
+		size_t result = ZSTD_compressCCtx(ctx.get(), out, ZSTD_compressBound(length), in, length, level);
+		if (ZSTD_isError(result)) {
+			throw runtime_error(string("zstd compression failed: ") + ZSTD_getErrorName(result));
+		}
+		return result;
+	}
+#endif
+	default:
+		break;
+	}
+	throw invalid_argument("Codec not available in this build.");
+}
+
+void decompress(Codec codec, const char *in, size_t length, char *out, size_t rawLength) {
+	switch (codec) {
+	case Codec::NONE:
+		if (length != rawLength) {
+			throw runtime_error("Uncompressed frame has the wrong length.");
+		}
+		memcpy(out, in, length);
+		return;
+	case Codec::SNAPPY: {
+		size_t actual;
+		if (!snappy::GetUncompressedLength(in, length, &actual) || actual != rawLength ||
+			!snappy::RawUncompress(in, length, out)) {
+			throw runtime_error("snappy decompression of packet failed.");
+		}
+		return;
+	}
+#ifdef SYNC_WITH_LZ4
+	case Codec::LZ4:
+		if (LZ4_decompress_safe(in, out, length, rawLength) != static_cast<int>(rawLength)) {
+			throw runtime_error("lz4 decompression of packet failed.");
+		}
+		return;
+#endif
+#ifdef SYNC_WITH_ZSTD
+	case Codec::ZSTD: {
+		thread_local unique_ptr<ZSTD_DCtx, size_t (*)(ZSTD_DCtx*)> ctx(ZSTD_createDCtx(), ZSTD_freeDCtx);
+		size_t result = ZSTD_decompressDCtx(ctx.get(), out, rawLength, in, length);
+		if (ZSTD_isError(result) || result != rawLength) {
+			throw runtime_error("zstd decompression of packet failed.");
+		}
+		return;
+	}
+#endif
+	default:
+		break;
+	}
+	throw runtime_error("Packet uses a codec not available in this build.");
+}
+
+bool looksIncompressible(const char *data, size_t length) {
+	// A few contiguous windows, since that's where compressors find their matches.
+	const size_t WINDOWS = 4, WINDOW_SIZE = 512;
+	if (length < WINDOWS * WINDOW_SIZE) {
+		return false;
+	}
+
+	uint32_t counts[256] = {};
+	for (size_t w = 0; w < WINDOWS; w++) {
+		const uint8_t *window = reinterpret_cast<const uint8_t*>(data) + (length - WINDOW_SIZE) * w / (WINDOWS - 1);
+		for (size_t i = 0; i < WINDOW_SIZE; i++) {
+			counts[window[i]]++;
+		}
+	}
+
+	double entropy = 0;
+	const double n = WINDOWS * WINDOW_SIZE;
+	for (uint32_t count : counts) {
+		if (count) {
+			double p = count / n;
+			entropy -= p * log2(p);
+		}
+	}
+	// Random bytes come out around 7.9 bits over a sample this size, and text around 5.
+	return entropy > 7.5;
+}
+
+
+///////////////////////
+// CompressionPolicy //
+///////////////////////
+
+void CompressionPolicy::Configure(const string &spec) {
+	string name = spec.substr(0, spec.find(':'));
+	if (name == "auto") {
+		forced = false;
+	} else if (name == "none") {
+		forced = true;
+		forcedCodec = Codec::NONE;
+	} else if (name == "snappy") {
+		forced = true;
+		forcedCodec = Codec::SNAPPY;
+	} else if (name == "lz4") {
+		forced = true;
+		forcedCodec = Codec::LZ4;
+	} else if (name == "zstd") {
+		forced = true;
+		forcedCodec = Codec::ZSTD;
+	} else {
+		throw invalid_argument("Unknown compression " + spec);
+	}
+
+	if (spec.find(':') != string::npos) {
+		if (name != "zstd") {
+			throw invalid_argument("Only zstd takes a level: " + spec);
+		}
+		zstdLevel = stoi(spec.substr(spec.find(':') + 1));
+	}
+	if (forced && !codecAvailable(forcedCodec)) {
+		throw invalid_argument("Compression " + name + " is not available in this build.");
+	}
+}
+
+Codec CompressionPolicy::choose(const char *data, size_t length, int *level) {
+	*level = zstdLevel;
+	this->frames++;
+
+	if (length < MIN_COMPRESS_LENGTH) {
+		return Codec::NONE;
+	}
+
+	Codec codec = forced ? forcedCodec : this->pick();
+	if (!this->usable(codec)) {
+		// Forced, but the other end was built without it.
+		StatusLine::Add("compressFallbacks", 1);
+		codec = Codec::SNAPPY;
+	}
+	// Only worth sampling the data if we'd otherwise spend time compressing it.
+	if (codec != Codec::NONE && looksIncompressible(data, length)) {
+		StatusLine::Add("compressSkipped", 1);
+		return Codec::NONE;
+	}
+	return codec;
+}
+
+void CompressionPolicy::setPeerCodecs(uint8_t codecs) {
+	this->peerCodecs = codecs;
+}
+
+bool CompressionPolicy::usable(Codec codec) const {
+	return codecAvailable(codec) && (this->peerCodecs & (1 << int(codec))) != 0;
+}
+
+Codec CompressionPolicy::pick() const {
+	bool fastLink = this->unblockedSends >= UNBLOCKED_SENDS_FOR_FAST_LINK;
+	if (this->linkBytesPerSecond == 0 && !fastLink) {
+		return Codec::SNAPPY;
+	}
+
+	Codec candidates[] = { Codec::SNAPPY, Codec::LZ4, Codec::ZSTD };
+
+	if (this->frames % EXPLORE_EVERY == 0) {
+		Codec least = Codec::SNAPPY;
+		for (Codec codec : candidates) {
+			if (this->usable(codec) && this->stats[int(codec)].samples < this->stats[int(least)].samples) {
+				least = codec;
+			}
+		}
+		return least;
+	}
+
+	// Seconds per raw byte, from CPU and from the wire. A link that keeps up costs nothing.
+	double wire = fastLink ? 0 : 1.0 / this->linkBytesPerSecond;
+	Codec best = Codec::NONE;
+	double bestCost = wire;
+	for (Codec codec : candidates) {
+		const CodecStats &stats = this->stats[int(codec)];
+		if (!this->usable(codec) || stats.samples == 0) {
+			continue;
+		}
+		double cost = stats.secondsPerByte + stats.ratio * wire;
+		if (cost < bestCost) {
+			best = codec;
+			bestCost = cost;
+		}
+	}
+	return best;
+}
+
+void CompressionPolicy::recordCompression(Codec codec, size_t length, size_t compressedLength, double seconds) {
+	CodecStats &stats = this->stats[int(codec)];
+	ewma(stats.ratio, static_cast<double>(compressedLength) / length, stats.samples);
+	ewma(stats.secondsPerByte, seconds / length, stats.samples);
+	stats.samples++;
+
+	StatusLine::Add("compressIn", length);
+	StatusLine::Add("compressOut", compressedLength);
+	StatusLine::Add("compressMicros", static_cast<uint64_t>(seconds * 1e6));
+}
+
+void CompressionPolicy::recordSend(size_t length, double seconds) {
+	if (seconds < BLOCKED_SEND_SECONDS) {
+		this->unblockedSends++;
+		return;
+	}
+
+	ewma(this->linkBytesPerSecond, length / seconds, this->linkBytesPerSecond == 0 ? 0 : 1);
+	this->unblockedSends = 0;
+}
@@ -0,0 +1,79 @@
+#ifndef NET_COMPRESSION_H
+#define NET_COMPRESSION_H
+
+#include <atomic>
+#include <cstdint>
+#include <ostream>
+#include <string>
+
+// How a frame's payload is compressed. Each frame says which it used, and which its sender
+// can decode, so that neither end sends the other a codec it was built without.
+// LZ4 and ZSTD are only available when built with WITH_LZ4=1 / WITH_ZSTD=1.
+enum class Codec : uint8_t {
+	NONE   = 0,
+	SNAPPY = 1,
+	LZ4    = 2,
+	ZSTD   = 3
+};
+
+std::ostream& operator<<(std::ostream &os, Codec codec);
+
+bool codecAvailable(Codec codec);
+// 1 << codec for each codec available in this build.
+uint8_t availableCodecs();
+size_t maxCompressedLength(Codec codec, size_t length);
+// Compresses into out, which must have room for maxCompressedLength bytes. Returns the
+// compressed size. level only matters for ZSTD.
+size_t compress(Codec codec, int level, const char *in, size_t length, char *out);
+// Decompresses exactly rawLength bytes into out, or throws if the input doesn't hold that.
+void decompress(Codec codec, const char *in, size_t length, char *out, size_t rawLength);
+// Estimates from a sample whether data is already compressed or random, so that no codec
+// would get anything out of it.
+bool looksIncompressible(const char *data, size_t length);
+
+/**
+ * Picks the codec for each frame sent over one connection.
+ *
+ * Frames that look incompressible are sent as they are. Otherwise the choice is whatever
+ * minimizes the time to compress plus the time to put the result on the wire, going by the
+ * measured cost and ratio of each codec and by how fast the link drains. Until the link has
+ * been seen to be the bottleneck, it's snappy, as it always used to be.
+ */
+class CompressionPolicy {
+public:
+	// "auto" (the default), "none", "snappy", "lz4", "zstd" or "zstd:<level>". Affects every
+	// connection, so it's set once at startup. Throws invalid_argument on anything else.
+	static void Configure(const std::string &spec);
+
+	// Picks a codec for a frame, and the level to use it at.
+	Codec choose(const char *data, size_t length, int *level);
+	// From each frame received, which may be on another thread than the one sending.
+	void setPeerCodecs(uint8_t codecs);
+	void recordCompression(Codec codec, size_t length, size_t compressedLength, double seconds);
+	void recordSend(size_t length, double seconds);
+
+private:
+	// What the measurements so far say is cheapest, before looking at the data itself.
+	Codec pick() const;
+	// Available here and at the other end.
+	bool usable(Codec codec) const;
+
+	struct CodecStats {
+		// EWMAs, with a pessimistic start so that an unmeasured codec isn't picked on paper.
+		double ratio = 1.0;
+		double secondsPerByte = 0;
+		uint64_t samples = 0;
+	};
+
+	static const int CODECS = 4;
+	CodecStats stats[CODECS];
+	// EWMA of how fast sends drain when they block; 0 until one has.
+	double linkBytesPerSecond = 0;
+	// Sends since one last blocked. Many in a row mean the link is keeping up with us.
+	uint64_t unblockedSends = 0;
+	uint64_t frames = 0;
+	// Until the other end has said otherwise, only what every build has.
+	std::atomic<uint8_t> peerCodecs{ (1 << int(Codec::NONE)) | (1 << int(Codec::SNAPPY)) };
+};
+
+#endif
@@ -49,4 +49,6 @@ void InetClient::attemptConnect(struct addrinfo *p) {
     if (connect(this->sock, p->ai_addr, p->ai_addrlen) == -1) {
         throw system_error(errno, system_category(), "connect");
     }
+
+    setNoDelay(this->sock);
 }
@@ -1,10 +1,13 @@
 #include "inet-server.h"
 
+#include <algorithm>
 #include <arpa/inet.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <iostream>
+#include <list>
 #include <netdb.h>
 #include <unistd.h>
 #include <string.h>
@@ -13,44 +16,54 @@
 #include <system_error>
 #include <thread>
 
+#ifdef __linux__
+#include <sys/epoll.h>
+#else
+#include <sys/event.h>
+#endif
+
 #include "../util.h"
 #include "../util/log.h"
+#include "protocol.h"
 #include "util.h"
 
 using namespace std;
 
+namespace {
+	// Once a message starts to arrive, the rest of it has this long.
+	const auto FRAME_TIMEOUT = chrono::seconds(60);
+	// Peers reconnect well before this (see PeerSession), so a quiet connection is gone.
+	const auto IDLE_TIMEOUT = chrono::seconds(60);
+	const auto OPEN_STREAMS_IDLE_TIMEOUT = chrono::seconds(600);
+	const auto SWEEP_INTERVAL = chrono::milliseconds(10000);
+	const int MAX_EVENTS = 64;
+	// Most the reactor reads off one connection before seeing to the others. Level-triggered,
+	// so it's back for the rest next time round.
+	const size_t READ_BUDGET = 1024 * 1024;
+
+	void setBlocking(int fd, bool blocking) {
+		int flags = fcntl(fd, F_GETFL, 0);
+		if (flags == -1 || fcntl(fd, F_SETFL, blocking ? flags & ~O_NONBLOCK : flags | O_NONBLOCK) == -1) {
+			throw system_error(errno, system_category(), "fcntl");
+		}
+	}
+}
+
 class InetRemoteSocket : public Socket {
 public:
 	InetRemoteSocket() = delete;
-	InetRemoteSocket(unsigned int localSocket) {
-        socklen_t sin_size = sizeof this->their_addr;
-
-	    if ((this->sock = accept(localSocket, (struct sockaddr *)(&this->their_addr), &sin_size)) == -1) {
-	    	throw system_error(errno, system_category(), "accept");
-	    }
+	InetRemoteSocket(int sock) {
+		this->sock = sock;
 	}
-    string peerString() {
-        char s[INET6_ADDRSTRLEN];
-
-        void *in_addr;
-        if (this->their_addr.ss_family == AF_INET) {
-            in_addr = &(((struct sockaddr_in*)&this->their_addr)->sin_addr);
-        } else {
-            in_addr = &(((struct sockaddr_in6*)&this->their_addr)->sin6_addr);
-        }
-
-        inet_ntop(their_addr.ss_family, in_addr, s, sizeof s);
-
-        return string(s);
-    }
-
-private:
-    struct sockaddr_storage their_addr;
 };
 
-InetServer::InetServer(const std::string &host, const std::string &port, function<void (Socket &)> connFn) {
+InetServer::InetServer(
+    const std::string &host, const std::string &port,
+    function<unique_ptr<Session> ()> sessionFn,
+    size_t workers
+) : sessionFn(sessionFn) {
     AddrInfo info(host, port);
-    
+
     for (struct addrinfo *p = info.servinfo; p != nullptr; p = p->ai_next) {
         try {
             this->attemptBind(p);
@@ -69,20 +82,34 @@ InetServer::InetServer(const std::string &host, const std::string &port, functio
         throw runtime_error("InetServer could not bind to any address.");
     }
 
-    if (listen(this->sock, 10) == -1) {
+    if (listen(this->sock, SOMAXCONN) == -1) {
         throw system_error(errno, system_category(), "listen");
     }
+    // Only the reactor accepts, and it accepts until there's nothing left.
+    setBlocking(this->sock, false);
 
-    const uint32_t MAX_THREADS = 10;
-    Socket sockets[MAX_THREADS];
-    thread conns[MAX_THREADS];
-    for (int connId=0; ; connId = (connId + 1) % MAX_THREADS) {
-        if (conns[connId].joinable()) {
-            conns[connId].join();
-        }
+#ifdef __linux__
+    this->poller = epoll_create1(EPOLL_CLOEXEC);
+#else
+    this->poller = kqueue();
+#endif
+    if (this->poller == -1) {
+        throw system_error(errno, system_category(), "epoll_create/kqueue");
+    }
+    this->watch(this->sock);
 
-        sockets[connId] = InetRemoteSocket(this->sock);
-        conns[connId] = thread(bind(connFn, ref(sockets[connId])));
+    for (size_t i = 0; i < workers; i++) {
+        this->workers.emplace_back([this] () {
+            this->work();
+        });
+    }
+
+    this->run();
+}
+
+InetServer::~InetServer() {
+    if (this->poller != -1) {
+        close(this->poller);
     }
 }
 
@@ -100,3 +127,424 @@ void InetServer::attemptBind(struct addrinfo *p) {
         throw system_error(errno, system_category(), "bind");
     }
 }
+
+
+/////////////
+// Reactor //
+/////////////
+
+void InetServer::run() {
+    StatusLine statusLine("InetServer");
+    STATUS(statusLine, "Listening.");
+
+    auto lastSweep = chrono::steady_clock::now();
+    int fds[MAX_EVENTS];
+    for (;;) {
+        int n = this->wait(fds, MAX_EVENTS, SWEEP_INTERVAL);
+
+        bool accepting = false;
+        for (int i = 0; i < n; i++) {
+            if (fds[i] == static_cast<int>(this->sock)) {
+                accepting = true;
+                continue;
+            }
+            shared_ptr<Connection> conn;
+            {
+                lock_guard<mutex> lock(this->m);
+                auto search = this->conns.find(fds[i]);
+                if (search == this->conns.end()) {
+                    continue;
+                }
+                conn = search->second;
+            }
+            this->receive(conn);
+        }
+
+        if (accepting) {
+            this->acceptAll();
+        }
+
+        if (chrono::steady_clock::now() - lastSweep >= SWEEP_INTERVAL) {
+            this->sweep();
+            lastSweep = chrono::steady_clock::now();
+        }
+
+        size_t connCount, readyCount;
+        {
+            lock_guard<mutex> lock(this->m);
+            connCount = this->conns.size();
+            readyCount = this->ready.size();
+        }
+        STATUS(statusLine, "conns=" << connCount << " ready=" << readyCount);
+    }
+}
+
+void InetServer::acceptAll() {
+    for (;;) {
+        int fd = accept(this->sock, nullptr, nullptr);
+        if (fd == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return;
+            } else if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            } else if (errno == EMFILE || errno == ENFILE) {
+                // Still pending, so we'll be back here once something else has closed.
+                ERR("InetServer out of file descriptors.");
+                this_thread::sleep_for(chrono::milliseconds(100));
+                return;
+            }
+            throw system_error(errno, system_category(), "accept");
+        }
+
+        shared_ptr<Connection> conn = make_shared<Connection>();
+        conn->fd = fd;
+        conn->socket.reset(new InetRemoteSocket(fd));
+        conn->lastActive = chrono::steady_clock::now();
+        try {
+            // Workers send replies blocking, while the reactor reads with MSG_DONTWAIT. Some
+            // platforms hand out accepted sockets with the listener's O_NONBLOCK.
+            setBlocking(fd, true);
+            setNoDelay(fd);
+        } catch (const exception &e) {
+            LOG_EXCEPTION(e, "InetServer accept");
+            continue;
+        }
+
+        {
+            lock_guard<mutex> lock(this->m);
+            this->conns[fd] = conn;
+        }
+        this->watch(fd);
+        StatusLine::Add("connsAccepted", 1);
+    }
+}
+
+void InetServer::receive(shared_ptr<Connection> conn) {
+    auto now = chrono::steady_clock::now();
+    size_t budget = READ_BUDGET;
+    try {
+        while (budget > 0) {
+            bool inHeader = conn->headerRead < Socket::PACKET_HEADER_SIZE;
+            char *dest = inHeader ? conn->header + conn->headerRead : conn->partial.body.data() + conn->bodyRead;
+            size_t wanted = inHeader ? Socket::PACKET_HEADER_SIZE - conn->headerRead : conn->partial.size - conn->bodyRead;
+
+            ssize_t len = recv(conn->fd, dest, min(wanted, budget), MSG_DONTWAIT);
+            if (len == 0) {
+                throw runtime_error("Connection closed by remote.");
+            } else if (len == -1) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    break;
+                } else if (errno == EINTR) {
+                    continue;
+                }
+                throw system_error(errno, system_category(), "recv");
+            }
+            StatusLine::Add("inbound", len);
+            conn->lastActive = now;
+            budget -= len;
+
+            if (inHeader) {
+                if (conn->headerRead == 0) {
+                    conn->packetStarted = now;
+                }
+                conn->headerRead += len;
+                if (conn->headerRead == Socket::PACKET_HEADER_SIZE) {
+                    conn->partial.size = Socket::PacketBodySize(conn->header);
+                    conn->partial.body = BufferPool::Take(conn->partial.size);
+                    conn->bodyRead = 0;
+                }
+                continue;
+            }
+
+            conn->bodyRead += len;
+            if (conn->bodyRead < conn->partial.size) {
+                continue;
+            }
+            conn->headerRead = 0;
+
+            lock_guard<mutex> lock(this->m);
+            if (conn->closed) {
+                return;
+            }
+            conn->packets.push_back(std::move(conn->partial));
+            if (!conn->decoding) {
+                conn->decoding = true;
+                this->ready.push_back([this, conn] () {
+                    this->decodePacket(conn);
+                });
+                this->readyCv.notify_one();
+            }
+        }
+    } catch (const exception &e) {
+        LOG_EXCEPTION(e, "InetServer connection");
+        lock_guard<mutex> lock(this->m);
+        this->drop(conn);
+    }
+}
+
+void InetServer::sweep() {
+    lock_guard<mutex> lock(this->m);
+    auto now = chrono::steady_clock::now();
+    list<shared_ptr<Connection>> idle, stalled;
+    for (auto &entry : this->conns) {
+        const Connection &conn = *entry.second;
+        if (conn.headerRead > 0 && now - conn.packetStarted > FRAME_TIMEOUT) {
+            stalled.push_back(entry.second);
+            continue;
+        }
+
+        bool scheduled = false;
+        for (const auto &stream : conn.streams) {
+            scheduled = scheduled || stream.second->scheduled;
+        }
+        // Streams left open are a promise of more to come, so those get longer.
+        auto timeout = conn.streams.empty() ? IDLE_TIMEOUT : OPEN_STREAMS_IDLE_TIMEOUT;
+        if (!conn.decoding && !scheduled && now - conn.lastActive > timeout) {
+            idle.push_back(entry.second);
+        }
+    }
+    for (auto &conn : idle) {
+        this->drop(conn);
+    }
+    for (auto &conn : stalled) {
+        ERR("InetServer connection " << conn->fd << " took over " << FRAME_TIMEOUT.count() << "s on one message, closing.");
+        this->drop(conn);
+    }
+    StatusLine::Add("connsIdleClosed", idle.size());
+    StatusLine::Add("connsStalledClosed", stalled.size());
+}
+
+
+/////////////
+// Workers //
+/////////////
+
+void InetServer::work() {
+    for (;;) {
+        function<void ()> task;
+        {
+            unique_lock<mutex> lock(this->m);
+            this->readyCv.wait(lock, [this] { return !this->ready.empty(); });
+            task = std::move(this->ready.front());
+            this->ready.pop_front();
+        }
+
+        task();
+    }
+}
+
+void InetServer::decodePacket(shared_ptr<Connection> conn) {
+    Packet packet;
+    {
+        lock_guard<mutex> lock(this->m);
+        if (conn->closed) {
+            return;
+        }
+        packet = std::move(conn->packets.front());
+        conn->packets.pop_front();
+    }
+
+    Socket::Frame frame;
+    try {
+        frame = conn->socket->decode(packet.body.data(), packet.size);
+    } catch (const exception &e) {
+        LOG_EXCEPTION(e, "InetServer connection");
+        lock_guard<mutex> lock(this->m);
+        this->drop(conn);
+        return;
+    }
+
+    {
+        lock_guard<mutex> lock(this->m);
+        if (conn->closed) {
+            return;
+        }
+        if (!conn->packets.empty()) {
+            // Behind whatever else is ready, so that one busy connection doesn't hog a worker.
+            this->ready.push_back([this, conn] () {
+                this->decodePacket(conn);
+            });
+            this->readyCv.notify_one();
+        } else {
+            conn->decoding = false;
+        }
+
+        uint32_t id = frame.header.stream;
+        shared_ptr<Stream> stream;
+        auto search = conn->streams.find(id);
+        if (search != conn->streams.end()) {
+            stream = search->second;
+        } else if (id > conn->lastStreamId && frame.header.type != MSG::Type::STREAM_CLOSE) {
+            stream = make_shared<Stream>();
+            stream->id = id;
+            stream->session = this->sessionFn();
+            conn->streams[id] = stream;
+            conn->lastStreamId = id;
+        }
+
+        // Otherwise it's for a stream that has already ended, and the peer will find out.
+        if (stream && frame.header.type == MSG::Type::STREAM_CLOSE) {
+            stream->closing = true;
+            if (!stream->scheduled) {
+                conn->streams.erase(id);
+            }
+        } else if (stream) {
+            stream->pending.push_back(std::move(frame));
+            if (!stream->scheduled) {
+                stream->scheduled = true;
+                this->ready.push_back([this, conn, stream] () {
+                    this->runStream(conn, stream);
+                });
+                this->readyCv.notify_one();
+            }
+        }
+    }
+}
+
+void InetServer::runStream(shared_ptr<Connection> conn, shared_ptr<Stream> stream) {
+    Socket::Frame frame;
+    {
+        lock_guard<mutex> lock(this->m);
+        if (conn->closed) {
+            return;
+        }
+        frame = std::move(stream->pending.front());
+        stream->pending.pop_front();
+    }
+
+    bool open = false;
+    try {
+        open = stream->session->onMessage(*conn->socket, stream->id, frame.header.type, frame.message.get());
+    } catch (const exception &e) {
+        LOG_EXCEPTION(e, "InetServer stream " << stream->id);
+    }
+
+    MSG::StreamWindow window;
+    window.bytes = 0;
+    bool ended = false;
+    {
+        lock_guard<mutex> lock(this->m);
+        stream->consumed += frame.header.size;
+        if (open && stream->consumed >= MSG::StreamWindow::INITIAL / 2) {
+            window.bytes = stream->consumed;
+            stream->consumed = 0;
+        }
+
+        if (!open) {
+            // Whatever else came in on it was sent before the peer knew it would end.
+            ended = !stream->closing;
+            stream->pending.clear();
+            conn->streams.erase(stream->id);
+        } else if (!stream->pending.empty()) {
+            // To the back of the line, so that busy streams take turns.
+            this->ready.push_back([this, conn, stream] () {
+                this->runStream(conn, stream);
+            });
+            this->readyCv.notify_one();
+        } else {
+            stream->scheduled = false;
+            if (stream->closing) {
+                conn->streams.erase(stream->id);
+            }
+        }
+    }
+
+    try {
+        if (window.bytes > 0) {
+            conn->socket->send(window, stream->id);
+        }
+        if (ended) {
+            conn->socket->send(MSG::StreamClose(), stream->id);
+        }
+    } catch (const exception &e) {
+        // The connection is going, and its reader will find out.
+    }
+}
+
+void InetServer::drop(shared_ptr<Connection> conn) {
+    // Anything still running on it finishes up first, and then the socket closes. Out of the
+    // poller now, though, or the reactor would keep hearing about it until then.
+    if (!conn->closed) {
+        try {
+            this->unwatch(conn->fd);
+        } catch (const exception &e) {
+            LOG_EXCEPTION(e, "InetServer drop");
+        }
+    }
+    conn->closed = true;
+    conn->streams.clear();
+    this->conns.erase(conn->fd);
+}
+
+
+////////////
+// Poller //
+////////////
+
+#ifdef __linux__
+
+void InetServer::watch(int fd) {
+    epoll_event ev = {};
+    ev.events = EPOLLIN;
+    ev.data.fd = fd;
+    if (epoll_ctl(this->poller, EPOLL_CTL_ADD, fd, &ev) == -1) {
+        throw system_error(errno, system_category(), "epoll_ctl add");
+    }
+}
+
+void InetServer::unwatch(int fd) {
+    if (epoll_ctl(this->poller, EPOLL_CTL_DEL, fd, nullptr) == -1) {
+        throw system_error(errno, system_category(), "epoll_ctl del");
+    }
+}
+
+int InetServer::wait(int *fds, int maxFds, chrono::milliseconds timeout) {
+    epoll_event events[MAX_EVENTS];
+    int n = epoll_wait(this->poller, events, min(maxFds, MAX_EVENTS), timeout.count());
+    if (n == -1) {
+        if (errno == EINTR) {
+            return 0;
+        }
+        throw system_error(errno, system_category(), "epoll_wait");
+    }
+    for (int i = 0; i < n; i++) {
+        fds[i] = events[i].data.fd;
+    }
+    return n;
+}
+
+#else
+
+void InetServer::watch(int fd) {
+    struct kevent ev;
+    EV_SET(&ev, fd, EVFILT_READ, EV_ADD, 0, 0, nullptr);
+    if (kevent(this->poller, &ev, 1, nullptr, 0, nullptr) == -1) {
+        throw system_error(errno, system_category(), "kevent add");
+    }
+}
+
+void InetServer::unwatch(int fd) {
+    struct kevent ev;
+    EV_SET(&ev, fd, EVFILT_READ, EV_DELETE, 0, 0, nullptr);
+    if (kevent(this->poller, &ev, 1, nullptr, 0, nullptr) == -1) {
+        throw system_error(errno, system_category(), "kevent delete");
+    }
+}
+
+int InetServer::wait(int *fds, int maxFds, chrono::milliseconds timeout) {
+    struct kevent events[MAX_EVENTS];
+    timespec ts = { static_cast<time_t>(timeout.count() / 1000), static_cast<long>(timeout.count() % 1000 * 1000000) };
+    int n = kevent(this->poller, nullptr, 0, events, min(maxFds, MAX_EVENTS), &ts);
+    if (n == -1) {
+        if (errno == EINTR) {
+            return 0;
+        }
+        throw system_error(errno, system_category(), "kevent");
+    }
+    for (int i = 0; i < n; i++) {
+        fds[i] = static_cast<int>(events[i].ident);
+    }
+    return n;
+}
+
+#endif
@@ -1,22 +1,124 @@
 #ifndef NET_INET_SERVER_H
 #define NET_INET_SERVER_H
 
+#include <chrono>
+#include <condition_variable>
+#include <deque>
 #include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
 #include <utility>
+#include <vector>
 #include "socket.h"
 #include "../index.h"
 
+/**
+ * InetServer owns every connection made to it. One thread waits on all of them (epoll on
+ * Linux, kqueue on macOS) and reads whatever has arrived without blocking, keeping a partly
+ * received message with its connection until the rest turns up. Each complete message goes
+ * to the worker pool, which decodes it and queues it on its stream, and the stream's Session
+ * handles it on a worker of its own. Idle connections and slow senders cost no thread at
+ * all, and a slow stream doesn't hold up the others on its connection.
+ */
 class InetServer : public Socket {
 public:
+	// Per-stream state, created when a stream's first message arrives. Messages on one stream
+	// are handled one at a time and in order, though not always on the same thread.
+	class Session {
+	public:
+		virtual ~Session() {}
+		// Replies go on the same stream. Returns false to end the stream.
+		virtual bool onMessage(Socket &remote, uint32_t stream, MSG::Type type, MSG::Base *msg) = 0;
+	};
+
+	static const size_t DEFAULT_WORKERS = 10;
+
 	InetServer() = delete;
 	// This constructor contains the run loop and therefore never terminates.
-	InetServer(const std::string &host, const std::string &port, function<void (Socket &)> connFn);
+	// sessionFn is called for each new stream.
+	InetServer(
+		const std::string &host, const std::string &port,
+		std::function<std::unique_ptr<Session> ()> sessionFn,
+		size_t workers=DEFAULT_WORKERS
+	);
 
 	InetServer(const InetServer &other) = delete;
-	InetServer(InetServer &&other) : Socket(std::move(other)) {}
+	InetServer(InetServer &&other) = delete;
+	~InetServer();
+
 private:
+	struct Stream {
+		uint32_t id;
+		std::unique_ptr<Session> session;
+		std::deque<Socket::Frame> pending;
+		// With a worker, or waiting for one.
+		bool scheduled = false;
+		// The peer is done with it, so it ends once pending is handled.
+		bool closing = false;
+		// Bytes handled since the peer was last granted more window.
+		uint64_t consumed = 0;
+	};
+
+	struct Packet {
+		BufferPool::Buffer body;
+		size_t size;
+	};
+
+	struct Connection {
+		int fd;
+		std::unique_ptr<Socket> socket;
+		std::map<uint32_t, std::shared_ptr<Stream>> streams;
+		// Peers number streams upwards from 1, so anything up to here has been seen before.
+		uint32_t lastStreamId = 0;
+		// Received but not yet decoded, in order.
+		std::deque<Packet> packets;
+		// With a worker decoding packets, or waiting for one. Only one decodes at a time.
+		bool decoding = false;
+		bool closed = false;
+
+		// Reactor only: the packet being received, header first and then body.
+		char header[Socket::PACKET_HEADER_SIZE];
+		size_t headerRead = 0;
+		Packet partial;
+		size_t bodyRead = 0;
+		std::chrono::steady_clock::time_point packetStarted;
+		std::chrono::steady_clock::time_point lastActive;
+	};
+
 	void attemptBind(struct addrinfo *p);
+
+	// Reactor thread.
+	void run();
+	void acceptAll();
+	// Reads what's there without blocking, and queues any packets it completes.
+	void receive(std::shared_ptr<Connection> conn);
+	// Drops connections that have been quiet for longer than IDLE_TIMEOUT, or that started a
+	// packet more than FRAME_TIMEOUT ago and still haven't finished it.
+	void sweep();
+
+	// Worker threads.
+	void work();
+	void decodePacket(std::shared_ptr<Connection> conn);
+	void runStream(std::shared_ptr<Connection> conn, std::shared_ptr<Stream> stream);
+	// Caller holds m.
+	void drop(std::shared_ptr<Connection> conn);
+
+	// Thin layer over epoll/kqueue, level-triggered.
+	void watch(int fd);
+	void unwatch(int fd);
+	int wait(int *fds, int maxFds, std::chrono::milliseconds timeout);
+
+	std::function<std::unique_ptr<Session> ()> sessionFn;
+	int poller = -1;
+	std::vector<std::thread> workers;
+
+	std::mutex m;
+	std::condition_variable readyCv;
+	std::map<int, std::shared_ptr<Connection>> conns;
+	std::deque<std::function<void ()>> ready;
 };
 
 #endif
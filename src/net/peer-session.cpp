@@ -0,0 +1,184 @@
+#include "peer-session.h"
+
+#include <stdexcept>
+
+#include "protocol.h"
+#include "../util/log.h"
+
+using namespace std;
+
+namespace {
+	// Shorter than the replica's idle timeout, so we never send on a connection it dropped.
+	const auto IDLE_RECONNECT = chrono::seconds(30);
+}
+
+////////////////
+// Connection //
+////////////////
+
+PeerSession::Connection::Connection(Socket &&socket) : socket(std::move(socket)) {
+	this->lastUsed = chrono::steady_clock::now();
+	this->reader = thread([this] () {
+		this->read();
+	});
+}
+
+PeerSession::Connection::~Connection() {
+	this->socket.shutdown();
+	this->reader.join();
+}
+
+void PeerSession::Connection::read() {
+	for (;;) {
+		Socket::Frame frame;
+		try {
+			// Streams time out their own waits.
+			frame = this->socket.awaitFrame(chrono::seconds(0));
+		} catch (const exception &e) {
+			lock_guard<mutex> lock(this->m);
+			this->failed = true;
+			this->error = e.what();
+			this->cv.notify_all();
+			return;
+		}
+
+		lock_guard<mutex> lock(this->m);
+		auto search = this->streams.find(frame.header.stream);
+		if (search == this->streams.end()) {
+			// Already closed on our side.
+			continue;
+		}
+
+		StreamState &stream = search->second;
+		switch (frame.header.type) {
+		case MSG::Type::STREAM_WINDOW:
+			stream.window += dynamic_cast<MSG::StreamWindow*>(frame.message.get())->bytes;
+			break;
+		case MSG::Type::STREAM_CLOSE:
+			stream.closed = true;
+			break;
+		default:
+			stream.inbox.emplace_back(std::move(frame.message), chrono::steady_clock::now());
+			break;
+		}
+		this->cv.notify_all();
+	}
+}
+
+bool PeerSession::Connection::stale() {
+	lock_guard<mutex> lock(this->m);
+	return this->failed || chrono::steady_clock::now() - this->lastUsed > IDLE_RECONNECT;
+}
+
+
+////////////
+// Stream //
+////////////
+
+PeerSession::Stream::~Stream() {
+	{
+		lock_guard<mutex> lock(this->conn->m);
+		this->conn->streams.erase(this->id);
+		this->conn->lastUsed = chrono::steady_clock::now();
+		if (this->conn->failed) {
+			return;
+		}
+	}
+
+	try {
+		this->socket().send(MSG::StreamClose(), this->id);
+	} catch (const exception &e) {
+		this->fail(e.what());
+	}
+}
+
+bool PeerSession::Stream::stale() const {
+	return this->conn->stale();
+}
+
+const Socket& PeerSession::Stream::socket() const {
+	return this->conn->socket;
+}
+
+void PeerSession::Stream::awaitWindow() {
+	unique_lock<mutex> lock(this->conn->m);
+	StreamState &stream = this->conn->streams.at(this->id);
+	this->conn->cv.wait(lock, [this, &stream] {
+		return stream.window > 0 || stream.closed || this->conn->failed;
+	});
+	if (this->conn->failed) {
+		throw runtime_error("Connection failed: " + this->conn->error);
+	}
+	if (stream.closed) {
+		throw runtime_error("Stream closed by remote.");
+	}
+	this->conn->lastUsed = chrono::steady_clock::now();
+}
+
+void PeerSession::Stream::sent(size_t bytes) {
+	lock_guard<mutex> lock(this->conn->m);
+	this->conn->streams.at(this->id).window -= bytes;
+}
+
+void PeerSession::Stream::fail(const string &error) {
+	{
+		lock_guard<mutex> lock(this->conn->m);
+		if (!this->conn->failed) {
+			this->conn->failed = true;
+			this->conn->error = error;
+		}
+		this->conn->cv.notify_all();
+	}
+	// Wakes the reader, and every stream on the connection goes with it.
+	this->conn->socket.shutdown();
+}
+
+MSG::Ptr<MSG::Base> PeerSession::Stream::await(chrono::duration<uint64_t> timeout) {
+	unique_lock<mutex> lock(this->conn->m);
+	StreamState &stream = this->conn->streams.at(this->id);
+	auto ready = [this, &stream] {
+		return !stream.inbox.empty() || stream.closed || this->conn->failed;
+	};
+	if (timeout.count() == 0) {
+		this->conn->cv.wait(lock, ready);
+	} else if (!this->conn->cv.wait_for(lock, timeout, ready)) {
+		throw runtime_error("Timed out waiting on stream " + to_string(this->id));
+	}
+
+	// Whatever arrived before the stream ended is still good.
+	if (!stream.inbox.empty()) {
+		MSG::Ptr<MSG::Base> result = std::move(stream.inbox.front().first);
+		this->lastArrived = stream.inbox.front().second;
+		stream.inbox.pop_front();
+		this->conn->lastUsed = chrono::steady_clock::now();
+		return result;
+	}
+	if (this->conn->failed) {
+		throw runtime_error("Connection failed: " + this->conn->error);
+	}
+	throw runtime_error("Stream closed by remote.");
+}
+
+
+/////////////////
+// PeerSession //
+/////////////////
+
+PeerSession::PeerSession(function<Socket ()> connectFn) : connectFn(connectFn) {
+}
+
+unique_ptr<PeerSession::Stream> PeerSession::open() {
+	lock_guard<mutex> lock(this->m);
+
+	if (!this->conn || this->conn->stale()) {
+		// Streams still on the old one keep it alive until they're done with it.
+		this->conn = make_shared<Connection>(this->connectFn());
+		StatusLine::Add("peerConnects", 1);
+	}
+
+	lock_guard<mutex> connLock(this->conn->m);
+	uint32_t id = this->conn->nextId++;
+	this->conn->streams[id];
+	StatusLine::Add("streamsOpened", 1);
+	return unique_ptr<Stream>(new Stream(this->conn, id));
+}
@@ -0,0 +1,126 @@
+#ifndef NET_PEER_SESSION_H
+#define NET_PEER_SESSION_H
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include "protocol.h"
+#include "socket.h"
+
+/**
+ * A PeerSession is the one connection the primary keeps to a replica, carrying any number of
+ * logical streams: a diff, an info request, each TransferWorker's transfers. A stream is to
+ * the replica what a connection of its own used to be, minus the handshake.
+ *
+ * The connection is made when the first stream is opened, and made again when a stream is
+ * opened after it failed or sat unused for a while. Streams already open stay on the old
+ * connection, and fail if it does.
+ */
+class PeerSession {
+	struct Connection;
+
+public:
+	class Stream {
+	public:
+		Stream(const Stream &other) = delete;
+		Stream& operator=(const Stream &other) = delete;
+		// Tells the replica it can forget the stream.
+		~Stream();
+
+		// Blocks while the replica hasn't caught up with what we already sent on this stream.
+		template <typename T>
+		void send(const T &msg) {
+			this->awaitWindow();
+			try {
+				this->sent(this->socket().send(msg, this->id));
+			} catch (const std::exception &e) {
+				// Part of a frame may have gone out, so nothing after it would make sense.
+				this->fail(e.what());
+				throw;
+			}
+		}
+
+		// Packets can be pretty big——need to be allocated on heap, and can't be copied around.
+		template <typename T>
+		MSG::Ptr<T> awaitWithType(
+			MSG::Type type,
+			std::chrono::duration<uint64_t> timeout=std::chrono::seconds(30)
+		) {
+			MSG::Ptr<MSG::Base> msg;
+			RETHROW_NESTED(msg = this->await(timeout), "awaitWithType " << type);
+			T *casted = dynamic_cast<T*>(msg.get());
+			if (casted != nullptr) {
+				msg.release();
+			}
+			return MSG::Ptr<T>(casted);
+		}
+
+		// Its connection failed, or has been quiet long enough that the replica may drop it.
+		// Better to open a new one than to keep using it.
+		bool stale() const;
+
+		// When the message last awaited came off the connection, which can be a while before
+		// it was awaited.
+		std::chrono::steady_clock::time_point arrived() const { return this->lastArrived; }
+
+	private:
+		friend class PeerSession;
+		Stream(std::shared_ptr<Connection> conn, uint32_t id) : conn(conn), id(id) {}
+
+		const Socket& socket() const;
+		void awaitWindow();
+		void sent(size_t bytes);
+		void fail(const std::string &error);
+		MSG::Ptr<MSG::Base> await(std::chrono::duration<uint64_t> timeout);
+
+		std::shared_ptr<Connection> conn;
+		uint32_t id;
+		std::chrono::steady_clock::time_point lastArrived;
+	};
+
+	PeerSession(std::function<Socket ()> connectFn);
+	PeerSession(const PeerSession &other) = delete;
+
+	std::unique_ptr<Stream> open();
+
+private:
+	struct StreamState {
+		// With when each arrived.
+		std::deque<std::pair<MSG::Ptr<MSG::Base>, std::chrono::steady_clock::time_point>> inbox;
+		// Bytes the replica will still take on this stream.
+		int64_t window = MSG::StreamWindow::INITIAL;
+		// The replica closed it, e.g. after failing to handle something on it.
+		bool closed = false;
+	};
+
+	// One connection, and a thread that sorts whatever arrives on it into its streams.
+	struct Connection {
+		Connection(Socket &&socket);
+		~Connection();
+		void read();
+		bool stale();
+
+		Socket socket;
+		std::thread reader;
+		std::mutex m;
+		std::condition_variable cv;
+		std::map<uint32_t, StreamState> streams;
+		bool failed = false;
+		std::string error;
+		uint32_t nextId = 1;
+		std::chrono::steady_clock::time_point lastUsed;
+	};
+
+	std::function<Socket ()> connectFn;
+	std::mutex m;
+	std::shared_ptr<Connection> conn;
+};
+
+#endif
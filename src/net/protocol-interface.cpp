@@ -18,6 +18,17 @@ std::ostream& operator<<(std::ostream &stream, const MSG::Type &type) {
 	case MSG::Type::INSPECT_RESP:       return stream << "INSPECT_RESP";
 	case MSG::Type::LOG_REQ:            return stream << "LOG_REQ";
 	case MSG::Type::LOG_RESP:           return stream << "LOG_RESP";
+	case MSG::Type::XFR_RENAME_RESP:    return stream << "XFR_RENAME_RESP";
+	case MSG::Type::JOURNAL_REQ:        return stream << "JOURNAL_REQ";
+	case MSG::Type::JOURNAL_RESP:       return stream << "JOURNAL_RESP";
+	case MSG::Type::XFR_LINK_RESP:      return stream << "XFR_LINK_RESP";
+	case MSG::Type::STREAM_CLOSE:       return stream << "STREAM_CLOSE";
+	case MSG::Type::STREAM_WINDOW:      return stream << "STREAM_WINDOW";
+	case MSG::Type::RECONCILE_REQ:      return stream << "RECONCILE_REQ";
+	case MSG::Type::RECONCILE_RESP:     return stream << "RECONCILE_RESP";
+	case MSG::Type::DIFF_COMMIT_RESP:   return stream << "DIFF_COMMIT_RESP";
+	case MSG::Type::DIFF_RESUME_REQ:    return stream << "DIFF_RESUME_REQ";
+	case MSG::Type::DIFF_RESUME_RESP:   return stream << "DIFF_RESUME_RESP";
 	}
 	return stream;
 }
@@ -40,6 +51,17 @@ std::wostream& operator<<(std::wostream &stream, const MSG::Type &type) {
 	case MSG::Type::INSPECT_RESP:       return stream << "INSPECT_RESP";
 	case MSG::Type::LOG_REQ:            return stream << "LOG_REQ";
 	case MSG::Type::LOG_RESP:           return stream << "LOG_RESP";
+	case MSG::Type::XFR_RENAME_RESP:    return stream << "XFR_RENAME_RESP";
+	case MSG::Type::JOURNAL_REQ:        return stream << "JOURNAL_REQ";
+	case MSG::Type::JOURNAL_RESP:       return stream << "JOURNAL_RESP";
+	case MSG::Type::XFR_LINK_RESP:      return stream << "XFR_LINK_RESP";
+	case MSG::Type::STREAM_CLOSE:       return stream << "STREAM_CLOSE";
+	case MSG::Type::STREAM_WINDOW:      return stream << "STREAM_WINDOW";
+	case MSG::Type::RECONCILE_REQ:      return stream << "RECONCILE_REQ";
+	case MSG::Type::RECONCILE_RESP:     return stream << "RECONCILE_RESP";
+	case MSG::Type::DIFF_COMMIT_RESP:   return stream << "DIFF_COMMIT_RESP";
+	case MSG::Type::DIFF_RESUME_REQ:    return stream << "DIFF_RESUME_REQ";
+	case MSG::Type::DIFF_RESUME_RESP:   return stream << "DIFF_RESUME_RESP";
 	}
 	return stream;
 }
@@ -5,14 +5,15 @@
 #include <functional>
 #include <istream>
 #include <map>
+#include <memory>
 #include <ostream>
+#include <stdexcept>
 #include <string>
-#include <typeindex>
-#include <typeinfo>
 #include <vector>
 #include <stdio.h>
 
 #include "../util/log.h"
+#include "../util/object-pool.h"
 
 namespace MSG {
 	/**
@@ -36,51 +37,137 @@ namespace MSG {
 		INSPECT_REQ        = 12,
 		INSPECT_RESP       = 13,
 		LOG_REQ            = 14,
-		LOG_RESP           = 15
+		LOG_RESP           = 15,
+		XFR_RENAME_RESP    = 16,
+		JOURNAL_REQ        = 17,
+		JOURNAL_RESP       = 18,
+		XFR_LINK_RESP      = 19,
+		STREAM_CLOSE       = 20,
+		STREAM_WINDOW      = 21,
+		RECONCILE_REQ      = 22,
+		RECONCILE_RESP     = 23,
+		DIFF_COMMIT_RESP   = 24,
+		DIFF_RESUME_REQ    = 25,
+		DIFF_RESUME_RESP   = 26
 	};
 
 	struct Base {
 		virtual ~Base() = default;
 
 		// Serialize to stream
-		virtual void serialize(std::ostream &stream) const = 0;
+		virtual void serialize(Writer &stream) const = 0;
 		// Deserialize from stream
-		virtual void deserialize(std::istream &stream) = 0;
+		virtual void deserialize(Reader &stream) = 0;
 
-		Type type;
+		// Set on messages made by the Factory.
+		Type type = Type::UNSET;
 	};
 
-	struct Factory {
-		typedef std::function<std::unique_ptr<Base> ()> Constructor;
+	// A message that is just its FIELDS (see serialize.h). Sending one whose type is known
+	// serializes it without going through Base's virtuals.
+	template <typename T>
+	struct Message : Base {
+		void serialize(Writer &stream) const final {
+			schema::serializeFields(stream, static_cast<const T&>(*this));
+		}
+		void deserialize(Reader &stream) final {
+			schema::deserializeFields(stream, static_cast<T&>(*this));
+		}
+	};
+
+	// Hands messages back to the Factory, which may reuse them, rather than deleting them.
+	struct Recycle {
+		void operator()(Base *msg) const;
+	};
+
+	// A received message.
+	template <typename T>
+	using Ptr = std::unique_ptr<T, Recycle>;
 
+	/**
+	 * Makes messages by type as they're received. Lookup is by indexing a table with the type
+	 * byte. Types registered as pooled keep up to that many of their objects around once
+	 * they're done with, and hand them out again, buffers and all, instead of allocating.
+	 */
+	struct Factory {
 		template <typename T>
-		static void Register(Type t) {
-			Factory::constructors[t] = [] () {
-				return std::unique_ptr<Base>(new T);
+		static void Register(Type t, size_t pooled=0) {
+			Factory::PoolFor<T>().setCapacity(pooled);
+			Factory::table[static_cast<uint8_t>(t)] = {
+				[] () -> Base* {
+					T *result = Factory::PoolFor<T>().take();
+					if (result == nullptr) {
+						result = new T;
+						StatusLine::Add("msgAllocs", 1);
+					}
+					return result;
+				},
+				[] (Base *msg) {
+					T *obj = static_cast<T*>(msg);
+					if (!Factory::PoolFor<T>().give(obj)) {
+						delete obj;
+					}
+				}
 			};
-			Factory::types[std::type_index(typeid(T))] = t;
+			Factory::TypeOf<T>() = t;
 		}
-		
-		static std::unique_ptr<Base> Create(Type t) {
-			const auto &result = Factory::constructors.find(t);
-			assert(result != Factory::constructors.end());
-			return result->second();
+
+		static Ptr<Base> Create(Type t) {
+			const Entry &entry = Factory::table[static_cast<uint8_t>(t)];
+			if (entry.create == nullptr) {
+				throw std::runtime_error("Unknown message type " + std::to_string(static_cast<int>(t)));
+			}
+			Ptr<Base> result(entry.create());
+			result->type = t;
+			return result;
+		}
+
+		static void Recycle(Base *msg) {
+			const Entry &entry = Factory::table[static_cast<uint8_t>(msg->type)];
+			if (msg->type == Type::UNSET || entry.recycle == nullptr) {
+				// Not one of ours.
+				delete msg;
+				return;
+			}
+			entry.recycle(msg);
 		}
 
 		template <typename T>
 		static Type EnumType() {
-			return Factory::types.at(std::type_index(typeid(T)));
+			Type t = Factory::TypeOf<T>();
+			assert(t != Type::UNSET);
+			return t;
 		}
 
 	private:
-		static std::map<Type,Constructor> constructors;
-		static std::map<std::type_index,Type> types;
+		struct Entry {
+			Base* (*create)();
+			void (*recycle)(Base *msg);
+		};
+
+		template <typename T>
+		static ObjectPool<T>& PoolFor() {
+			static ObjectPool<T> pool;
+			return pool;
+		}
+
+		template <typename T>
+		static Type& TypeOf() {
+			static Type t = Type::UNSET;
+			return t;
+		}
+
+		static Entry table[256];
 	};
 
+	inline void Recycle::operator()(Base *msg) const {
+		Factory::Recycle(msg);
+	}
+
 	template <typename T>
 	struct FactoryRecord {
-		FactoryRecord(Type t) {
-			Factory::Register<T>(t);
+		FactoryRecord(Type t, size_t pooled=0) {
+			Factory::Register<T>(t, pooled);
 		}
 	};
 }
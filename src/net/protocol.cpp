@@ -5,16 +5,23 @@
 using namespace std;
 
 namespace MSG {
-	map<Type, Factory::Constructor> Factory::constructors;
-	map<type_index, Type> Factory::types;
+	Factory::Entry Factory::table[256];
 
+	// Pooled: the ones that arrive by the thousand. A pooled XfrBlock keeps the memory of the
+	// biggest block it has carried, so fewer are kept than the StreamWindow::INITIAL /
+	// XfrBlock::MIN_SIZE = 128 small ones a stream can have in flight.
 	static FactoryRecord<InfoReq> InfoReq_Recorder(Type::INFO_REQ);
 	static FactoryRecord<InfoResp> InfoResp_Recorder(Type::INFO_RESP);
-	static FactoryRecord<DiffReq> DiffReq_Recorder(Type::DIFF_REQ);
-	static FactoryRecord<DiffResp> DiffResp_Recorder(Type::DIFF_RESP);
+	static FactoryRecord<DiffReq> DiffReq_Recorder(Type::DIFF_REQ, 64);
+	static FactoryRecord<DiffResp> DiffResp_Recorder(Type::DIFF_RESP, 64);
 	static FactoryRecord<DiffCommit> DiffCommit_Recorder(Type::DIFF_COMMIT);
+	static FactoryRecord<DiffCommitResp> DiffCommitResp_Recorder(Type::DIFF_COMMIT_RESP);
+	static FactoryRecord<DiffResumeReq> DiffResumeReq_Recorder(Type::DIFF_RESUME_REQ);
+	static FactoryRecord<DiffResumeResp> DiffResumeResp_Recorder(Type::DIFF_RESUME_RESP);
+	static FactoryRecord<ReconcileReq> ReconcileReq_Recorder(Type::RECONCILE_REQ);
+	static FactoryRecord<ReconcileResp> ReconcileResp_Recorder(Type::RECONCILE_RESP);
 	static FactoryRecord<XfrEstablishReq> XfrEstablishReq_Recorder(Type::XFR_ESTABLISH_REQ);
-	static FactoryRecord<XfrBlock> XfrBlock_Recorder(Type::XFR_BLOCK);
+	static FactoryRecord<XfrBlock> XfrBlock_Recorder(Type::XFR_BLOCK, 64);
 	static FactoryRecord<SyncEstablishReq> SyncEstablishReq_Recorder(Type::SYNC_ESTABLISH_REQ);
 	static FactoryRecord<FullsyncCmd> FullsyncCmd_Recorder(Type::FULLSYNC_CMD);
 	static FactoryRecord<FlushCmd> FlushCmd_Recorder(Type::FLUSH_CMD);
@@ -22,11 +29,17 @@ namespace MSG {
 	static FactoryRecord<InspectResp> InspectResp_Recorder(Type::INSPECT_RESP);
 	static FactoryRecord<LogReq> LogReq_Recorder(Type::LOG_REQ);
 	static FactoryRecord<LogResp> LogResp_Recorder(Type::LOG_RESP);
+	static FactoryRecord<XfrRenameResp> XfrRenameResp_Recorder(Type::XFR_RENAME_RESP);
+	static FactoryRecord<JournalReq> JournalReq_Recorder(Type::JOURNAL_REQ);
+	static FactoryRecord<JournalResp> JournalResp_Recorder(Type::JOURNAL_RESP);
+	static FactoryRecord<XfrLinkResp> XfrLinkResp_Recorder(Type::XFR_LINK_RESP);
+	static FactoryRecord<StreamClose> StreamClose_Recorder(Type::STREAM_CLOSE);
+	static FactoryRecord<StreamWindow> StreamWindow_Recorder(Type::STREAM_WINDOW, 64);
 
-	void LogResp::serialize(ostream &stream) const {
+	void LogResp::serialize(Writer &stream) const {
 		StatusLine::Serialize(stream);
 	}
-	void LogResp::deserialize(istream &stream) {
+	void LogResp::deserialize(Reader &stream) {
 		StatusLine::Deserialize(stream, this->statusLines);
 	}
 }
@@ -3,7 +3,6 @@
 
 // #include <cassert>
 // #include <functional>
-#include <istream>
 // #include <map>
 #include <ostream>
 #include <string>
@@ -12,54 +11,43 @@
 #include <vector>
 #include "../process/policy/policy.h"
 #include "protocol-interface.h"
+#include "../util/delta-coded.h"
+#include "../util/front-coded.h"
+#include "../util/iblt.h"
 #include "../util/max-size-buffer.h"
 
 class StatusLine;
 
-const int64_t PROTOCOL_VERSION = 1;
+const int64_t PROTOCOL_VERSION = 18;
 
 namespace MSG {
 	/**
 	 * Want to add a message?
 	 * 1. Add to Type in protocol-interface.h
-	 * 2. Add to this header
+	 * 2. Add to this header, deriving from Message and listing its FIELDS
 	 * 3. Register with Factory in protocol.cpp
 	 */
 	
-	struct InfoReq : Base {
-		virtual void serialize(std::ostream &stream) const { }
-		virtual void deserialize(std::istream &stream) { }
+	struct InfoReq : Message<InfoReq> {
+		static constexpr auto FIELDS = std::make_tuple();
 	};
 
-	struct InfoResp : Base {
+	struct InfoResp : Message<InfoResp> {
 		struct Response {
 			std::string instanceId;
 			std::string status;
 			uint64_t filesIndexed;
 			uint64_t hash;
+			uint64_t excludesFingerprint;
 
-			void serialize(std::ostream &stream) const {
-				::serialize(stream, this->instanceId);
-				::serialize(stream, this->status);
-				::serialize(stream, this->filesIndexed);
-				::serialize(stream, this->hash);
-			}
-			void deserialize(std::istream &stream) {
-				::deserialize(stream, this->instanceId);
-				::deserialize(stream, this->status);
-				::deserialize(stream, this->filesIndexed);
-				::deserialize(stream, this->hash);
-			}
+			static constexpr auto FIELDS = std::make_tuple(
+				&Response::instanceId, &Response::status, &Response::filesIndexed, &Response::hash,
+				&Response::excludesFingerprint);
 		};
 
 		std::vector<Response> payloads;
 
-		virtual void serialize(std::ostream &stream) const {
-			::serialize(stream, this->payloads);
-		}
-		virtual void deserialize(std::istream &stream) {
-			::deserialize(stream, this->payloads);
-		}
+		static constexpr auto FIELDS = std::make_tuple(&InfoResp::payloads);
 	};
 
 	/**
@@ -73,169 +61,275 @@ namespace MSG {
 	 *   there can only be one primary, and the primary will know when a diff txn has started.
 	 */
 
-	struct DiffReq : Base {
-		static const uint32_t MAX_RECORDS = 256;
+	struct DiffReq : Message<DiffReq> {
+		// The primary sizes requests to the link, within these.
+		static const uint32_t MAX_RECORDS = 4096;
+		static const size_t MAX_BYTES = 1024 * 1024;
 		
 		struct Query {
 			std::string path;
 			uint64_t hash;
 
-			void serialize(std::ostream &stream) const {
-				::serialize(stream, path);
-				::serialize(stream, hash);
-			}
-			void deserialize(std::istream &stream) {
-				::deserialize(stream, path);
-				::deserialize(stream, hash);
-			}
+			static constexpr auto FIELDS = std::make_tuple(&Query::path, &Query::hash);
 		};
 
 		uint64_t epoch;
-		std::vector<Query> queries;
+		// Numbered per session, so the primary can have several in flight and still tell which
+		// DiffResp answers which.
+		uint32_t requestId = 0;
+		// Queries are numbered through the session, starting here for this request's, so that
+		// answers can refer to them by number rather than by path.
+		uint32_t firstId = 0;
+		// Siblings go out together, so their paths are sent as what they don't share.
+		FrontCoded<Query> queries;
+
+		static constexpr auto FIELDS = std::make_tuple(
+			&DiffReq::epoch, &DiffReq::requestId, &DiffReq::firstId, &DiffReq::queries);
+	};
 
-		virtual void serialize(std::ostream &stream) const {
-			::serialize(stream, this->epoch);
-			::serialize(stream, this->queries);
-		}
-		virtual void deserialize(std::istream &stream) {
-			::deserialize(stream, this->epoch);
-			::deserialize(stream, this->queries);
-		}
+	struct DiffResp : Message<DiffResp> {
+		// The DiffReq's.
+		uint32_t requestId = 0;
+		// Ids of its queries whose paths have non-matching hashes, ascending.
+		DeltaCoded<uint32_t> answers;
+
+		static constexpr auto FIELDS = std::make_tuple(&DiffResp::requestId, &DiffResp::answers);
 	};
 
-	struct DiffResp : Base {
-		struct Answer {
-			std::string path;
+	/**
+	 * For a directory with too many children to ask about one by one. The primary sends an IBLT
+	 * of its children's (Index::ReconcileKey, hash) pairs, and the replica takes its own away
+	 * and answers with the keys of the children it has to be sent, having expected the rest as
+	 * if they'd been asked about in a DiffReq. If the IBLT was too small for the difference,
+	 * the primary falls back to DiffReqs.
+	 */
+	struct ReconcileReq : Message<ReconcileReq> {
+		uint64_t epoch;
+		// Numbered along with DiffReqs.
+		uint32_t requestId = 0;
+		std::string path;
+		Iblt sketch;
 
-			void serialize(std::ostream &stream) const {
-				::serialize(stream, this->path);
-			}
-			void deserialize(std::istream &stream) {
-				::deserialize(stream, this->path);
-			}
-		};
+		static constexpr auto FIELDS = std::make_tuple(
+			&ReconcileReq::epoch, &ReconcileReq::requestId, &ReconcileReq::path, &ReconcileReq::sketch);
+	};
 
-		// |answers| <= |queries| since answers only includes paths with non-matching hashes.
-		std::vector<Answer> answers;
+	struct ReconcileResp : Message<ReconcileResp> {
+		// The ReconcileReq's.
+		uint32_t requestId = 0;
+		bool decoded = false;
+		std::vector<uint64_t> different;
 
-		virtual void serialize(std::ostream &stream) const {
-			::serialize(stream, this->answers);
-		}
-		virtual void deserialize(std::istream &stream) {
-			::deserialize(stream, this->answers);
-		}
+		static constexpr auto FIELDS = std::make_tuple(
+			&ReconcileResp::requestId, &ReconcileResp::decoded, &ReconcileResp::different);
 	};
 
-	struct DiffCommit : Base {
+	/**
+	 * Sent by the primary before picking up a diff that was cut short, to check that the
+	 * replica still holds what the DiffReqs it already answered expect. If it doesn't (having
+	 * restarted, committed, or diffed at another epoch since), the diff starts over.
+	 */
+	struct DiffResumeReq : Message<DiffResumeReq> {
 		uint64_t epoch;
 
-		virtual void serialize(std::ostream &stream) const {
-			::serialize(stream, this->epoch);
-		}
-		virtual void deserialize(std::istream &stream) {
-			::deserialize(stream, this->epoch);
-		}
+		static constexpr auto FIELDS = std::make_tuple(&DiffResumeReq::epoch);
+	};
+
+	struct DiffResumeResp : Message<DiffResumeResp> {
+		bool resumable = false;
+
+		static constexpr auto FIELDS = std::make_tuple(&DiffResumeResp::resumable);
+	};
+
+	struct DiffCommit : Message<DiffCommit> {
+		uint64_t epoch;
+		// Answer with a DiffCommitResp, for replicas that were in the same state as this one
+		// and get this diff's transfers without being asked themselves.
+		bool reportDeleted = false;
+		// Directories the primary couldn't list. Whatever the replica has under them stays.
+		std::vector<std::string> unreadable;
+
+		static constexpr auto FIELDS = std::make_tuple(
+			&DiffCommit::epoch, &DiffCommit::reportDeleted, &DiffCommit::unreadable);
+	};
+
+	struct DiffCommitResp : Message<DiffCommitResp> {
+		// Past this, the replica just says it deleted too much to list.
+		static const size_t MAX_BYTES = 1024 * 1024;
+
+		struct Deleted {
+			std::string path;
+
+			static constexpr auto FIELDS = std::make_tuple(&Deleted::path);
+		};
+
+		bool complete = true;
+		// What the commit deleted, each only where its parent wasn't deleted too.
+		FrontCoded<Deleted> deleted;
+
+		static constexpr auto FIELDS = std::make_tuple(&DiffCommitResp::complete, &DiffCommitResp::deleted);
 	};
 
 	/**
 	 * We want to start a transfer. Can include further steps (i.e. transfer to 1 or more
 	 * peers, as we transfer to you.)
 	 */
-	struct XfrEstablishReq : Base {
+	struct XfrEstablishReq : Message<XfrEstablishReq> {
 		PolicyPlan plan;
-
-		virtual void serialize(std::ostream &stream) const {
-			::serialize(stream, this->plan);
-		}
-		virtual void deserialize(std::istream &stream) {
-			::deserialize(stream, this->plan);
-		}
+		// Which journal plan.file.seq refers to.
+		uint64_t journalId;
+		// Files only: how much data each XfrBlock but the last carries, which the primary picks
+		// by file size with XfrBlock::SizeFor.
+		uint32_t blockSize = 0;
+
+		static constexpr auto FIELDS = std::make_tuple(
+			&XfrEstablishReq::plan, &XfrEstablishReq::journalId, &XfrEstablishReq::blockSize);
 	};
 
 	/**
 	 * Transfer data block.
-	 * Closing protocol is that primary sends non-full block to replica.
+	 * Closing protocol is that primary sends a non-full block without a hole to replica.
 	 */
-	struct XfrBlock : Base {
-		static const uint32_t MAX_SIZE = 32 * 1024;
+	struct XfrBlock : Message<XfrBlock> {
+		// Small files go in small blocks, and bulk transfers in big ones, so that they take few
+		// frames. Short of MAX_SIZE, a file takes about 16 blocks, which keeps reading, sending
+		// and writing it going at once. Much past MAX_SIZE, frames stop fitting in cache on
+		// their way through compression and encryption, and get slower.
+		static const uint32_t MIN_SIZE = 32 * 1024;
+		static const uint32_t MAX_SIZE = 1024 * 1024;
+
+		static uint32_t SizeFor(uint64_t fileSize) {
+			uint32_t size = MIN_SIZE;
+			while (size < MAX_SIZE && size * uint64_t(16) < fileSize) {
+				size *= 2;
+			}
+			return size;
+		}
 
 		MaxSizeBuffer<MAX_SIZE> data;
+		// Zero bytes following data, which the replica leaves as a hole instead of writing.
+		uint64_t hole = 0;
 
-		virtual void serialize(std::ostream &stream) const {
-			::serialize(stream, this->data);
-		}
-		virtual void deserialize(std::istream &stream) {
-			::deserialize(stream, this->data);
-		}
+		static constexpr auto FIELDS = std::make_tuple(&XfrBlock::data, &XfrBlock::hole);
+	};
+
+	/**
+	 * Replica's answer to an XfrEstablishReq whose plan has renamedFrom set.
+	 * If the source was missing, nothing was renamed, and primary follows up by transferring
+	 * content instead.
+	 */
+	struct XfrRenameResp : Message<XfrRenameResp> {
+		bool renamed;
+
+		static constexpr auto FIELDS = std::make_tuple(&XfrRenameResp::renamed);
+	};
+
+	/**
+	 * Replica's answer to an XfrEstablishReq for a file whose plan has linkTo set to another path.
+	 * If linkTo was missing or not yet current, nothing was linked, and primary follows up by
+	 * transferring content instead.
+	 */
+	struct XfrLinkResp : Message<XfrLinkResp> {
+		bool linked;
+
+		static constexpr auto FIELDS = std::make_tuple(&XfrLinkResp::linked);
+	};
+
+	/**
+	 * Starts a sync session. Carries the primary's exclude patterns, which the replica
+	 * adopts so that both sides index the same set of paths.
+	 */
+	struct SyncEstablishReq : Message<SyncEstablishReq> {
+		std::vector<std::string> excludes;
+		// The replica was last seen to match the primary with everything in this journal up
+		// to journalSeq applied. journalId is 0 if it hasn't been yet.
+		uint64_t journalId;
+		uint64_t journalSeq;
+
+		static constexpr auto FIELDS = std::make_tuple(
+			&SyncEstablishReq::excludes, &SyncEstablishReq::journalId,
+			&SyncEstablishReq::journalSeq);
+	};
+
+	/**
+	 * Asks the replica how far along the primary's change journal it is, so that the primary
+	 * can send just what it missed instead of diffing.
+	 */
+	struct JournalReq : Message<JournalReq> {
+		static constexpr auto FIELDS = std::make_tuple();
 	};
 
-	struct SyncEstablishReq : Base {
-		virtual void serialize(std::ostream &stream) const {}
-		virtual void deserialize(std::istream &stream) {}
+	struct JournalResp : Message<JournalResp> {
+		// As last told by SyncEstablishReq; 0 if never.
+		uint64_t journalId;
+		uint64_t journalSeq;
+		// Changes after journalSeq that have been applied since.
+		std::vector<uint64_t> applied;
+
+		static constexpr auto FIELDS = std::make_tuple(
+			&JournalResp::journalId, &JournalResp::journalSeq, &JournalResp::applied);
 	};
 
-	struct FullsyncCmd : Base {
-		virtual void serialize(std::ostream &stream) const {}
-		virtual void deserialize(std::istream &stream) {}
+	struct FullsyncCmd : Message<FullsyncCmd> {
+		static constexpr auto FIELDS = std::make_tuple();
 	};
 
-	struct FlushCmd : Base {
-		virtual void serialize(std::ostream &stream) const {}
-		virtual void deserialize(std::istream &stream) {}
+	struct FlushCmd : Message<FlushCmd> {
+		static constexpr auto FIELDS = std::make_tuple();
 	};
 
-	struct InspectReq : Base {
+	struct InspectReq : Message<InspectReq> {
 		std::string path;
 
-		virtual void serialize(std::ostream &stream) const {
-			::serialize(stream, this->path);
-		}
-		virtual void deserialize(std::istream &stream) {
-			::deserialize(stream, this->path);
-		}
+		static constexpr auto FIELDS = std::make_tuple(&InspectReq::path);
 	};
 
-	struct InspectResp : Base {
+	struct InspectResp : Message<InspectResp> {
 		struct Child {
 			std::string path;
 			uint64_t hash;
 
-			void serialize(std::ostream &stream) const {
-				::serialize(stream, this->path);
-				::serialize(stream, this->hash);
-			}
-			void deserialize(std::istream &stream) {
-				::deserialize(stream, this->path);
-				::deserialize(stream, this->hash);
-			}
+			static constexpr auto FIELDS = std::make_tuple(&Child::path, &Child::hash);
 		};
 
 		std::string path;
 		uint64_t hash;
 		std::vector<Child> children;
 
-		virtual void serialize(std::ostream &stream) const {
-			::serialize(stream, this->path);
-			::serialize(stream, this->hash);
-			::serialize(stream, this->children);
-		}
-		virtual void deserialize(std::istream &stream) {
-			::deserialize(stream, this->path);
-			::deserialize(stream, this->hash);
-			::deserialize(stream, this->children);
-		}
+		static constexpr auto FIELDS = std::make_tuple(
+			&InspectResp::path, &InspectResp::hash, &InspectResp::children);
 	};
 
-	struct LogReq : Base {
-		virtual void serialize(std::ostream &stream) const { }
-		virtual void deserialize(std::istream &stream) { }
+	struct LogReq : Message<LogReq> {
+		static constexpr auto FIELDS = std::make_tuple();
 	};
 
 	struct LogResp : Base {
 		std::unique_ptr<StatusLine[]> statusLines;
 
-		virtual void serialize(std::ostream &stream) const;
-		virtual void deserialize(std::istream &stream);
+		virtual void serialize(Writer &stream) const;
+		virtual void deserialize(Reader &stream);
+	};
+
+	/**
+	 * Ends the stream it's sent on. Either side may send it, and the other side then drops
+	 * whatever it has for that stream.
+	 */
+	struct StreamClose : Message<StreamClose> {
+		static constexpr auto FIELDS = std::make_tuple();
+	};
+
+	/**
+	 * Lets the primary send this many more bytes on the stream it's sent on. The replica
+	 * grants more as it works through what it was sent, so no one stream can flood it.
+	 */
+	struct StreamWindow : Message<StreamWindow> {
+		// What each stream starts out with.
+		static const uint64_t INITIAL = 4 * 1024 * 1024;
+
+		uint64_t bytes;
+
+		static constexpr auto FIELDS = std::make_tuple(&StreamWindow::bytes);
 	};
 }
 
@@ -1,6 +1,5 @@
 #include "socket.h"
 
-#include <snappy.h>
 #include <openssl/conf.h>
 #include <openssl/err.h>
 #include <openssl/evp.h>
@@ -37,15 +36,23 @@ public:
 		}
 	}
 
-	void initEncrypt(const unsigned char *key, const unsigned char *iv) {
+	void initEncrypt(const unsigned char *key) {
 		if (1 != EVP_EncryptInit_ex(this->ctx, EVP_aes_256_gcm(), NULL, NULL, NULL)) {
 			this->printError();
 			throw runtime_error("Failed to initialize encryption operation.");
 		}
 
-		if (1 != EVP_EncryptInit_ex(this->ctx, NULL, NULL, key, iv)) {
+		if (1 != EVP_EncryptInit_ex(this->ctx, NULL, NULL, key, NULL)) {
 			this->printError();
-			throw runtime_error("Failed to initialize encryption key and IV.");
+			throw runtime_error("Failed to initialize encryption key.");
+		}
+	}
+
+	// Starts a new message, keeping the key schedule from initEncrypt.
+	void resetEncrypt(const unsigned char *iv) {
+		if (1 != EVP_EncryptInit_ex(this->ctx, NULL, NULL, NULL, iv)) {
+			this->printError();
+			throw runtime_error("Failed to initialize encryption IV.");
 		}
 	}
 
@@ -83,15 +90,23 @@ public:
 		}
 	}
 
-	void initDecrypt(const unsigned char *key, const unsigned char *iv) {
+	void initDecrypt(const unsigned char *key) {
 		if (1 != EVP_DecryptInit_ex(this->ctx, EVP_aes_256_gcm(), NULL, NULL, NULL)) {
 			this->printError();
 			throw runtime_error("Failed to initialize decryption operation.");
 		}
 
-		if (1 != EVP_DecryptInit_ex(this->ctx, NULL, NULL, key, iv)) {
+		if (1 != EVP_DecryptInit_ex(this->ctx, NULL, NULL, key, NULL)) {
+			this->printError();
+			throw runtime_error("Failed to initialize decryption key.");
+		}
+	}
+
+	// Starts a new message, keeping the key schedule from initDecrypt.
+	void resetDecrypt(const unsigned char *iv) {
+		if (1 != EVP_DecryptInit_ex(this->ctx, NULL, NULL, NULL, iv)) {
 			this->printError();
-			throw runtime_error("Failed to initialize decryption key and IV.");
+			throw runtime_error("Failed to initialize decryption IV.");
 		}
 	}
 
@@ -131,24 +146,29 @@ private:
 // SocketCrypto //
 //////////////////
 
-SocketCrypto::SocketCrypto() {
-	OPENSSL_init_crypto(OPENSSL_INIT_LOAD_CONFIG, NULL);
+string SocketCrypto::key;
+
+SocketCrypto::SocketCrypto() : encryptCtx(new CipherCtx()), decryptCtx(new CipherCtx()) {
+	assert(SocketCrypto::key.size() == 32 && "Socket::CryptoInit must be called before creating sockets.");
 
 	// A (key, IV) pair must be unique.
 	// In order to avoid using extreme amounts of entropy, we seed with a random 12-byte number
-	// and then increment that number on each call to encrypt.
-	CipherCtx ctx;
-	ctx.nonce(this->iv);
+	// and then increment that number on each call to encrypt. With 96 random bits per connection,
+	// two connections' ranges overlapping is as unlikely as two random nonces colliding.
+	this->encryptCtx->nonce(this->iv);
+
+	const unsigned char *key = reinterpret_cast<const unsigned char*>(SocketCrypto::key.data());
+	this->encryptCtx->initEncrypt(key);
+	this->decryptCtx->initDecrypt(key);
 }
 
 SocketCrypto::~SocketCrypto() {
-	EVP_cleanup();
-	ERR_free_strings();
 }
 
 void SocketCrypto::setKey(const string &key) {
 	assert(key.size() == 32 && "Key must be 32 bytes.");
-	this->key = key;
+	OPENSSL_init_crypto(OPENSSL_INIT_LOAD_CONFIG, NULL);
+	SocketCrypto::key = key;
 }
 
 void SocketCrypto::incrIV() {
@@ -170,14 +190,10 @@ void SocketCrypto::encrypt(const unsigned char *buffer, size_t length, unsigned
 	unsigned char *ivOut = outBuffer + TAG_SIZE;
 	unsigned char *bufOut = outBuffer + TAG_SIZE + IV_SIZE;
 
-	CipherCtx ctx;
 	memcpy(ivOut, this->iv, IV_SIZE);
-	ctx.initEncrypt(
-		reinterpret_cast<const unsigned char*>(this->key.data()),
-		ivOut
-	);
-	int ciphertext_len = ctx.encrypt(buffer, length, bufOut);
-	ctx.tag(tagOut);
+	this->encryptCtx->resetEncrypt(ivOut);
+	int ciphertext_len = this->encryptCtx->encrypt(buffer, length, bufOut);
+	this->encryptCtx->tag(tagOut);
 
 	*outBufLen = ciphertext_len + TAG_SIZE + IV_SIZE;
 
@@ -185,17 +201,12 @@ void SocketCrypto::encrypt(const unsigned char *buffer, size_t length, unsigned
 }
 
 void SocketCrypto::decrypt(const unsigned char *buffer, size_t length, unsigned char *outBuffer, int *outBufLen) {
-	CipherCtx ctx;
-	
 	const unsigned char *tagIn = buffer;
 	const unsigned char *ivIn = buffer + TAG_SIZE;
 	const unsigned char *bufIn = buffer + TAG_SIZE + IV_SIZE;
 
-	ctx.initDecrypt(
-		reinterpret_cast<const unsigned char*>(this->key.data()),
-		ivIn
-	);
-	*outBufLen = ctx.decrypt(bufIn, length - IV_SIZE - TAG_SIZE, tagIn, outBuffer);
+	this->decryptCtx->resetDecrypt(ivIn);
+	*outBufLen = this->decryptCtx->decrypt(bufIn, length - IV_SIZE - TAG_SIZE, tagIn, outBuffer);
 }
 
 
@@ -204,9 +215,8 @@ void SocketCrypto::decrypt(const unsigned char *buffer, size_t length, unsigned
 ///////////////////
 
 void Socket::CryptoInit(const string &key) {
-	Socket::socketCrypto.setKey(key);
+	SocketCrypto::setKey(key);
 }
-SocketCrypto Socket::socketCrypto;
 
 
 ////////////
@@ -214,7 +224,7 @@ SocketCrypto Socket::socketCrypto;
 ////////////
 
 Socket::Socket()
-: sock(0), buf(new char[this->BUF_SIZE]), buf2(new char[this->BUF_SIZE]) {
+: sock(0), sendBuf(new OutputBuffer()), compression(new CompressionPolicy()), sendMutex(new mutex()), crypto(new SocketCrypto()) {
 }
 
 Socket::~Socket() {
@@ -224,6 +234,10 @@ Socket::~Socket() {
     }
 }
 
+void Socket::shutdown() {
+	::shutdown(this->sock, SHUT_RDWR);
+}
+
 void Socket::awaitWithHandler(
 	std::function<void (MSG::Type type, MSG::Base *msg)> handler,
 	chrono::duration<uint64_t> timeout
@@ -261,141 +275,181 @@ void Socket::receiveSome(char *buf, size_t neededIn) {
 	assert(needed == 0);
 }
 
-template <typename T>
-void deserializeFromStream(const char *buf, const size_t size, T &result) {
-    string str(buf, size);
-    istringstream ss(str, istringstream::binary);
-    ss.exceptions(istringstream::failbit | istringstream::badbit);
-    result.deserialize(ss);
-}
-
 Socket::Frame Socket::receive(chrono::duration<uint64_t> timeout) {
-	char *buf = this->buf.get();
-	char *buf2 = this->buf2.get();
-
 	timeval tv = chronoToTimeval(timeout);
 	setsockopt(this->sock, SOL_SOCKET, SO_RCVTIMEO, (char*)&tv, sizeof(timeval));
 
-	int bufSize = 0;
-
 	//////////////////////
 	// Encrypted packet //
 	//////////////////////
 
-	{
-		EncryptedHeader enchdr;
-
-		// Receive and deserialize header
-
-		RETHROW_NESTED(
-			this->receiveSome(buf, enchdr.wireSize()),
-			"Receiving encrypted header tv_sec=" << tv.tv_sec << " tv_usec=" << tv.tv_usec
-		);
-		deserializeFromStream(buf, enchdr.wireSize(), enchdr);
-		assert(enchdr.size <= this->BUF_SIZE);
+	char enchdrBuf[PACKET_HEADER_SIZE];
+	RETHROW_NESTED(
+		this->receiveSome(enchdrBuf, PACKET_HEADER_SIZE),
+		"Receiving encrypted header tv_sec=" << tv.tv_sec << " tv_usec=" << tv.tv_usec
+	);
+	size_t bodySize = PacketBodySize(enchdrBuf);
 
-		// Receive and decrypt body
+	BufferPool::Buffer packet = BufferPool::Take(bodySize);
+	RETHROW_NESTED(
+		this->receiveSome(packet.data(), bodySize),
+		"Failed to receive encrypted body tv_sec=" << tv.tv_sec << " tv_usec=" << tv.tv_usec
+	);
+	return this->decode(packet.data(), bodySize);
+}
 
-		RETHROW_NESTED(
-			this->receiveSome(buf, enchdr.size - enchdr.wireSize()),
-			"Failed to receive encrypted body tv_sec=" << tv.tv_sec << " tv_usec=" << tv.tv_usec
-		);
-		Socket::socketCrypto.decrypt(
-			reinterpret_cast<const unsigned char *>(buf),
-			enchdr.size - enchdr.wireSize(),
-			reinterpret_cast<unsigned char *>(buf2),
-			&bufSize
-		);
-		assert(bufSize <= this->BUF_SIZE);
+size_t Socket::PacketBodySize(const char *header) {
+	EncryptedHeader enchdr;
+	static_assert(sizeof(enchdr.size) == PACKET_HEADER_SIZE, "PACKET_HEADER_SIZE is the encrypted header");
+	enchdr.read(header);
+	int64_t bodySize = enchdr.size - static_cast<int64_t>(enchdr.wireSize());
+	if (bodySize < TAG_SIZE + IV_SIZE || enchdr.size > static_cast<int64_t>(MAX_FRAME_SIZE)) {
+		throw runtime_error("Bad encrypted packet size " + to_string(enchdr.size));
 	}
+	return bodySize;
+}
 
-	// Out: Decrypted packet in buf2
-	// Out: Decrypted packet size in bufSize
+Socket::Frame Socket::decode(char *buf, size_t bodySize) {
+	// Everything happens in place: buf holds the encrypted packet and is decrypted where it
+	// is, decompressed gets the decompressed message, and the message is deserialized straight
+	// out of that (or out of buf, if it was sent uncompressed). decompressed is sized to the
+	// frame, and goes back to the pool once the message is out of it.
+	char *plaintext = buf + TAG_SIZE + IV_SIZE;
+	int plaintextSize = 0;
+	this->crypto->decrypt(
+		reinterpret_cast<const unsigned char *>(buf),
+		bodySize,
+		reinterpret_cast<unsigned char *>(plaintext),
+		&plaintextSize
+	);
 
 	///////////////////////
 	// Compressed packet //
 	///////////////////////
 
-	{
-		Header hdr;
-
-		// Deserialize header
-
-		deserializeFromStream(buf2, hdr.wireSize(), hdr);
-		assert(hdr.type == MSG::Type::COMPRESSED);
-		assert(hdr.size <= this->BUF_SIZE);
-
-		// Decompress body
-
-		string uncompressed;
-		bool success = snappy::Uncompress(buf2 + hdr.wireSize(), hdr.size - hdr.wireSize(), &uncompressed);
-		if (!success) {
-			throw runtime_error("snappy decompression of packet failed.");
-		}
-	    assert(uncompressed.capacity() <= this->BUF_SIZE);
-		memmove(buf, uncompressed.data(), uncompressed.capacity());
-
-		bufSize = uncompressed.capacity();
+	CompressedHeader compressedHdr;
+	if (plaintextSize < static_cast<int>(compressedHdr.wireSize())) {
+		throw runtime_error("Truncated compressed header.");
+	}
+	compressedHdr.read(plaintext);
+	if (compressedHdr.type != MSG::Type::COMPRESSED || compressedHdr.size > plaintextSize ||
+		compressedHdr.rawSize < 0 || compressedHdr.rawSize > static_cast<int64_t>(MAX_FRAME_SIZE)) {
+		throw runtime_error("Bad compressed header.");
+	}
+	this->compression->setPeerCodecs(compressedHdr.codecs);
+
+	char *compressed = plaintext + compressedHdr.wireSize();
+	size_t compressedSize = compressedHdr.size - compressedHdr.wireSize();
+	size_t uncompressedSize = compressedHdr.rawSize;
+	// Stored frames can be read right where they are.
+	char *uncompressed = compressed;
+	BufferPool::Buffer decompressed;
+	if (compressedHdr.codec != Codec::NONE) {
+		decompressed = BufferPool::Take(uncompressedSize);
+		uncompressed = decompressed.data();
+		decompress(compressedHdr.codec, compressed, compressedSize, uncompressed, uncompressedSize);
+	} else if (compressedSize != uncompressedSize) {
+		throw runtime_error("Bad stored frame size.");
 	}
-
-	// Out: Uncompressed packet in buf
-	// Out: Uncompressed packet size in bufSize
 
 	/////////////////////////
 	// Uncompressed packet //
 	/////////////////////////
 
-	{
-		Header hdr;
-
-		// Deserialize header
-		{
-			deserializeFromStream(buf, hdr.wireSize(), hdr);
-			assert(hdr.type != MSG::Type::UNSET);
-			assert(hdr.size <= this->BUF_SIZE);
-		}
-
-		// Deserialize body
-		{
-			unique_ptr<MSG::Base> sub = MSG::Factory::Create(hdr.type);
-			deserializeFromStream(buf + hdr.wireSize(), hdr.size - hdr.wireSize(), *sub);
-			return Frame{hdr, std::move(sub)};
-		}
+	Header hdr;
+	if (uncompressedSize < hdr.wireSize()) {
+		throw runtime_error("Truncated message header.");
+	}
+	hdr.read(uncompressed);
+	if (hdr.type == MSG::Type::UNSET || hdr.size > static_cast<int64_t>(uncompressedSize) ||
+		hdr.size < static_cast<int64_t>(hdr.wireSize())) {
+		throw runtime_error("Bad message header.");
 	}
-}
-
-void Socket::sendBuffer(const void *buffer, size_t length) const {
-	// buffer contains {header,message}
 
-	// Now we compress.
+	MSG::Ptr<MSG::Base> sub = MSG::Factory::Create(hdr.type);
+	Reader in(uncompressed + hdr.wireSize(), hdr.size - hdr.wireSize());
+	sub->deserialize(in);
+	return Frame{hdr, std::move(sub)};
+}
 
-	string compressed;
-	size_t compressedSize = snappy::Compress((const char *)buffer, length, &compressed);
+size_t Socket::sendFrame(MSG::Type type, uint32_t stream) const {
+	// sendBuf holds {room for header, message}, and everything below happens in a buffer from
+	// the pool, sized to fit and laid out as
+	// |  encrypted header  |  TAG  |  IV  |  compressed header  |  compressed({header,message})  |
+	// where "compressed" may also be stored as is, if compressing wouldn't pay.
+	// so that each layer is written around the last instead of being copied into a new one.
+
+	Header hdr;
+	hdr.type = type;
+	hdr.size = static_cast<int64_t>(this->sendBuf->size());
+	hdr.stream = stream;
+	hdr.write(this->sendBuf->data());
+
+	EncryptedHeader enchdr;
+	CompressedHeader compressedHdr;
+	size_t overhead = enchdr.wireSize() + TAG_SIZE + IV_SIZE + compressedHdr.wireSize();
+
+	int level;
+	Codec codec = this->compression->choose(this->sendBuf->data(), hdr.size, &level);
+	size_t frameBound = overhead + maxCompressedLength(codec, hdr.size);
+	if (frameBound > MAX_FRAME_SIZE) {
+		throw runtime_error("Message of " + to_string(hdr.size) + " bytes is too large to send.");
+	}
 
-	Packet compressedPacket = { MSG::Type::COMPRESSED, compressed.data(), compressedSize };
-	string packetStr = compressedPacket.toString();
+	BufferPool::Buffer frame = BufferPool::Take(frameBound);
+	char *buf = frame.data();
+	char *encrypted = buf + enchdr.wireSize();
+	char *plaintext = encrypted + TAG_SIZE + IV_SIZE;
+	char *compressed = plaintext + compressedHdr.wireSize();
+
+	auto start = chrono::steady_clock::now();
+	size_t compressedSize = compress(codec, level, this->sendBuf->data(), hdr.size, compressed);
+	if (codec != Codec::NONE) {
+		this->compression->recordCompression(
+			codec, hdr.size, compressedSize, chrono::duration<double>(chrono::steady_clock::now() - start).count()
+		);
+		if (compressedSize >= static_cast<size_t>(hdr.size)) {
+			// Didn't pay off, so don't make the other end pay to decompress it.
+			codec = Codec::NONE;
+			compressedSize = compress(codec, level, this->sendBuf->data(), hdr.size, compressed);
+		}
+	}
 
-	// packetStr contains {header(COMPRESSED, compressedSize), compressed({header,message})}
+	compressedHdr.type = MSG::Type::COMPRESSED;
+	compressedHdr.codec = codec;
+	compressedHdr.rawSize = hdr.size;
+	compressedHdr.codecs = availableCodecs();
+	compressedHdr.size = static_cast<int64_t>(compressedHdr.wireSize() + compressedSize);
+	compressedHdr.write(plaintext);
 
-	char *buf = this->buf.get();
 	int len;
-	Socket::socketCrypto.encrypt(
-		reinterpret_cast<const unsigned char *>(packetStr.data()),
-		packetStr.size(),
-		reinterpret_cast<unsigned char*>(buf),
+	this->crypto->encrypt(
+		reinterpret_cast<const unsigned char *>(plaintext),
+		compressedHdr.size,
+		reinterpret_cast<unsigned char*>(encrypted),
 		&len
 	);
 
-	EncryptedPacket encryptedPacket = { buf, static_cast<size_t>(len) };
-	string encPacketStr = encryptedPacket.toString();
-
-	// encPacketStr contains {header(encryptedSize), encrypted(...)}
+	enchdr.size = static_cast<int64_t>(enchdr.wireSize() + len);
+	enchdr.write(buf);
 
 	timeval tv = chronoToTimeval(chrono::seconds(10));
 	setsockopt(this->sock, SOL_SOCKET, SO_SNDTIMEO, (char*)&tv, sizeof(timeval));
-	if (::send(this->sock, encPacketStr.data(), encPacketStr.size(), MSG_NOSIGNAL) != encPacketStr.size()) {
-        throw system_error(errno, system_category(), "send");
-    }
+	start = chrono::steady_clock::now();
+	// A signal or a full send buffer can cut a send short, and the rest still has to follow.
+	ssize_t sent = 0;
+	while (sent < enchdr.size) {
+		ssize_t len = ::send(this->sock, buf + sent, enchdr.size - sent, MSG_NOSIGNAL);
+		if (len == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			throw system_error(errno, system_category(), "send");
+		}
+		sent += len;
+	}
+	this->compression->recordSend(enchdr.size, chrono::duration<double>(chrono::steady_clock::now() - start).count());
 
-    StatusLine::Add("outbound", encPacketStr.size());
+    StatusLine::Add("outbound", enchdr.size);
+	return hdr.size;
 }
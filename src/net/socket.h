@@ -14,13 +14,17 @@
 #include <functional>
 #include <iostream>
 #include <memory>
+#include <mutex>
 #include <string>
 #include <sstream>
 #include <system_error>
 
+#include "compression.h"
 #include "protocol-interface.h"
+#include "../util/buffer-pool.h"
 #include "../util/chrono.h"
 #include "../util/log.h"
+#include "../util/output-buffer.h"
 #include "../util/serialize.h"
 #include <stdio.h>
 
@@ -29,19 +33,55 @@ using namespace std;
 static const int IV_SIZE = 12;
 static const int TAG_SIZE = 16;
 
-struct SocketCrypto {
+class CipherCtx;
+
+/**
+ * Cipher state for one connection. The AES key schedule is set up once per direction, and
+ * each message only sets a fresh IV. Like the Socket that owns it, not thread-safe.
+ */
+class SocketCrypto {
+public:
 	SocketCrypto();
+	SocketCrypto(const SocketCrypto &other) = delete;
+	SocketCrypto& operator=(const SocketCrypto &other) = delete;
 	~SocketCrypto();
+
+	// Writes |TAG|IV|ciphertext| to outBuffer. buffer may be outBuffer + TAG_SIZE + IV_SIZE, to
+	// encrypt in place.
 	void encrypt(const unsigned char *buffer, size_t length, unsigned char *outBuffer, int *outBufLen);
+	// Reads |TAG|IV|ciphertext| from buffer. outBuffer may be buffer + TAG_SIZE + IV_SIZE, to
+	// decrypt in place.
 	void decrypt(const unsigned char *buffer, size_t length, unsigned char *outBuffer, int *outBufLen);
-	void setKey(const std::string &key);
+
+	// The pre-shared key every connection uses. Set once at startup, before any traffic.
+	static void setKey(const std::string &key);
+
+private:
 	void incrIV();
-	std::string key;
+
+	static std::string key;
+	std::unique_ptr<CipherCtx> encryptCtx, decryptCtx;
+	// IV of the next message we send. Messages we receive carry their own.
 	unsigned char iv[IV_SIZE];
 };
 
 class Socket {
-	const size_t BUF_SIZE = 512*1024;
+
+	// Big-endian, like ::serialize.
+	static void writeInt64(char *out, int64_t val) {
+		wire::putFixed(out, static_cast<uint64_t>(val));
+	}
+	static int64_t readInt64(const char *in) {
+		return static_cast<int64_t>(wire::getFixed<uint64_t>(in));
+	}
+	static void writeInt32(char *out, uint32_t val) {
+		wire::putFixed(out, val);
+	}
+	static uint32_t readInt32(const char *in) {
+		return wire::getFixed<uint32_t>(in);
+	}
+
+	// Headers are read and written in place, in the same layout ::serialize would give them.
 
 	struct EncryptedHeader {
 		// Number of bytes in message, including Header itself.
@@ -51,37 +91,11 @@ class Socket {
 			return sizeof(this->size);
 		}
 
-		void serialize(std::ostream &stream) const {
-			::serialize(stream, this->size);
-		}
-		void deserialize(std::istream &stream) {
-			::deserialize(stream, this->size);
+		void write(char *out) const {
+			writeInt64(out, this->size);
 		}
-		string toString() const {
-			ostringstream ss(stringstream::binary);
-			this->serialize(ss);
-			string str = ss.str();
-			assert(str.size() == this->wireSize());
-			return str;
-		}
-	};
-
-	// Convenience struct for writing
-	struct EncryptedPacket {
-		const char *data;
-		size_t len;
-
-		string toString() const {
-			// Make packet header
-			EncryptedHeader hdr;
-			hdr.size = static_cast<int64_t>(hdr.wireSize() + this->len);
-			string hdrStr = hdr.toString();
-
-			// Combine everything into a string
-			ostringstream ss(stringstream::binary);
-			ss.write(hdrStr.data(), hdrStr.size());
-			ss.write(this->data, this->len);
-			return ss.str();
+		void read(const char *in) {
+			this->size = readInt64(in);
 		}
 	};
 
@@ -90,87 +104,111 @@ class Socket {
 		int64_t size;
 		// Type of message included.
 		MSG::Type type;
+		// Logical stream the message belongs to, for connections that carry several.
+		uint32_t stream;
 
 		size_t wireSize() const {
-			return sizeof(this->size) + sizeof(this->type);
+			return sizeof(this->size) + sizeof(this->type) + sizeof(this->stream);
 		}
 
-		void serialize(std::ostream &stream) const {
-			::serialize(stream, this->type);
-			::serialize(stream, this->size);
-		}
-		void deserialize(std::istream &stream) {
-			::deserialize(stream, this->type);
-			::deserialize(stream, this->size);
+		void write(char *out) const {
+			out[0] = static_cast<char>(this->type);
+			writeInt64(out + sizeof(this->type), this->size);
+			writeInt32(out + sizeof(this->type) + sizeof(this->size), this->stream);
 		}
-		string toString() const {
-			ostringstream ss(stringstream::binary);
-			this->serialize(ss);
-			string str = ss.str();
-			assert(str.size() == this->wireSize());
-			return str;
+		void read(const char *in) {
+			this->type = static_cast<MSG::Type>(in[0]);
+			this->size = readInt64(in + sizeof(this->type));
+			this->stream = readInt32(in + sizeof(this->type) + sizeof(this->size));
 		}
 	};
 
-	// Convenience struct for writing
-	struct Packet {
+	struct CompressedHeader {
+		// Number of bytes in packet, including CompressedHeader itself.
+		int64_t size;
+		// Always MSG::Type::COMPRESSED.
 		MSG::Type type;
-		const char *data;
-		size_t len;
-
-		string toString() const {
-			// Make packet header
-			Header hdr;
-			hdr.type = this->type;
-			hdr.size = static_cast<int64_t>(hdr.wireSize() + this->len);
-			string hdrStr = hdr.toString();
-
-			// Combine everything into a string
-			ostringstream ss(stringstream::binary);
-			ss.write(hdrStr.data(), hdrStr.size());
-			ss.write(this->data, this->len);
-			return ss.str();
+		Codec codec;
+		// Size of the {header,message} inside, once decompressed.
+		int64_t rawSize;
+		// What the sender can decode (see availableCodecs), so that replies only use those.
+		uint8_t codecs;
+
+		size_t wireSize() const {
+			return sizeof(this->size) + sizeof(this->type) + sizeof(this->codec) + sizeof(this->rawSize) +
+				sizeof(this->codecs);
+		}
+
+		void write(char *out) const {
+			out[0] = static_cast<char>(this->type);
+			writeInt64(out + 1, this->size);
+			out[9] = static_cast<char>(this->codec);
+			writeInt64(out + 10, this->rawSize);
+			out[18] = static_cast<char>(this->codecs);
+		}
+		void read(const char *in) {
+			this->type = static_cast<MSG::Type>(in[0]);
+			this->size = readInt64(in + 1);
+			this->codec = static_cast<Codec>(in[9]);
+			this->rawSize = readInt64(in + 10);
+			this->codecs = static_cast<uint8_t>(in[18]);
 		}
 	};
 
+public:
+	// Largest frame either end sends or accepts, headers and all. Buffers are only as big as
+	// the frames they hold, so this is just a sanity limit; it leaves room for a full-size
+	// XfrBlock that didn't compress.
+	static const size_t MAX_FRAME_SIZE = 4 * 1024 * 1024;
 
 	// Uncompressed, unencrypted packet for returning/passing around.
 	struct Frame {
 		Header header;
-		unique_ptr<MSG::Base> message;
+		MSG::Ptr<MSG::Base> message;
 	};
 
-public:
 	Socket();
 	Socket(const Socket &other) = delete;
 	Socket(Socket &&other) {
 		this->sock = other.sock;
 		other.sock = 0;
 
-		this->buf = std::move(other.buf);
-		this->buf2 = std::move(other.buf2);
+		this->crypto = std::move(other.crypto);
+		this->sendBuf = std::move(other.sendBuf);
+		this->compression = std::move(other.compression);
+		this->sendMutex = std::move(other.sendMutex);
 	}
 	Socket& operator=(const Socket &other) = delete;
 	Socket& operator=(Socket &&other) {
 		swap(this->sock, other.sock);
-		swap(this->buf, other.buf);
-		swap(this->buf2, other.buf2);
+		swap(this->crypto, other.crypto);
+		swap(this->sendBuf, other.sendBuf);
+		swap(this->compression, other.compression);
+		swap(this->sendMutex, other.sendMutex);
 		return *this;
 	}
 	virtual ~Socket();
 
+	// Safe to call from several threads at once. Returns the message's size before
+	// compression, which is what stream windows count.
 	template <typename T>
-	void send(const T &msg) const {
-		ostringstream msgSs(stringstream::binary);
-		msg.serialize(msgSs);
-		string message = msgSs.str();
+	size_t send(const T &msg, uint32_t stream=0) const {
+		std::lock_guard<std::mutex> lock(*this->sendMutex);
 
-		Packet packet = { MSG::Factory::EnumType<T>(), message.data(), message.size() };
-		string packetStr = packet.toString();
+		// Serialized straight into place, after room for the header.
+		this->sendBuf->reset(Header().wireSize());
+		if constexpr (HasWireSize<T>::value) {
+			this->sendBuf->reserve(::wireSize(msg));
+		}
+		Writer out(*this->sendBuf);
+		msg.serialize(out);
+
+		size_t result;
 		RETHROW_NESTED(
-			this->sendBuffer(packetStr.data(), packetStr.size()),
+			result = this->sendFrame(MSG::Factory::EnumType<T>(), stream),
 			"sending " << MSG::Factory::EnumType<T>()
 		);
+		return result;
 	}
 
 	void awaitWithHandler(
@@ -180,30 +218,56 @@ public:
 
 	// Packets can be pretty big——need to be allocated on heap, and can't be copied around.
 	template <typename T>
-	std::unique_ptr<T> awaitWithType(
+	MSG::Ptr<T> awaitWithType(
 		MSG::Type type,
 		chrono::duration<uint64_t> timeout=chrono::seconds(30)
 	) {
 		Frame frame;
 		RETHROW_NESTED(frame = this->receive(timeout), "awaitWithType " << type);
-		T *castedSub = dynamic_cast<T*>(frame.message.release());
-		return unique_ptr<T>(castedSub);
+		T *castedSub = dynamic_cast<T*>(frame.message.get());
+		if (castedSub != nullptr) {
+			frame.message.release();
+		}
+		return MSG::Ptr<T>(castedSub);
+	}
+
+	// Any message, on any stream. Only one thread should be receiving at a time.
+	Frame awaitFrame(chrono::duration<uint64_t> timeout=chrono::seconds(30)) {
+		return this->receive(timeout);
 	}
 
+	// For readers that gather packets off the socket themselves, e.g. without blocking. A
+	// packet is PACKET_HEADER_SIZE bytes of header, then PacketBodySize(header) bytes of body,
+	// which decode() turns into a frame. Only one thread should be decoding at a time.
+	static const size_t PACKET_HEADER_SIZE = sizeof(int64_t);
+	// Throws if the header is out of bounds.
+	static size_t PacketBodySize(const char *header);
+	Frame decode(char *body, size_t bodySize);
+
+	// Wakes whoever is blocked receiving on this socket, and fails any further sends.
+	void shutdown();
+
 	static void CryptoInit(const string &key);
 
 protected:
-	static SocketCrypto socketCrypto;
-
 	void receiveSome(char *buf, size_t neededIn);
 
 	// Receives a message to the internal buffer.
 	Frame receive(std::chrono::duration<uint64_t> timeout=std::chrono::seconds(30));
 
-	void sendBuffer(const void *buffer, size_t length) const;
+	// Frames, compresses, encrypts and sends the message serialized into sendBuf.
+	size_t sendFrame(MSG::Type type, uint32_t stream) const;
 
 	unsigned int sock;
-	std::unique_ptr<char> buf, buf2;
+	// Frames themselves are built and received in buffers from BufferPool, held only as long
+	// as it takes.
+	mutable std::unique_ptr<OutputBuffer> sendBuf;
+	mutable std::unique_ptr<CompressionPolicy> compression;
+	// Guards sendBuf, compression and the encrypting half of crypto. Receiving has its own.
+	mutable std::unique_ptr<std::mutex> sendMutex;
+	// Per connection, so that no cipher state is shared between threads. Mutable since
+	// sending doesn't change the socket as far as callers are concerned.
+	mutable std::unique_ptr<SocketCrypto> crypto;
 };
 
 #endif
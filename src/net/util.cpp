@@ -6,6 +6,7 @@
 #include <stdlib.h>
 #include <errno.h>
 #include <iostream>
+#include <netinet/tcp.h>
 #include <unistd.h>
 #include <system_error>
 
@@ -30,3 +31,10 @@ AddrInfo::~AddrInfo() {
         freeaddrinfo(this->servinfo);
     }
 }
+
+void setNoDelay(int fd) {
+    int yes = 1;
+    if (setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(int)) == -1) {
+        throw system_error(errno, system_category(), "setsockopt TCP_NODELAY");
+    }
+}
@@ -19,4 +19,8 @@ public:
     struct addrinfo *servinfo;
 };
 
+// Each send() is a whole frame, so Nagle's algorithm has nothing to coalesce. All it would do
+// is hold a pipelined request back until the previous one is ACKed.
+void setNoDelay(int fd);
+
 #endif
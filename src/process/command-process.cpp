@@ -57,7 +57,8 @@ void CommandProcess::main() {
 
                     MSG::InfoResp resp;
                     resp.payloads.push_back({
-                        this->instanceId, "reachable", this->index->size(), this->index->hash()
+                        this->instanceId, "reachable", this->index->size(), this->index->hash(),
+                        this->index->excludesFingerprint()
                     });
 
                     for (auto &replica : *(this->syncThreads)) {
@@ -67,7 +68,7 @@ void CommandProcess::main() {
                                 resp.payloads.push_back(payload);
                             }
                         } catch (timeout_error e) {
-                            resp.payloads.push_back({ "", "DOWN", 0, 0 });
+                            resp.payloads.push_back({ "", "DOWN", 0, 0, 0 });
                         }
                     }
 
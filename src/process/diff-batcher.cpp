@@ -0,0 +1,69 @@
+#include "diff-batcher.h"
+
+#include <algorithm>
+#include <cmath>
+
+#include "../net/protocol.h"
+
+using namespace std;
+
+namespace {
+    // Per sample, so that the last few dozen DiffResps count for most of the fit.
+    const double DECAY = 0.95;
+}
+
+DiffBatcher::DiffBatcher(size_t pipelineDepth) : pipelineDepth(max<size_t>(pipelineDepth, 1)) {
+}
+
+size_t DiffBatcher::batchSize(size_t roundQueries) const {
+    double perRequest, perQuery;
+    if (!this->costs(perRequest, perQuery)) {
+        return DEFAULT_QUERIES;
+    }
+
+    double rtt = chrono::duration<double>(this->rtt).count();
+    // Enough that the pipeline doesn't run dry waiting on a round trip.
+    double keepBusy = (rtt / this->pipelineDepth - perRequest) / perQuery;
+    // Where waiting on a bigger first request starts to cost more than fewer requests save.
+    double amortize = sqrt(roundQueries * perRequest / perQuery);
+
+    double result = max(keepBusy, amortize);
+    result = min(result, static_cast<double>(MSG::DiffReq::MAX_RECORDS));
+    return max(static_cast<size_t>(result), size_t(MIN_QUERIES));
+}
+
+void DiffBatcher::answered(size_t queries, Clock::duration latency, Clock::duration busy) {
+    this->rtt = min(this->rtt, latency);
+    if (busy <= Clock::duration::zero()) {
+        return;
+    }
+
+    double x = queries;
+    double y = chrono::duration<double>(busy).count();
+    this->weight = this->weight * DECAY + 1;
+    this->sumX = this->sumX * DECAY + x;
+    this->sumY = this->sumY * DECAY + y;
+    this->sumXX = this->sumXX * DECAY + x * x;
+    this->sumXY = this->sumXY * DECAY + x * y;
+}
+
+DiffBatcher::Clock::duration DiffBatcher::minLatency() const {
+    return this->rtt;
+}
+
+bool DiffBatcher::costs(double &perRequest, double &perQuery) const {
+    if (this->weight < 2 || this->sumX <= 0 || this->sumY <= 0) {
+        return false;
+    }
+
+    // Until requests of different sizes have been answered, there's no telling the two apart.
+    // The last of each round is usually short.
+    double det = this->weight * this->sumXX - this->sumX * this->sumX;
+    // That is, the sizes vary by less than a query.
+    if (det < this->weight * this->weight) {
+        return false;
+    }
+    perQuery = (this->weight * this->sumXY - this->sumX * this->sumY) / det;
+    perRequest = (this->sumY - perQuery * this->sumX) / this->weight;
+    return perQuery > 0 && perRequest >= 0;
+}
@@ -0,0 +1,47 @@
+#ifndef PROCESS_DIFF_BATCHER_H
+#define PROCESS_DIFF_BATCHER_H
+
+#include <chrono>
+#include <cstddef>
+
+/**
+ * Picks how many queries go in each DiffReq of a fullsync, from what the replica's answers show
+ * about the link. A DiffReq keeps the replica and the link busy for a fixed time per request plus
+ * a time per query, which is fitted to how far apart its DiffResp arrives from the one before.
+ *
+ * Requests should be big enough that the pipeline's worth of them in flight covers a round trip,
+ * and otherwise only as big as pays for their fixed cost: nothing downstream can start on a
+ * request until all of it is there, so a round waits out one request's worth of queries before
+ * the replica gets going.
+ */
+class DiffBatcher {
+public:
+	typedef std::chrono::steady_clock Clock;
+
+	// Until there's anything to go by.
+	static const size_t DEFAULT_QUERIES = 256;
+	static const size_t MIN_QUERIES = 32;
+
+	DiffBatcher(size_t pipelineDepth);
+
+	// Queries the next DiffReq of a round that asks roundQueries in all should carry.
+	size_t batchSize(size_t roundQueries) const;
+	// The DiffResp to a DiffReq of queries queries arrived, latency after the DiffReq was sent.
+	// busy is how long since the DiffResp before it arrived, if the DiffReq was in flight all
+	// that time; zero if that's not known.
+	void answered(size_t queries, Clock::duration latency, Clock::duration busy);
+	// Shortest time a DiffReq has taken to be answered: about a round trip.
+	Clock::duration minLatency() const;
+
+private:
+	// Fitted costs in seconds, false if there isn't enough to go by yet.
+	bool costs(double &perRequest, double &perQuery) const;
+
+	size_t pipelineDepth;
+	Clock::duration rtt = Clock::duration::max();
+	// Least squares sums over (queries, seconds busy), with older samples weighing less so that
+	// the fit follows the link as it changes.
+	double weight = 0, sumX = 0, sumY = 0, sumXX = 0, sumXY = 0;
+};
+
+#endif
@@ -9,6 +9,7 @@ void FanoutPolicy::push(const PolicyHost &host, const PolicyFile &file) {
 	lock_guard<mutex> lock(this->m);
 
 	this->pending[host].push_back(file);
+	++this->unfinished[host][file.path];
 	++this->hostStats[host].remaining;
 
 	// Uncomment for perf timing
@@ -16,20 +17,38 @@ void FanoutPolicy::push(const PolicyHost &host, const PolicyFile &file) {
 	// 	LOG("Started fanout.");
 	// }
 
-	this->cv.notify_one();
+	// Workers for other hosts, or held back on something, share the cv.
+	this->cv.notify_all();
 }
 
 PolicyPlan FanoutPolicy::pop(const PolicyHost &host) {
 	unique_lock<mutex> lock(this->m);
-	this->cv.wait(lock, [this,host] { return !this->pending[host].empty(); });
-
-	auto firstItem = this->pending[host].front();
+	deque<PolicyFile>::iterator it;
+	this->cv.wait(lock, [this, host, &it] {
+		it = this->next(host);
+		if (it != this->pending[host].end()) {
+			return true;
+		}
+		// Everything left is held back on something that isn't going anywhere, e.g. two links
+		// queued with each other as linkTo after a rename reordered their group. Better to send
+		// one as content than to wait forever.
+		if (!this->pending[host].empty() && this->inFlight[host] == 0) {
+			it = this->pending[host].begin();
+			return true;
+		}
+		return false;
+	});
 
 	PolicyPlan plan;
-	plan.file = firstItem;
+	plan.file = *it;
 	plan.steps.value = host;
 
-	this->pending[host].pop_front();
+	this->pending[host].erase(it);
+	++this->inFlight[host];
+	if (!plan.file.renamedFrom.empty()) {
+		this->renamesInFlight[host].insert(plan.file.path);
+		this->renamesInFlight[host].insert(plan.file.renamedFrom);
+	}
 	--this->hostStats[host].remaining;
 	++this->hostStats[host].completed;
 
@@ -43,6 +62,67 @@ PolicyPlan FanoutPolicy::pop(const PolicyHost &host) {
 	return plan;
 }
 
+void FanoutPolicy::done(const PolicyHost &host, const PolicyFile &file) {
+	lock_guard<mutex> lock(this->m);
+
+	map<Relpath, int> &paths = this->unfinished[host];
+	auto it = paths.find(file.path);
+	if (it != paths.end() && --it->second <= 0) {
+		paths.erase(it);
+	}
+	--this->inFlight[host];
+	if (!file.renamedFrom.empty()) {
+		multiset<Relpath> &renames = this->renamesInFlight[host];
+		for (const Relpath &path : { file.path, file.renamedFrom }) {
+			auto search = renames.find(path);
+			if (search != renames.end()) {
+				renames.erase(search);
+			}
+		}
+	}
+
+	// Whatever was held back on file may be good to go now.
+	this->cv.notify_all();
+}
+
+deque<PolicyFile>::iterator FanoutPolicy::next(const PolicyHost &host) {
+	deque<PolicyFile> &files = this->pending[host];
+	const map<Relpath, int> &paths = this->unfinished[host];
+	// Renames in flight, and then those queued ahead of the file being looked at. The first
+	// rename queued is only ever held by those in flight, so this always gets going again.
+	multiset<Relpath> renames = this->renamesInFlight[host];
+	for (auto it = files.begin(); it != files.end(); ++it) {
+		const PolicyFile &file = *it;
+		bool held = within(file.path, renames) || (!file.renamedFrom.empty() && within(file.renamedFrom, renames));
+
+		bool isLink = file.type == FileRecord::Type::FILE && !file.linkTo.empty() && file.linkTo != file.path;
+		held = held || (isLink && paths.find(file.linkTo) != paths.end());
+
+		if (!held) {
+			return it;
+		}
+		if (!file.renamedFrom.empty()) {
+			renames.insert(file.path);
+			renames.insert(file.renamedFrom);
+		}
+	}
+	return files.end();
+}
+
+bool FanoutPolicy::within(const Relpath &path, const multiset<Relpath> &paths) {
+	if (paths.empty()) {
+		return false;
+	}
+	for (Relpath ancestor = path; ; ancestor = ancestor.parent_path()) {
+		if (paths.count(ancestor) > 0) {
+			return true;
+		}
+		if (!ancestor.has_parent_path()) {
+			return false;
+		}
+	}
+}
+
 PolicyStats FanoutPolicy::stats(const PolicyHost &host) {
 	lock_guard<mutex> lock(this->m);
 	return this->hostStats[host];
@@ -7,6 +7,7 @@
 #include <deque>
 #include <map>
 #include <mutex>
+#include <set>
 
 class FanoutPolicy : public Policy {
 public:
@@ -14,13 +15,28 @@ public:
 	virtual void push(const PolicyHost &host, const PolicyFile &file);
 	virtual PolicyPlan pop(const PolicyHost &host);
 	virtual PolicyStats stats(const PolicyHost &host);
+	virtual void done(const PolicyHost &host, const PolicyFile &file);
 	virtual void waitUntilEmpty();
 private:
+	// The first of host's pending files that isn't held back, or end() if there's none.
+	std::deque<PolicyFile>::iterator next(const PolicyHost &host);
+	// Whether path is one of paths, or under one.
+	static bool within(const Relpath &path, const std::multiset<Relpath> &paths);
+
 	std::condition_variable empty_cv;
 	std::condition_variable cv;
 	std::map<PolicyHost, std::deque<PolicyFile>> pending;
 	std::map<PolicyFile, int> filePendingCount;
 	std::map<PolicyHost, PolicyStats> hostStats;
+	// Paths queued for or in flight to each host, with how many times. A hard link is held back
+	// while its linkTo is here, since the replica can only link to a copy it has received.
+	std::map<PolicyHost, std::map<Relpath, int>> unfinished;
+	// Plans popped for each host and not yet done.
+	std::map<PolicyHost, int> inFlight;
+	// Both ends of each rename in flight to a host. Anything at or under either is held back
+	// until it's done, as is anything behind a rename still queued, so that a change under
+	// its destination can't reach the replica first and then be renamed over.
+	std::map<PolicyHost, std::multiset<Relpath>> renamesInFlight;
 	std::mutex m;
 };
 
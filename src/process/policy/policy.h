@@ -35,7 +35,7 @@ public:
 		return stream;
 	}
 
-	void serialize(std::ostream &stream) const {
+	void serialize(Writer &stream) const {
 		::serialize(stream, this->isLocal);
 		if (this->isLocal) {
 			::serialize(stream, this->instanceId);
@@ -44,7 +44,7 @@ public:
 			::serialize(stream, this->port);
 		}
 	}
-	void deserialize(std::istream &stream) {
+	void deserialize(Reader &stream) {
 		::deserialize(stream, this->isLocal);
 		if (this->isLocal) {
 			::deserialize(stream, this->instanceId);
@@ -53,6 +53,12 @@ public:
 			::deserialize(stream, this->port);
 		}
 	}
+	size_t wireSize() const {
+		if (this->isLocal) {
+			return ::wireSize(this->isLocal) + ::wireSize(this->instanceId);
+		}
+		return ::wireSize(this->isLocal) + ::wireSize(this->host) + ::wireSize(this->port);
+	}
 
 	std::string instanceId;
 	std::string host, port;
@@ -76,21 +82,31 @@ struct PolicyFile {
 	Relpath path;
 	std::filesystem::path targetPath;  // for symlinks only
 	FileRecord::Type type;
+	// Set if path was renamed from here, so the replica can move it instead of receiving it.
+	Relpath renamedFrom;
+	// Position in the primary's change journal, 0 if not from the journal (e.g. from a diff).
+	uint64_t seq = 0;
+	// Files only: the first indexed hard link to this file's inode on the primary, which may be
+	// path itself. Empty if the file has no other indexed links.
+	Relpath linkTo;
+	// Files only: content hash, so the replica can tell whether its linkTo is current.
+	HashT version = NULL_HASH;
+
+	static constexpr auto FIELDS = std::make_tuple(
+		&PolicyFile::path, &PolicyFile::targetPath, &PolicyFile::type, &PolicyFile::renamedFrom,
+		&PolicyFile::seq, &PolicyFile::linkTo, &PolicyFile::version);
 
-	void serialize(std::ostream &stream) const {
-		::serialize(stream, this->path);
-		::serialize(stream, this->targetPath);
-		::serialize(stream, this->type);
-	}
-	void deserialize(std::istream &stream) {
-		::deserialize(stream, this->path);
-		::deserialize(stream, this->targetPath);
-		::deserialize(stream, this->type);
-	}
 	std::string debugString() const {
 		std::stringstream stream;
 		// stream << L"PolicyFile[" << this->path << L" | " << this->targetPath << L" | " << std::to_wstring(static_cast<int>(this->type)) << L"]";
-		stream << "PolicyFile[" << this->path << " | " << this->targetPath << " | " << std::to_string(static_cast<int>(this->type)) << "]";
+		stream << "PolicyFile[" << this->path << " | " << this->targetPath << " | " << std::to_string(static_cast<int>(this->type));
+		if (!this->renamedFrom.empty()) {
+			stream << " | from " << this->renamedFrom;
+		}
+		if (!this->linkTo.empty() && this->linkTo != this->path) {
+			stream << " | link to " << this->linkTo;
+		}
+		stream << "]";
 		return stream.str();
 	}
 };
@@ -116,28 +132,15 @@ struct Tree {
 		return stream;
 	}
 
-	void serialize(std::ostream &stream) const {
-		::serialize(stream, this->value);
-		::serialize(stream, this->children);
-	}
-	void deserialize(std::istream &stream) {
-		::deserialize(stream, this->value);
-		::deserialize(stream, this->children);
-	}
+	static constexpr auto FIELDS = std::make_tuple(&Tree::value, &Tree::children);
 };
 
 struct PolicyPlan {
 	PolicyFile file;
 	Tree<PolicyHost> steps;
 
-	void serialize(std::ostream &stream) const {
-		::serialize(stream, this->file);
-		::serialize(stream, this->steps);
-	}
-	void deserialize(std::istream &stream) {
-		::deserialize(stream, this->file);
-		::deserialize(stream, this->steps);
-	}
+	static constexpr auto FIELDS = std::make_tuple(&PolicyPlan::file, &PolicyPlan::steps);
+
 	std::string debugString() const {
 		std::stringstream stream;
 		stream << "PolicyPlan[file=" << file.debugString() << "]";
@@ -151,6 +154,8 @@ public:
 	virtual void push(const PolicyHost &host, const PolicyFile &file) = 0;
 	virtual PolicyPlan pop(const PolicyHost &host) = 0;
 	virtual PolicyStats stats(const PolicyHost &host) = 0;
+	// Called once a popped plan has been dealt with, whether it succeeded or was pushed again.
+	virtual void done(const PolicyHost &host, const PolicyFile &file) {}
 	const PolicyHost us;
 };
 
@@ -95,7 +95,8 @@ protected:
 			}
 		}
 
-		return std::move(this->messages.front());
+		// A copy, so that the message is still there to retry should handling it fail.
+		return this->messages.front();
 	}
 
 	Message consume() {
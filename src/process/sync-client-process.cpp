@@ -1,24 +1,49 @@
 #include "sync-client-process.h"
 
+#include <algorithm>
+#include <deque>
 #include <functional>
 #include <fstream>
 #include <iostream>
+#include <map>
+#include <set>
 #include <stdexcept>
+#include <tuple>
 
 #include "../net/protocol.h"
+#include "diff-batcher.h"
 
 using namespace std;
 
+namespace {
+    // DiffReqs sent but not yet answered, in bytes. Half a stream window, so that diffing
+    // never waits on the replica to grant more.
+    const size_t MAX_DIFF_BYTES_IN_FLIGHT = MSG::StreamWindow::INITIAL / 2;
+    // IBLT cells per child a directory's first sketch gets, besides MIN_SKETCH_CELLS, before
+    // there's a difference to size it by.
+    const size_t FIRST_SKETCH_CHILDREN_PER_CELL = 64;
+    const size_t MIN_SKETCH_CELLS = 64;
+    // Past this many bytes a child, a sketch costs about what asking about each child does.
+    const size_t MAX_SKETCH_BYTES_PER_CHILD = 4;
+}
+
 //////////////
 // Dispatch //
 //////////////
 
 SyncClientProcess::SyncClientProcess(
-    const PolicyHost &host, Index &index, TransferProcess &transferProc, bool verbose
+    const PolicyHost &host, PeerSession &session, Index &index, const ExcludeSet &excludes,
+    ChangeJournal &journal, TransferProcess &transferProc, size_t pipelineDepth, size_t maxLookahead,
+    bool verbose
 ) {
     this->host = host;
+    this->session = &session;
     this->index = &index;
+    this->excludes = excludes.patterns();
+    this->journal = &journal;
     this->transferProc = &transferProc;
+    this->pipelineDepth = max<size_t>(pipelineDepth, 1);
+    this->maxLookahead = maxLookahead;
     this->verbose = verbose;
     this->th = thread([this] () {
         LOG("-- Starting SyncClientProcess thread for " << this->host);
@@ -48,9 +73,24 @@ void SyncClientProcess::main() {
         STATUS(this->status, "Idle");
         Message msg = this->peek();
         switch (msg.type) {
-        case MT::FULLSYNC:
-            RETHROW_NESTED(this->performFullsync(), "SyncClientProcess::main.FULLSYNC");
+        case MT::FULLSYNC: {
+            vector<SyncClientProcess*> followers = msg.payload.cast<vector<SyncClientProcess*>>();
+            try {
+                RETHROW_NESTED(this->performFullsync(followers), "SyncClientProcess::main.FULLSYNC");
+            } catch (const exception &e) {
+                if (!followers.empty()) {
+                    // Their fullsync shouldn't hinge on ours ever succeeding, so each does its own,
+                    // and our retry goes without them.
+                    for (SyncClientProcess *follower : followers) {
+                        follower->castFullsync();
+                    }
+                    this->consume();
+                    this->castFullsync();
+                }
+                throw;
+            }
             break;
+        }
         case MT::INFO:
             RETHROW_NESTED(this->reply(msg.refid, this->performInfo()), "SyncClientProcess::main.FULLSYNC");
             break;
@@ -59,7 +99,59 @@ void SyncClientProcess::main() {
     }
 }
 
-void SyncClientProcess::performFullsync() {
+bool SyncClientProcess::replayJournal() {
+    if (this->lastSyncWasReplay) {
+        this->lastSyncWasReplay = false;
+        return false;
+    }
+
+    STATUS(this->status, "Checking journal position");
+    unique_ptr<PeerSession::Stream> remote = this->openStream();
+    MSG::JournalReq req;
+    RETHROW_NESTED(remote->send(req), "sending JOURNAL_REQ");
+    MSG::Ptr<MSG::JournalResp> resp;
+    RETHROW_NESTED(
+        resp = remote->awaitWithType<MSG::JournalResp>(MSG::Type::JOURNAL_RESP),
+        "awaiting JOURNAL_RESP"
+    );
+    if (!resp || resp->journalId != this->journal->id()) {
+        return false;
+    }
+
+    uint64_t seq = resp->journalSeq;
+    set<uint64_t> applied(resp->applied.begin(), resp->applied.end());
+    uint64_t replayed = 0;
+    bool reachable = this->journal->since(seq, [this, &applied, &replayed] (const PolicyFile &file) {
+        if (applied.count(file.seq) > 0) {
+            return;
+        }
+        if (this->verbose) {
+            LOG("Replaying " << file.path);
+        }
+        this->transferProc->castTransfer(this->host, file);
+        ++replayed;
+    });
+    if (!reachable) {
+        LOG("Journal no longer reaches back to " << seq << " for " << this->host << ", diffing instead.");
+        return false;
+    }
+
+    LOG("Replayed " << replayed << " journal entries after " << seq << " for " << this->host << ".");
+    StatusLine::Add("journalReplayed", replayed);
+    this->lastSyncWasReplay = true;
+    return true;
+}
+
+void SyncClientProcess::performFullsync(const vector<SyncClientProcess*> &followers) {
+    if (this->replayJournal()) {
+        // What this replica missed says nothing about what they did.
+        for (SyncClientProcess *follower : followers) {
+            follower->castFullsync();
+        }
+        return;
+    }
+    this->lastSyncWasReplay = false;
+
     /**
      * An epoch serves as a txnid for a fullsync.
      * Why do we use the index hash? Well, we should always be sending the same DiffReqs
@@ -70,12 +162,47 @@ void SyncClientProcess::performFullsync() {
     STATUS(this->status, "Fullsync " << epoch);
     if (this->verbose) {
         LOG("Started fullsync.");
+        if (!followers.empty()) {
+            LOG("Sharing it with " << followers.size() << " replicas in the same state.");
+        }
     }
 
-    Socket remote = this->connect();
-
-	this->index->diff([this,epoch,&remote] (const deque<std::filesystem::path>& seen) {
+    unique_ptr<PeerSession::Stream> remote = this->openStream();
+    if (!this->diffProgress.level.empty() && this->diffProgress.hash == epoch) {
+        MSG::DiffResumeReq req;
+        req.epoch = epoch;
+        RETHROW_NESTED(remote->send(req), "sending DIFF_RESUME_REQ");
+        MSG::Ptr<MSG::DiffResumeResp> resp;
+        RETHROW_NESTED(
+            resp = remote->awaitWithType<MSG::DiffResumeResp>(MSG::Type::DIFF_RESUME_RESP),
+            "awaiting DIFF_RESUME_RESP"
+        );
+        if (resp && resp->resumable) {
+            StatusLine::Add("client resumed fullsyncs", 1);
+        } else {
+            LOG("Replica " << this->host << " no longer has the last fullsync's progress, starting over.");
+            this->diffProgress = Index::DiffProgress();
+        }
+    }
+    // Numbers queries through the session, so that the replica can answer with these instead
+    // of their paths.
+    uint32_t nextQueryId = 0;
+    DiffBatcher batcher(this->pipelineDepth);
+    // When the last DiffResp arrived.
+    chrono::steady_clock::time_point lastArrival;
+    // How long the last round of diff took in all, and what it found.
+    chrono::steady_clock::duration roundTime = chrono::steady_clock::duration::zero();
+    size_t roundQueries = 0;
+    size_t roundAnswers = 0;
+    size_t lookahead = min(this->maxLookahead, size_t(DiffBatcher::DEFAULT_QUERIES));
+    // Per fullsync: DiffReqs sent, their queries, and how many the batcher asked for.
+    size_t batches = 0;
+    size_t batchQueries = 0;
+    size_t batchTargets = 0;
+
+	this->index->diff([this,epoch,&remote,&nextQueryId,&batcher,&lastArrival,&roundTime,&roundQueries,&roundAnswers,&batches,&batchQueries,&batchTargets] (const deque<std::filesystem::path>& seen) {
         // Oracle function
+        auto roundStart = chrono::steady_clock::now();
 
         deque<std::filesystem::path> result;
 
@@ -91,101 +218,306 @@ void SyncClientProcess::performFullsync() {
             );
         };
 
-        // Let's check in with the remote.
+        // Let's check in with the remote, keeping up to pipelineDepth DiffReqs in flight so
+        // that a slow link isn't idle for a whole round trip per request.
         deque<std::filesystem::path> sent(seen);
+        // (requestId, number of queries, bytes, when it was sent) of each DiffReq awaiting its
+        // DiffResp.
+        deque<tuple<uint32_t, size_t, size_t, chrono::steady_clock::time_point>> inFlight;
+        size_t inFlightBytes = 0;
+        // Paths of the queries in flight, the first numbered unansweredId.
+        deque<std::filesystem::path> unanswered;
+        uint32_t unansweredId = nextQueryId;
         MSG::DiffReq req;
-        unique_ptr<MSG::DiffResp> resp;
         req.epoch = epoch;
+        // At most what req will serialize to, before front coding.
+        size_t reqBytes = 0;
+
+        function<void ()> receive = [this, &remote, &inFlight, &inFlightBytes, &unanswered, &unansweredId, &result, &answerCtr, &updateStats, &batcher, &lastArrival] () {
+            MSG::Ptr<MSG::DiffResp> resp;
+            RETHROW_NESTED(
+                resp = remote->awaitWithType<MSG::DiffResp>(MSG::Type::DIFF_RESP),
+                "awaiting DIFF_RESP"
+            );
+            auto arrival = remote->arrived();
+            auto [requestId, count, bytes, sentAt] = inFlight.front();
+            if (!resp || resp->requestId != requestId) {
+                throw runtime_error("DIFF_RESP doesn't answer DIFF_REQ " + to_string(requestId));
+            }
+            inFlight.pop_front();
+            inFlightBytes -= bytes;
+
+            // If this one was sent before the last DiffResp arrived, the replica and the link
+            // spent all the time since then on it.
+            bool busy = lastArrival > sentAt;
+            batcher.answered(count, arrival - sentAt, busy ? arrival - lastArrival : chrono::steady_clock::duration::zero());
+            lastArrival = arrival;
+
+            // Should the connection drop before the round is over, these needn't be asked again.
+            for (size_t i = 0; i < count; i++) {
+                this->diffProgress.answered[unanswered[i]] = false;
+            }
+            for (uint32_t id : resp->answers) {
+                // Wraps around if id is from an earlier request.
+                uint32_t offset = id - unansweredId;
+                if (offset >= count) {
+                    throw runtime_error("DIFF_RESP answers query " + to_string(id) + ", which its DIFF_REQ didn't ask.");
+                }
+                result.push_back(unanswered[offset]);
+                this->diffProgress.answered[unanswered[offset]] = true;
+            }
+            unanswered.erase(unanswered.begin(), unanswered.begin() + count);
+            unansweredId += count;
+            answerCtr += resp->answers.size();
+            StatusLine::Add("client answers", resp->answers.size());
+            updateStats("<--");
+        };
+        function<void ()> flush = [this, &remote, &req, &reqBytes, &inFlight, &inFlightBytes, &nextQueryId, &queryCtr, &receive, &updateStats, &batches, &batchQueries] () {
+            // Leaves the stream window room for everything else on the stream.
+            while (!inFlight.empty() && inFlightBytes + reqBytes > MAX_DIFF_BYTES_IN_FLIGHT) {
+                receive();
+            }
+
+            req.requestId = this->nextRequestId++;
+            req.firstId = nextQueryId;
+            nextQueryId += req.queries.size();
+            queryCtr += req.queries.size();
+            batches++;
+            batchQueries += req.queries.size();
+            StatusLine::Add("client queries", req.queries.size());
+            StatusLine::Add("client batches", 1);
+            // Before sending, as the DiffResp can arrive before send returns.
+            auto sentAt = chrono::steady_clock::now();
+            RETHROW_NESTED(
+                remote->send(req),
+                "sending DIFF_REQ"
+            );
+            inFlight.push_back(make_tuple(req.requestId, req.queries.size(), reqBytes, sentAt));
+            inFlightBytes += reqBytes;
+            req.queries.clear();
+            reqBytes = 0;
+            updateStats("-->");
+
+            while (inFlight.size() >= this->pipelineDepth) {
+                receive();
+            }
+        };
 
         updateStats("-->");
 
+        size_t batchSize = 0;
         while (!sent.empty()) {
+            if (req.queries.empty()) {
+                batchSize = batcher.batchSize(seen.size());
+                batchTargets += batchSize;
+            }
+
             string front = sent.front();
+            reqBytes += front.size() + sizeof(uint64_t) + 2 * wire::varintSize(front.size());
             req.queries.push_back({ front, this->index->hash(front) });
+            unanswered.push_back(std::move(sent.front()));
             sent.pop_front();
 
-            if (req.queries.size() == MSG::DiffReq::MAX_RECORDS) {
-                queryCtr += req.queries.size();
-                StatusLine::Add("client queries", req.queries.size());
-                RETHROW_NESTED(
-                    remote.send(req),
-                    "sending DIFF_REQ"
-                )
-                
-                req.queries.clear();
-
-                updateStats("<--");
-
-                RETHROW_NESTED(
-                    resp = remote.awaitWithType<MSG::DiffResp>(MSG::Type::DIFF_RESP),
-                    "awaiting DIFF_RESP"
-                );
-                for (const auto &answer : resp->answers) {
-                    result.push_back(answer.path);
-                }
-                answerCtr += resp->answers.size();
-                StatusLine::Add("client answers", resp->answers.size());
-
-                updateStats("-->");
+            if (req.queries.size() >= batchSize || reqBytes >= MSG::DiffReq::MAX_BYTES) {
+                flush();
             }
         }
 
         if (req.queries.size() > 0) {
-            queryCtr += req.queries.size();
-            StatusLine::Add("client queries", req.queries.size());
-            RETHROW_NESTED(
-                remote.send(req),
-                "sending final DIFF_REQ"
-            );
-
-            RETHROW_NESTED(
-                resp = remote.awaitWithType<MSG::DiffResp>(MSG::Type::DIFF_RESP),
-                "awaiting final DIFF_RESP"
-            );
-            for (const auto &answer : resp->answers) {
-                result.push_back(answer.path);
-            }
-            answerCtr += resp->answers.size();
-            StatusLine::Add("client answers", resp->answers.size());
-            updateStats("<--");
+            flush();
+        }
+        while (!inFlight.empty()) {
+            receive();
         }
 
+        roundTime = chrono::steady_clock::now() - roundStart;
+        roundQueries = queryCtr;
+        roundAnswers = answerCtr;
+        StatusLine::Add("client rounds", 1);
         return result;
-    }, [this] (const PolicyFile &file) {
+    }, [this,&followers] (const PolicyFile &file) {
         // Emit function
 
         if (this->verbose) {
             LOG("Must transfer " << file.path);
         }
         this->transferProc->castTransfer(this->host, file);
-    });
+        for (SyncClientProcess *follower : followers) {
+            this->transferProc->castTransfer(follower->host, file);
+        }
+    }, [this,&batcher,&roundTime,&roundQueries,&roundAnswers,&lookahead] (size_t speculated, size_t used) {
+        // Lookahead function: how many queries to spend on the levels below this round's.
+
+        if (roundQueries == 0) {
+            // First round. Fill out the request the root goes in.
+            return lookahead;
+        }
+
+        // A round that took about a round trip had the link idle most of the time, so a few
+        // more queries in it would have cost next to nothing.
+        bool latencyBound = roundTime < 2 * batcher.minLatency();
+        // Without speculation to go by, most of what was asked differing suggests a change
+        // that goes deep.
+        bool paidOff = speculated > 0 ? used * 4 >= speculated : roundAnswers * 2 >= roundQueries;
+        if (paidOff || (latencyBound && used > 0)) {
+            lookahead = min(max(lookahead * 2, size_t(DiffBatcher::DEFAULT_QUERIES)), this->maxLookahead);
+        } else {
+            lookahead /= 2;
+        }
+        return lookahead;
+    }, [this,epoch,&remote] (const vector<std::filesystem::path> &dirs) {
+        // Reconcile function
+
+        map<std::filesystem::path, vector<std::filesystem::path>> result;
+        struct Pending {
+            uint32_t requestId;
+            std::filesystem::path dir;
+            size_t cells;
+            map<uint64_t, std::filesystem::path> byKey;
+        };
+        deque<Pending> pending;
+
+        for (const std::filesystem::path &dir : dirs) {
+            set<std::filesystem::path> children = this->index->children(dir);
+            auto search = this->sketchCells.find(dir);
+            size_t cells = search != this->sketchCells.end()
+                ? search->second
+                : children.size() / FIRST_SKETCH_CHILDREN_PER_CELL + MIN_SKETCH_CELLS;
+            if (cells * wireSize(Iblt::Cell()) > min(children.size() * MAX_SKETCH_BYTES_PER_CHILD, size_t(MSG::DiffReq::MAX_BYTES))) {
+                // Too much differs for a sketch to be worth it. Asking about each child sorts it
+                // out, so next time starts over small.
+                this->sketchCells.erase(dir);
+                continue;
+            }
+
+            MSG::ReconcileReq req;
+            req.epoch = epoch;
+            req.path = dir.string();
+            req.sketch = Iblt(cells);
+            Pending p = { 0, dir, cells, {} };
+            bool unique = true;
+            for (const std::filesystem::path &child : children) {
+                uint64_t key = Index::ReconcileKey(child);
+                if (!p.byKey.emplace(key, child).second) {
+                    unique = false;
+                    break;
+                }
+                req.sketch.insert(key, this->index->hash(child));
+            }
+            if (!unique) {
+                // Two names with one key can't be told apart.
+                continue;
+            }
+
+            req.requestId = p.requestId = this->nextRequestId++;
+            RETHROW_NESTED(
+                remote->send(req),
+                "sending RECONCILE_REQ"
+            );
+            pending.push_back(std::move(p));
+        }
+
+        for (const Pending &p : pending) {
+            MSG::Ptr<MSG::ReconcileResp> resp;
+            RETHROW_NESTED(
+                resp = remote->awaitWithType<MSG::ReconcileResp>(MSG::Type::RECONCILE_RESP),
+                "awaiting RECONCILE_RESP"
+            );
+            if (!resp || resp->requestId != p.requestId) {
+                throw runtime_error("RECONCILE_RESP doesn't answer RECONCILE_REQ " + to_string(p.requestId));
+            }
+            if (!resp->decoded) {
+                // Next time, big enough for a few times the difference this was too small for.
+                this->sketchCells[p.dir] = p.cells * 4;
+                StatusLine::Add("client reconcile failures", 1);
+                continue;
+            }
+
+            vector<std::filesystem::path> &different = result[p.dir];
+            for (uint64_t key : resp->different) {
+                auto child = p.byKey.find(key);
+                if (child == p.byKey.end()) {
+                    throw runtime_error("RECONCILE_RESP names a child of " + p.dir.string() + " we don't have.");
+                }
+                different.push_back(child->second);
+            }
+            // About how much will differ next time, with room to spare.
+            this->sketchCells[p.dir] = 2 * different.size() + MIN_SKETCH_CELLS;
+            StatusLine::Add("client reconciled", 1);
+        }
+        return result;
+    }, &this->diffProgress);
 
     MSG::DiffCommit msg;
     msg.epoch = epoch;
-    remote.send(msg);
+    msg.reportDeleted = !followers.empty();
+    for (const Relpath &path : this->index->unreadable()) {
+        msg.unreadable.push_back(path.string());
+    }
+    remote->send(msg);
+
+    if (!followers.empty()) {
+        MSG::Ptr<MSG::DiffCommitResp> resp;
+        RETHROW_NESTED(
+            resp = remote->awaitWithType<MSG::DiffCommitResp>(MSG::Type::DIFF_COMMIT_RESP),
+            "awaiting DIFF_COMMIT_RESP"
+        );
+        for (SyncClientProcess *follower : followers) {
+            if (!resp || !resp->complete) {
+                // Without the deletions, they'd be left with what we don't have.
+                follower->castFullsync();
+                continue;
+            }
+            for (const MSG::DiffCommitResp::Deleted &deleted : resp->deleted) {
+                PolicyFile file = { deleted.path, "", FileRecord::Type::DOES_NOT_EXIST };
+                this->transferProc->castTransfer(follower->host, file);
+            }
+        }
+        StatusLine::Add("client shared fullsyncs", followers.size());
+    }
 
+    // How full DiffReqs were against what the batcher asked for; rounds too small to fill one
+    // bring it down.
+    StatusLine::Int fill = batchTargets > 0 ? 100 * batchQueries / batchTargets : 0;
+    this->status.set("batches", static_cast<StatusLine::Int>(batches));
+    this->status.set("batch fill %", fill);
     if (this->verbose) {
-        LOG("Finished fullsync.");
+        LOG("Finished fullsync: " << batches << " DiffReqs, " << batchQueries << " queries, " <<
+            fill << "% full.");
     }
 }
 
 MSG::InfoResp SyncClientProcess::performInfo() {
-    Socket remote = this->connect();
+    // Changes get indexed before they're journaled, so if the replica turns out to match our
+    // index, it has everything journaled up to here.
+    uint64_t journalSeq = this->journal->lastSeq();
+
+    unique_ptr<PeerSession::Stream> remote = this->openStream();
 
     MSG::InfoReq msg;
-    remote.send(msg);
+    remote->send(msg);
+
+    MSG::InfoResp resp = *remote->awaitWithType<MSG::InfoResp>(MSG::Type::INFO_RESP);
 
-    MSG::InfoResp resp = *(remote.awaitWithType<MSG::InfoResp>(MSG::Type::INFO_RESP).release());
+    if (!resp.payloads.empty() && resp.payloads.front().hash == this->index->hash()) {
+        // Passed along with the next session.
+        this->journalVerified = true;
+        this->journalVerifiedSeq = journalSeq;
+    }
 
     return resp;
 }
 
-Socket SyncClientProcess::connect() {
-    STATUS(this->status, "Connecting");
-    Socket remote = this->host.connect();
+unique_ptr<PeerSession::Stream> SyncClientProcess::openStream() {
+    STATUS(this->status, "Opening stream");
+    unique_ptr<PeerSession::Stream> remote = this->session->open();
 
     STATUS(this->status, "Establishing session");
-    remote.send(MSG::SyncEstablishReq());
+    MSG::SyncEstablishReq req;
+    req.excludes = this->excludes;
+    req.journalId = this->journalVerified ? this->journal->id() : 0;
+    req.journalSeq = this->journalVerifiedSeq;
+    remote->send(req);
 
     STATUS(this->status, "Established");
     return remote;
@@ -195,9 +527,10 @@ Socket SyncClientProcess::connect() {
 // Interface methods (caller thread) //
 ///////////////////////////////////////
 
-void SyncClientProcess::castFullsync() {
+void SyncClientProcess::castFullsync(const vector<SyncClientProcess*> &followers) {
 	Message msg;
 	msg.type = MT::FULLSYNC;
+	msg.payload = Any(followers);
 	this->cast(msg);
 }
 
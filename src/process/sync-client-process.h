@@ -2,19 +2,23 @@
 #define PROCESS_SYNC_CLIENT_PROCESS_H
 
 #include <condition_variable>
+#include <map>
 #include <mutex>
 #include <string>
 #include <thread>
+#include <vector>
 #include "../index.h"
+#include "../journal.h"
+#include "../fs/excludes.h"
 #include "../util.h"
+#include "../net/peer-session.h"
 #include "../net/protocol.h"
 #include "../util/log.h"
+#include "./diff-batcher.h"
 #include "./transfer-process.h"
 
 #include "process.h"
 
-class Socket;
-
 enum class SyncClientProcessMessageType {
 	FULLSYNC,
 	INFO
@@ -22,25 +26,56 @@ enum class SyncClientProcessMessageType {
 
 class SyncClientProcess : public Process<SyncClientProcessMessageType> {
 public:
-	SyncClientProcess(const PolicyHost &host, Index &index, TransferProcess &transferProc, bool verbose);
+	SyncClientProcess(
+		const PolicyHost &host, PeerSession &session, Index &index, const ExcludeSet &excludes,
+		ChangeJournal &journal, TransferProcess &transferProc, size_t pipelineDepth,
+		size_t maxLookahead, bool verbose);
+
+	// DiffReqs in flight at once during a fullsync.
+	static const size_t DEFAULT_PIPELINE_DEPTH = 16;
+	// Most queries a round of diff spends on paths deeper than it has got to, in case their
+	// parents turn out to differ. As many as a full pipeline carries, which costs about one
+	// round trip, and saves one whenever they're needed.
+	static const size_t DEFAULT_MAX_LOOKAHEAD = DEFAULT_PIPELINE_DEPTH * DiffBatcher::DEFAULT_QUERIES;
 
 	///////////////////////////////////////
 	// Interface methods (caller thread) //
 	///////////////////////////////////////
-	void castFullsync();
+	// Replicas in followers were in the same state as this one, and get sent what it does
+	// rather than being diffed themselves.
+	void castFullsync(const std::vector<SyncClientProcess*> &followers = {});
 	MSG::InfoResp callInfo();
 private:
 	/////////////////////////////////////////
 	// Implementation fns (managed thread) //
 	/////////////////////////////////////////
 	void main();
-	void performFullsync();
+	void performFullsync(const std::vector<SyncClientProcess*> &followers);
+	// Sends the replica just what it missed, if the journal still reaches back that far.
+	bool replayJournal();
 	MSG::InfoResp performInfo();
-	Socket connect();
+	// A new stream on the session, with a sync session established on it.
+	std::unique_ptr<PeerSession::Stream> openStream();
 
 	PolicyHost host;
+	PeerSession *session;
 	Index *index;
+	// Pushed to the replica on every session.
+	std::vector<std::string> excludes;
+	ChangeJournal *journal;
+	// Last time the replica was seen to match us, it had the journal applied up to here.
+	bool journalVerified = false;
+	uint64_t journalVerifiedSeq = 0;
+	// If a replay didn't make the replica converge, the next sync has to be a full diff.
+	bool lastSyncWasReplay = false;
 	TransferProcess *transferProc;
+	size_t pipelineDepth;
+	size_t maxLookahead;
+	// IBLT cells to reconcile each big directory with next time, by what differed last time.
+	std::map<Relpath, size_t> sketchCells;
+	// Of the last fullsync, if it was cut short, for the next to carry on from.
+	Index::DiffProgress diffProgress;
+	uint32_t nextRequestId = 1;
 	StatusLine status;
 	bool verbose;
 };
@@ -17,13 +17,17 @@ using namespace std;
 //////////////
 
 SyncServerProcess::SyncServerProcess(
-    const string &host, const string &port, const std::filesystem::path &root, Index &index, const string &instanceId
+    const string &host, const string &port, const std::filesystem::path &root, Index &index, const string &instanceId,
+    function<void (const vector<string> &)> excludesFn,
+    function<bool (const std::filesystem::path &)> filterFn
 ) {
     this->host = host;
     this->port = port;
     this->root = root;
     this->instanceId = instanceId;
     this->index = &index;
+    this->excludesFn = excludesFn;
+    this->filterFn = filterFn;
     this->th = thread([this] () {
         StatusLine statusLine("SyncServerProcess");
         STATUS(statusLine, "Good to go.");
@@ -38,175 +42,291 @@ SyncServerProcess::SyncServerProcess(
 /////////////////////////////////////////
 
 void SyncServerProcess::main() {
-    InetServer srv(this->host, this->port, [this] (Socket &remote) {
-        try {
-            StatusLine statusLine("SyncServerProcess worker");
-
-            bool notDone = true;
-
-            while (notDone) {
-                State st;
-                st.mode = ConnType::NEW;
-                st.remote = &remote;
-                st.deleted = 0;
-                st.receivedFiles = 0;
-                st.receivedSymlinks = 0;
-                st.receivedDirs = 0;
-                st.statusFn = [&st, &statusLine] (string str) {
-                    string modeStr;
-                    switch (st.mode) {
-                    case ConnType::NEW:
-                        modeStr = "NEW";
-                        break;
-                    case ConnType::SYNC:
-                        modeStr = "SYNC";
-                        break;
-                    case ConnType::XFR:
-                        modeStr = "XFR";
-                        break;
-                    }
-                    STATUS(
-                        statusLine,
-                        "[del=" << st.deleted <<
-                        ", filesIn=" << st.receivedFiles <<
-                        ", dirsIn=" << st.receivedDirs << "]  " <<
-                        modeStr << " | " <<
-                        str
-                    );
-                };
-
-                st.statusFn("Idle");
-
-                RETHROW_NESTED({
-                    st.remote->awaitWithHandler([this, &st] (MSG::Type type, MSG::Base *msg) {
-                        if (type == MSG::Type::SYNC_ESTABLISH_REQ) {
-                            st.mode = ConnType::SYNC;
-                            logTag("sync");
-                        } else if (type == MSG::Type::XFR_ESTABLISH_REQ) {
-                            MSG::XfrEstablishReq *req = dynamic_cast<MSG::XfrEstablishReq*>(msg);
-
-                            st.mode = ConnType::XFR;
-                            logTag("xfr");
-                            st.xfrPath = root / req->plan.file.path;
-                            st.xfrTargetPath = req->plan.file.targetPath;
-                            st.xfrType = (FileRecord::Type)(req->plan.file.type);
-                        } else {
-                            stringstream ss;
-                            ss << "Unknown message " << static_cast<int>(type) << " in SyncServerProcess session, expected establish message.";
-                            throw runtime_error(ss.str());
-                        }
-                    }, chrono::seconds(60));
-                }, "Waiting for establish request");
-
-                st.statusFn("Established");
-
-                switch (st.mode) {
-                case ConnType::SYNC:
-                    RETHROW_NESTED(notDone = this->syncLoop(st), "syncLoop" << " path=" << st.xfrPath.string() << " target=" << st.xfrTargetPath.string() << " type=" << st.xfrType);
-                    break;
-                case ConnType::XFR:
-                    RETHROW_NESTED(notDone = this->xfrLoop(st), "xfrLoop" << " path=" << st.xfrPath.string() << " target=" << st.xfrTargetPath.string() << " type=" << st.xfrType);
-                    break;
-                default: throw runtime_error("Connection in bad state.");
-                }
-            }
-        } catch (const exception &e) {
-            LOG_EXCEPTION(e, "SyncServiceProcess socket handler");
-        }
+    InetServer srv(this->host, this->port, [this] () {
+        return unique_ptr<InetServer::Session>(new Session(this));
     });
 }
 
-bool SyncServerProcess::syncLoop(State &st) {
-    st.statusFn("Waiting...");
+SyncServerProcess::Session::Session(SyncServerProcess *process)
+: process(process), statusLine("SyncServerProcess session") {
+    State &st = this->st;
+    StatusLine &statusLine = this->statusLine;
+
+    st.mode = ConnType::NEW;
+    st.remote = nullptr;
+    st.stream = 0;
+    st.deleted = 0;
+    st.receivedFiles = 0;
+    st.receivedSymlinks = 0;
+    st.receivedDirs = 0;
+    st.statusFn = [&st, &statusLine] (string str) {
+        string modeStr;
+        switch (st.mode) {
+        case ConnType::NEW:
+            modeStr = "NEW";
+            break;
+        case ConnType::SYNC:
+            modeStr = "SYNC";
+            break;
+        case ConnType::XFR:
+            modeStr = "XFR";
+            break;
+        }
+        STATUS(
+            statusLine,
+            "[del=" << st.deleted <<
+            ", filesIn=" << st.receivedFiles <<
+            ", dirsIn=" << st.receivedDirs << "]  " <<
+            modeStr << " | " <<
+            str
+        );
+    };
+
+    st.statusFn("Idle");
+}
+
+bool SyncServerProcess::Session::onMessage(Socket &remote, uint32_t stream, MSG::Type type, MSG::Base *msg) {
+    State &st = this->st;
+    st.remote = &remote;
+    st.stream = stream;
+
+    switch (st.mode) {
+    case ConnType::NEW:
+        RETHROW_NESTED(this->process->establish(st, type, msg), "Handling establish request");
+        return true;
+    case ConnType::SYNC:
+        logTag("sync");
+        bool open;
+        RETHROW_NESTED(open = this->process->syncMessage(st, type, msg), "syncMessage");
+        return open;
+    case ConnType::XFR:
+        logTag("xfr");
+        if (type != MSG::Type::XFR_BLOCK) {
+            stringstream ss;
+            ss << "Unknown message " << static_cast<int>(type) << " in XFR session, expected XFR_BLOCK.";
+            throw runtime_error(ss.str());
+        }
+        RETHROW_NESTED(
+            this->process->receiveBlock(st, *dynamic_cast<MSG::XfrBlock*>(msg)),
+            "receiveBlock" << " path=" << st.xfrPath.string()
+        );
+        return true;
+    }
+    throw runtime_error("Connection in bad state.");
+}
 
+void SyncServerProcess::establish(State &st, MSG::Type type, MSG::Base *msg) {
+    if (type == MSG::Type::SYNC_ESTABLISH_REQ) {
+        MSG::SyncEstablishReq *req = dynamic_cast<MSG::SyncEstablishReq*>(msg);
+
+        st.mode = ConnType::SYNC;
+        logTag("sync");
+        // Must take effect before this session's DiffReqs are answered.
+        this->excludesFn(req->excludes);
+        this->updateJournalPosition(req->journalId, req->journalSeq);
+        st.statusFn("Established");
+    } else if (type == MSG::Type::XFR_ESTABLISH_REQ) {
+        MSG::XfrEstablishReq *req = dynamic_cast<MSG::XfrEstablishReq*>(msg);
+
+        st.mode = ConnType::XFR;
+        logTag("xfr");
+        st.xfrPath = root / req->plan.file.path;
+        st.xfrTargetPath = req->plan.file.targetPath;
+        st.xfrType = (FileRecord::Type)(req->plan.file.type);
+        st.xfrRenamedFrom = req->plan.file.renamedFrom;
+        st.xfrLinked = !req->plan.file.linkTo.empty();
+        st.xfrLinkTo = req->plan.file.linkTo == req->plan.file.path ? Relpath() : req->plan.file.linkTo;
+        st.xfrVersion = req->plan.file.version;
+        st.xfrJournalId = req->journalId;
+        st.xfrSeq = req->plan.file.seq;
+        st.xfrBlockSize = req->blockSize;
+        st.statusFn("Established");
+
+        RETHROW_NESTED(this->xfrEstablished(st), "xfrEstablished" << " path=" << st.xfrPath.string() << " target=" << st.xfrTargetPath.string() << " type=" << st.xfrType);
+    } else {
+        stringstream ss;
+        ss << "Unknown message " << static_cast<int>(type) << " in SyncServerProcess session, expected establish message.";
+        throw runtime_error(ss.str());
+    }
+}
+
+bool SyncServerProcess::syncMessage(State &st, MSG::Type type, MSG::Base *msg) {
     bool finished = false;
-    while (!finished) {
-        st.remote->awaitWithHandler([this, &st, &finished] (MSG::Type type, MSG::Base *msg) {
-            if (type == MSG::Type::INFO_REQ) {
-                st.statusFn("Got INFO_REQ");
-
-                MSG::InfoResp resp;
-                resp.payloads.push_back({
-                    this->instanceId,
-                    "reachable",
-                    this->index->size(),
-                    this->index->hash()
-                });
-                st.remote->send(resp);
-
-                finished = true;
-            } else if (type == MSG::Type::DIFF_REQ) {
-                st.statusFn("Got DIFF_REQ");
-
-                MSG::DiffReq *req = dynamic_cast<MSG::DiffReq*>(msg);
-                MSG::DiffResp resp;
-                // LOG("Has payload |queries|=" << req->queries.size() << " and epoch=" << req->epoch);
-                for (const auto &query : req->queries) {
-                    bool matches = this->index->hash(query.path) == query.hash;
-                    // LOG("Checking if '" << query.path << "' matches " << query.hash << ". Answer? " << matches);
-                    // LOG("The hash we have for it is " << this->index->hash(query.path));
-                    this->index->setEpoch(query.path, req->epoch);
-                    this->index->setExpectedHash(query.path, query.hash);
-                    if (!matches) {
-                        resp.answers.push_back({ query.path });
-                    }
-                }
-                st.remote->send(resp);
-            } else if (type == MSG::Type::DIFF_COMMIT) {
-                st.statusFn("Got DIFF_COMMIT");
-
-                MSG::DiffCommit *req = dynamic_cast<MSG::DiffCommit*>(msg);
-                list<Relpath> deleted = this->index->commit(req->epoch);
-                for (auto i : deleted) {
-                    Relpath path = root / i;
-                    this->removeFile(path);
-                    scanSingle(path, [this] (const FileRecord &rec) {
-                        this->index->update(rec);
-                    });
-
-                    StatusLine::Add("del", 1);
-                    ++st.deleted;
-                }
-
-                finished = true;
-            } else {
-                finished = true;
-                ERR("Unknown message " << static_cast<int>(type));
-                throw runtime_error("Unknown message.");
+
+    if (type == MSG::Type::INFO_REQ) {
+        st.statusFn("Got INFO_REQ");
+
+        MSG::InfoResp resp;
+        resp.payloads.push_back({
+            this->instanceId,
+            "reachable",
+            this->index->size(),
+            this->index->hash(),
+            this->index->excludesFingerprint()
+        });
+        st.remote->send(resp, st.stream);
+
+        finished = true;
+    } else if (type == MSG::Type::JOURNAL_REQ) {
+        st.statusFn("Got JOURNAL_REQ");
+
+        MSG::JournalResp resp;
+        {
+            lock_guard<mutex> lock(this->journalMutex);
+            resp.journalId = this->journalId;
+            resp.journalSeq = this->journalSeq;
+            resp.applied.assign(this->journalAppliedSeqs.begin(), this->journalAppliedSeqs.end());
+        }
+        st.remote->send(resp, st.stream);
+
+        finished = true;
+    } else if (type == MSG::Type::DIFF_RESUME_REQ) {
+        st.statusFn("Got DIFF_RESUME_REQ");
+
+        MSG::DiffResumeReq *req = dynamic_cast<MSG::DiffResumeReq*>(msg);
+        MSG::DiffResumeResp resp;
+        resp.resumable = req->epoch != 0 && this->diffEpoch == req->epoch;
+        st.remote->send(resp, st.stream);
+    } else if (type == MSG::Type::DIFF_REQ) {
+        st.statusFn("Got DIFF_REQ");
+
+        MSG::DiffReq *req = dynamic_cast<MSG::DiffReq*>(msg);
+        MSG::DiffResp resp;
+        resp.requestId = req->requestId;
+        this->diffEpoch = req->epoch;
+        // LOG("Has payload |queries|=" << req->queries.size() << " and epoch=" << req->epoch);
+        uint32_t id = req->firstId;
+        for (const auto &query : req->queries) {
+            bool matches = this->index->expect(query.path, req->epoch, query.hash) == query.hash;
+            // LOG("Checking if '" << query.path << "' matches " << query.hash << ". Answer? " << matches);
+            if (!matches) {
+                resp.answers.push_back(id);
+            }
+            ++id;
+        }
+        st.remote->send(resp, st.stream);
+    } else if (type == MSG::Type::RECONCILE_REQ) {
+        st.statusFn("Got RECONCILE_REQ");
+
+        MSG::ReconcileReq *req = dynamic_cast<MSG::ReconcileReq*>(msg);
+        MSG::ReconcileResp resp;
+        resp.requestId = req->requestId;
+        this->diffEpoch = req->epoch;
+        resp.decoded = this->index->reconcile(req->path, req->epoch, req->sketch, resp.different);
+        StatusLine::Add(resp.decoded ? "reconciled" : "reconcileFailures", 1);
+        st.remote->send(resp, st.stream);
+    } else if (type == MSG::Type::DIFF_COMMIT) {
+        st.statusFn("Got DIFF_COMMIT");
+
+        MSG::DiffCommit *req = dynamic_cast<MSG::DiffCommit*>(msg);
+        set<Relpath> keep(req->unreadable.begin(), req->unreadable.end());
+        if (!keep.empty()) {
+            LOG("Keeping what's under " << keep.size() << " directories the primary couldn't read.");
+        }
+        list<Relpath> deleted = this->index->commit(req->epoch, keep);
+        this->diffEpoch = 0;
+        MSG::DiffCommitResp resp;
+        for (auto i : deleted) {
+            resp.deleted.push_back({ i.string() });
+            Relpath path = root / i;
+            this->removeFile(path);
+            scanSingle(path, [this] (const FileRecord &rec) {
+                this->index->update(rec);
+            });
+
+            StatusLine::Add("del", 1);
+            ++st.deleted;
+        }
+
+        if (req->reportDeleted) {
+            if (resp.deleted.wireSize() > MSG::DiffCommitResp::MAX_BYTES) {
+                resp.complete = false;
+                resp.deleted.clear();
             }
-        }, chrono::seconds(0));
+            st.remote->send(resp, st.stream);
+        }
+
+        finished = true;
+    } else {
+        finished = true;
+        ERR("Unknown message " << static_cast<int>(type));
+        throw runtime_error("Unknown message.");
     }
 
-    return false;
+    st.statusFn(finished ? "Finished" : "Waiting...");
+    // The primary opens a new stream for each sync session.
+    return !finished;
 }
 
-void SyncServerProcess::receiveFile(State &st) {
+void SyncServerProcess::beginFile(State &st) {
+    if (st.xfrBlockSize < MSG::XfrBlock::MIN_SIZE || st.xfrBlockSize > MSG::XfrBlock::MAX_SIZE) {
+        throw runtime_error("Bad block size " + to_string(st.xfrBlockSize) + " for " + st.xfrPath.string());
+    }
+
     // Create parent directories if necessary
     std::filesystem::path parent = st.xfrPath.parent_path();
     if (!std::filesystem::exists(parent)) {
         std::filesystem::create_directories(parent);
     }
 
-    ofstream f(st.xfrPath, ios_base::trunc);
-    if (f.fail()) {
+    // Writing in place would also change whatever else we've linked to this file, which is
+    // only right if the primary's copy is still linked too.
+    if (!st.xfrLinked) {
+        try {
+            File existing(st.xfrPath);
+            if (existing.links > 1) {
+                existing.remove();
+            }
+        } catch (does_not_exist_error e) {
+            // Nothing to unlink.
+        }
+    }
+
+    st.xfrFile.open(st.xfrPath, ios_base::trunc);
+    if (st.xfrFile.fail()) {
         StatusLine::Add("fileWriteErr", 1);
         throw runtime_error("Failed to open file " + st.xfrPath.string());
     }
+    st.xfrSize = 0;
+}
 
-    for (;;) {
-        unique_ptr<MSG::XfrBlock> block =
-            st.remote->awaitWithType<MSG::XfrBlock>(MSG::Type::XFR_BLOCK);
+void SyncServerProcess::receiveBlock(State &st, const MSG::XfrBlock &block) {
+    if (block.data.size() > st.xfrBlockSize) {
+        throw runtime_error("Block of " + to_string(block.data.size()) + " bytes for " + st.xfrPath.string());
+    }
+    ofstream &f = st.xfrFile;
+    f.write(reinterpret_cast<const char*>(block.data.data()), block.data.size());
+    if (f.bad()) {
+        StatusLine::Add("fileWriteErr", 1);
+        throw runtime_error("File is now in 'bad' state " + st.xfrPath.string());
+    }
+    st.xfrSize += block.data.size();
 
-        f.write(reinterpret_cast<char*>(block->data.data()), block->data.size());
-        if (f.bad()) {
+    if (block.hole > 0) {
+        // The file was truncated on open, so seeking past the end leaves a hole.
+        f.seekp(block.hole, ios_base::cur);
+        if (f.fail()) {
             StatusLine::Add("fileWriteErr", 1);
-            throw runtime_error("File is now in 'bad' state " + st.xfrPath.string());
+            throw runtime_error("Failed to skip hole in " + st.xfrPath.string());
         }
+        st.xfrSize += block.hole;
+        StatusLine::Add("holesIn", block.hole);
+        return;
+    }
 
-        if (block->data.size() < MSG::XfrBlock::MAX_SIZE) {
-            break;
-        }
+    if (block.data.size() == st.xfrBlockSize) {
+        return;
     }
+
+    // A hole at the very end only exists once the file is extended over it.
+    f.close();
+    if (std::filesystem::file_size(st.xfrPath) < st.xfrSize) {
+        std::filesystem::resize_file(st.xfrPath, st.xfrSize);
+    }
+
+    ++st.receivedFiles;
+    StatusLine::Add("filesIn", 1);
+    this->xfrFinished(st);
 }
 
 void SyncServerProcess::receiveSymlink(State &st) {
@@ -223,6 +343,37 @@ void SyncServerProcess::receiveSymlink(State &st) {
     }
 }
 
+void SyncServerProcess::updateJournalPosition(uint64_t id, uint64_t seq) {
+    if (id == 0) {
+        // Primary hasn't seen us match it yet.
+        return;
+    }
+
+    lock_guard<mutex> lock(this->journalMutex);
+    if (id != this->journalId) {
+        // Primary restarted, whatever we had is meaningless now.
+        this->journalId = id;
+        this->journalSeq = seq;
+        this->journalAppliedSeqs.clear();
+    } else if (seq > this->journalSeq) {
+        this->journalSeq = seq;
+        this->journalAppliedSeqs.erase(this->journalAppliedSeqs.begin(), this->journalAppliedSeqs.upper_bound(seq));
+    }
+}
+
+void SyncServerProcess::journalApplied(uint64_t id, uint64_t seq) {
+    lock_guard<mutex> lock(this->journalMutex);
+    if (id != this->journalId || seq <= this->journalSeq) {
+        return;
+    }
+
+    this->journalAppliedSeqs.insert(seq);
+    // Forgetting some only means the primary sends them again.
+    if (this->journalAppliedSeqs.size() > ChangeJournal::DEFAULT_CAPACITY) {
+        this->journalAppliedSeqs.erase(this->journalAppliedSeqs.begin());
+    }
+}
+
 void SyncServerProcess::removeFile(const std::filesystem::path &path) {
     try {
         File f(path);
@@ -232,7 +383,112 @@ void SyncServerProcess::removeFile(const std::filesystem::path &path) {
     }
 }
 
-bool SyncServerProcess::xfrLoop(State &st) {
+bool SyncServerProcess::receiveRename(State &st) {
+    std::filesystem::path from = root / st.xfrRenamedFrom;
+    if (!std::filesystem::exists(std::filesystem::symlink_status(from))) {
+        return false;
+    }
+
+    // rename() would refuse to replace a non-empty directory, or a file with a directory.
+    if (std::filesystem::exists(std::filesystem::symlink_status(st.xfrPath))) {
+        this->removeFile(st.xfrPath);
+    }
+
+    std::filesystem::path parent = st.xfrPath.parent_path();
+    if (!std::filesystem::exists(parent)) {
+        std::filesystem::create_directories(parent);
+    }
+
+    error_code ec;
+    std::filesystem::rename(from, st.xfrPath, ec);
+    if (ec) {
+        ERR("Failed to rename " << from << " to " << st.xfrPath << ": " << ec.message());
+        return false;
+    }
+
+    Relpath to = st.xfrPath.lexically_relative(root);
+    if (!this->index->rename(st.xfrRenamedFrom, to)) {
+        // Wasn't indexed, so index whatever is there now the slow way.
+        scanSingle(from, [this] (const FileRecord &rec) {
+            this->index->update(rec);
+        });
+        performFullScan(st.xfrPath, [this] (const FileRecord &rec) {
+            if (this->filterFn(rec.path)) {
+                this->index->update(rec);
+            }
+        }, this->filterFn);
+    }
+
+    return true;
+}
+
+bool SyncServerProcess::receiveLink(State &st) {
+    std::filesystem::path from = root / st.xfrLinkTo;
+    // Linking to stale content would be worse than receiving it again.
+    if (this->index->version(st.xfrLinkTo) != st.xfrVersion ||
+        !std::filesystem::is_regular_file(std::filesystem::symlink_status(from))) {
+        return false;
+    }
+
+    error_code ec;
+    if (std::filesystem::exists(std::filesystem::symlink_status(st.xfrPath))) {
+        if (!std::filesystem::equivalent(from, st.xfrPath, ec)) {
+            this->removeFile(st.xfrPath);
+        }
+    }
+
+    if (!std::filesystem::exists(std::filesystem::symlink_status(st.xfrPath))) {
+        std::filesystem::path parent = st.xfrPath.parent_path();
+        if (!std::filesystem::exists(parent)) {
+            std::filesystem::create_directories(parent);
+        }
+
+        std::filesystem::create_hard_link(from, st.xfrPath, ec);
+        if (ec) {
+            ERR("Failed to link " << st.xfrPath << " to " << from << ": " << ec.message());
+            return false;
+        }
+    }
+
+    // Same content as from, so there's no need to read it again.
+    try {
+        File f(st.xfrPath);
+        this->index->update(FileRecord(f, st.xfrVersion));
+    } catch (does_not_exist_error e) {
+        return false;
+    }
+    return true;
+}
+
+void SyncServerProcess::xfrEstablished(State &st) {
+    if (!st.xfrRenamedFrom.empty()) {
+        MSG::XfrRenameResp resp;
+        resp.renamed = this->receiveRename(st);
+        st.remote->send(resp, st.stream);
+
+        if (resp.renamed) {
+            StatusLine::Add("renamesIn", 1);
+            this->journalApplied(st.xfrJournalId, st.xfrSeq);
+        }
+        st.mode = ConnType::NEW;
+        st.statusFn("Idle");
+        return;
+    }
+
+    if (st.xfrType == FileRecord::Type::FILE && !st.xfrLinkTo.empty()) {
+        MSG::XfrLinkResp resp;
+        resp.linked = this->receiveLink(st);
+        st.remote->send(resp, st.stream);
+
+        if (resp.linked) {
+            StatusLine::Add("linksIn", 1);
+            this->journalApplied(st.xfrJournalId, st.xfrSeq);
+        }
+        st.mode = ConnType::NEW;
+        st.statusFn("Idle");
+        return;
+    }
+
     switch (st.xfrType) {
     case FileRecord::Type::DIRECTORY:
         if (!std::filesystem::exists(st.xfrPath)) {
@@ -247,6 +503,10 @@ bool SyncServerProcess::xfrLoop(State &st) {
         ++st.receivedDirs;
         break;
     case FileRecord::Type::DOES_NOT_EXIST:
+        if (!std::filesystem::exists(std::filesystem::symlink_status(st.xfrPath))) {
+            // Already gone, e.g. removed by a DiffCommit first.
+            break;
+        }
         if (access(st.xfrPath.c_str(), W_OK) != 0) {
             throw runtime_error("No permissions to delete directory: " + st.xfrPath.string());
         }
@@ -257,11 +517,10 @@ bool SyncServerProcess::xfrLoop(State &st) {
         ++st.deleted;
         break;
     case FileRecord::Type::FILE:
-        this->receiveFile(st);
-
-        ++st.receivedFiles;
-        StatusLine::Add("filesIn", 1);
-        break;
+        // Finished by receiveBlock, once the last block is in.
+        this->beginFile(st);
+        st.statusFn("Receiving...");
+        return;
     case FileRecord::Type::SYMLINK:
         this->receiveSymlink(st);
 
@@ -270,9 +529,16 @@ bool SyncServerProcess::xfrLoop(State &st) {
         break;
     }
 
+    this->xfrFinished(st);
+}
+
+void SyncServerProcess::xfrFinished(State &st) {
     scanSingle(st.xfrPath, [this] (const FileRecord &rec) {
         this->index->update(rec);
     });
+    this->journalApplied(st.xfrJournalId, st.xfrSeq);
 
-    return true;
+    // Ready for the next establish request on this connection.
+    st.mode = ConnType::NEW;
+    st.statusFn("Idle");
 }
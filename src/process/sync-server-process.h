@@ -1,13 +1,16 @@
 #ifndef PROCESS_SYNC_SERVER_PROCESS_H
 #define PROCESS_SYNC_SERVER_PROCESS_H
 
+#include <atomic>
 #include <condition_variable>
 #include <functional>
 #include <fstream>
 #include <mutex>
+#include <set>
 #include <string>
 #include <thread>
 #include "../index.h"
+#include "../journal.h"
 #include "../util.h"
 #include "../fs/scanner.h"
 #include "../net/inet-server.h"
@@ -30,16 +33,27 @@ class SyncServerProcess : public Process<SyncServerProcessMessageType> {
 	    XFR
 	};
 
-	// Connection state
+	// Stream state. Each message moves it along, so no thread waits on the stream.
 	struct State {
 		ConnType mode;
 		Socket *remote;
+		uint32_t stream;
 		std::function<void (std::string)> statusFn;
 
 		// XFR mode only
 		std::filesystem::path xfrPath;
 		std::filesystem::path xfrTargetPath;  // for symlinks only
 		FileRecord::Type xfrType;
+		Relpath xfrRenamedFrom;  // for renames only
+		Relpath xfrLinkTo;  // for files to be hard linked to another path only
+		bool xfrLinked;  // for files, whether the primary has other links to it
+		HashT xfrVersion;
+		uint64_t xfrJournalId;
+		uint64_t xfrSeq;
+		// Files only, while their blocks come in.
+		uint32_t xfrBlockSize;
+		std::ofstream xfrFile;
+		uint64_t xfrSize;
 
 		// Stats
 		uint64_t deleted;
@@ -48,27 +62,64 @@ class SyncServerProcess : public Process<SyncServerProcessMessageType> {
 		uint64_t receivedDirs;
 	};
 
+	class Session : public InetServer::Session {
+	public:
+		Session(SyncServerProcess *process);
+		bool onMessage(Socket &remote, uint32_t stream, MSG::Type type, MSG::Base *msg) override;
+	private:
+		SyncServerProcess *process;
+		StatusLine statusLine;
+		State st;
+	};
+
 public:
 	SyncServerProcess(
 		const std::string &host, const std::string &port,
 		const std::filesystem::path &root,
-		Index &index, const std::string &instanceId);
+		Index &index, const std::string &instanceId,
+		std::function<void (const std::vector<std::string> &)> excludesFn,
+		std::function<bool (const std::filesystem::path &)> filterFn);
 private:
 	/////////////////////////////////////////
 	// Implementation fns (managed thread) //
 	/////////////////////////////////////////
 	void main();
-	bool syncLoop(State &st);
-	bool xfrLoop(State &st);
+
+	// Called from InetServer workers, one message at a time per connection.
+	void establish(State &st, MSG::Type type, MSG::Base *msg);
+	// Returns false once the sync session is over.
+	bool syncMessage(State &st, MSG::Type type, MSG::Base *msg);
+	void xfrEstablished(State &st);
+	void receiveBlock(State &st, const MSG::XfrBlock &block);
+	void xfrFinished(State &st);
 
 	// Helpers
-	void receiveFile(State &st);
+	void beginFile(State &st);
 	void receiveSymlink(State &st);
+	// Returns false if there was nothing to rename, in which case primary sends content instead.
+	bool receiveRename(State &st);
+	// Returns false if linkTo isn't here or isn't current, in which case primary sends content instead.
+	bool receiveLink(State &st);
 	void removeFile(const std::filesystem::path &path);
+	void updateJournalPosition(uint64_t id, uint64_t seq);
+	void journalApplied(uint64_t id, uint64_t seq);
 
 	std::string host, port, instanceId;
 	std::filesystem::path root;
 	Index *index;
+	// Applies the exclude patterns pushed by the primary.
+	std::function<void (const std::vector<std::string> &)> excludesFn;
+	std::function<bool (const std::filesystem::path &)> filterFn;
+
+	// How far along the primary's change journal we are: everything up to journalSeq, as
+	// last confirmed by the primary, plus whatever we've applied since.
+	std::mutex journalMutex;
+	uint64_t journalId = 0;
+	uint64_t journalSeq = 0;
+	std::set<uint64_t> journalAppliedSeqs;
+	// Epoch of the diff whose expectations the index holds, until its DiffCommit. Only a diff
+	// at this epoch can be resumed, as restarting loses them.
+	std::atomic<uint64_t> diffEpoch = {0};
 };
 
 #endif
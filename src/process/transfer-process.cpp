@@ -3,15 +3,18 @@
 #include <cassert>
 #include <chrono>
 #include <condition_variable>
+#include <cstring>
+#include <fcntl.h>
 #include <functional>
 #include <fstream>
 #include <iostream>
 #include <map>
 #include <mutex>
 #include <stdexcept>
+#include <unistd.h>
 #include <vector>
 
-#include "../net/persistent-socket.h"
+#include "../net/peer-session.h"
 #include "../util/log.h"
 
 using namespace std;
@@ -52,10 +55,16 @@ private:
 class TransferWorker {
 public:
     TransferWorker() = default;
-    void bind(const std::filesystem::path &root, Policy *policy, const PolicyHost &host, TransferCounter &xfrCounter) {
+    void bind(
+        const std::filesystem::path &root, Policy *policy, const PolicyHost &host, PeerSession *session,
+        TransferCounter &xfrCounter, std::function<bool (const std::filesystem::path &)> filterFn, uint64_t journalId
+    ) {
         this->root = root;
         this->policy = policy;
         this->host = host;
+        this->session = session;
+        this->filterFn = filterFn;
+        this->journalId = journalId;
         this->th = thread([this, &xfrCounter] () {
             LOG("-- Starting TransferWorker");
 
@@ -68,9 +77,8 @@ public:
                 STATUSVAR(status, "remaining", stats.remaining);
             };
 
-            PersistentSocket sock([this] () {
-                return this->host.connect();
-            });
+            // Our own stream on the connection to host, shared with the other workers.
+            unique_ptr<PeerSession::Stream> stream;
 
             // Transfer loop
             for (;;) {
@@ -80,9 +88,14 @@ public:
 
                 try {
                     statusFn("Transferring");
-                    this->transfer(plan, sock, statusFn);
+                    if (!stream || stream->stale()) {
+                        stream = this->session->open();
+                    }
+                    this->transfer(plan, *stream, statusFn);
                 } catch (const exception &e) {
                     statusFn("Error during transfer - " + string(e.what()));
+                    // The replica may be halfway through something on it.
+                    stream.reset();
 
                     // Assume it was a failure and requeue it.
                     LOG_EXCEPTION(e, "TransferWorker transfer loop " << plan.debugString());
@@ -93,10 +106,11 @@ public:
                     // Wouldn't want a tight loop causing more problems.
                     this_thread::sleep_for(chrono::seconds(2));
                 }
+                this->policy->done(this->host, plan.file);
             }
         });
     }
-    void transfer(const PolicyPlan &plan, PersistentSocket &hostSock, std::function<void (string)> statusFn) {
+    void transfer(const PolicyPlan &plan, PeerSession::Stream &hostSock, std::function<void (string)> statusFn) {
         assert(plan.steps.value == this->host);
         statusFn("Transfer - " + plan.file.path.string());
 
@@ -108,48 +122,59 @@ public:
         //     return;
         // }
 
-        if (!std::filesystem::exists(this->root / plan.file.path)) {
+        bool exists = std::filesystem::exists(std::filesystem::symlink_status(this->root / plan.file.path));
+        if (plan.file.type == FileRecord::Type::DOES_NOT_EXIST && exists) {
+            // Back already, and that will have been queued too.
+            return;
+        }
+        if (plan.file.type != FileRecord::Type::DOES_NOT_EXIST && !exists) {
             StatusLine::Add("fileGone", 1);
             return;
         }
 
+        if (!plan.file.renamedFrom.empty()) {
+            this->transferRename(plan, hostSock, statusFn);
+            return;
+        }
+        if (plan.file.type == FileRecord::Type::FILE && !plan.file.linkTo.empty() && plan.file.linkTo != plan.file.path) {
+            this->transferLink(plan, hostSock, statusFn);
+            return;
+        }
+
         MSG::XfrEstablishReq req;
         req.plan = plan;
-        RETHROW_NESTED(hostSock.send(req), "transfer");
+        req.journalId = this->journalId;
 
         if (plan.file.type == FileRecord::Type::FILE) {
-            ifstream f(this->root / req.plan.file.path, ifstream::binary);
-            if (f.fail()) {
+            // Opened before the replica hears of it, since its size picks the block size.
+            std::filesystem::path path = this->root / req.plan.file.path;
+            int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+            struct stat statbuf;
+            if (fd < 0 || fstat(fd, &statbuf) != 0) {
+                if (fd >= 0) {
+                    close(fd);
+                }
                 StatusLine::Add("fileReadErr", 1);
                 throw runtime_error("Failed to open file " + req.plan.file.path.string());
             }
-
-            // If this resize is changed to a reserve, the contents of the buffer are sometimes
-            // zero after the read. I don't understand why.
-            this->block.data.resize(MSG::XfrBlock::MAX_SIZE);
-
-            while (f.good()) {
-                statusFn("Transfer - " + plan.file.path.string() + " - " + to_string(f.tellg()) + " - read");
-                f.read((char*)this->block.data.data(), MSG::XfrBlock::MAX_SIZE);
-                if (f.bad()) {
-                    StatusLine::Add("fileReadErr", 1);
-                    throw runtime_error("File is now in 'bad' state " + req.plan.file.path.string());
-                }
-                this->block.data.resize(f.gcount());
-                statusFn("Transfer - " + plan.file.path.string() + " - " + to_string(f.tellg()) + " - send");
-                RETHROW_NESTED(hostSock.send(this->block), "sending xfr file block");
-                StatusLine::Add("essentialOut", this->block.data.size());
-            }
-
-            // If file is already empty, closing protocol is already satisfied.
-            statusFn("Transfer - " + plan.file.path.string() + " - " + to_string(f.tellg()) + " - empty-send");
-            if (this->block.data.size() == MSG::XfrBlock::MAX_SIZE) {
-                this->block.data.resize(0);
-                RETHROW_NESTED(hostSock.send(this->block), "sending xfr empty file block");
+            req.blockSize = MSG::XfrBlock::SizeFor(statbuf.st_size);
+
+            try {
+                RETHROW_NESTED(hostSock.send(req), "transfer");
+                this->sendExtents(plan, fd, statbuf.st_size, req.blockSize, hostSock, statusFn);
+            } catch (...) {
+                close(fd);
+                throw;
             }
+            close(fd);
 
             StatusLine::Add("filesOut", 1);
-        } else if (plan.file.type == FileRecord::Type::SYMLINK) {
+            return;
+        }
+
+        RETHROW_NESTED(hostSock.send(req), "transfer");
+
+        if (plan.file.type == FileRecord::Type::SYMLINK) {
             // this->block.data.resize(0);
             // try {
             //     hostSock.send(this->block);
@@ -169,13 +194,160 @@ public:
             //     throw;
             // }
             StatusLine::Add("directoriesOut", 1);
+        } else if (plan.file.type == FileRecord::Type::DOES_NOT_EXIST) {
+            StatusLine::Add("deletesOut", 1);
+        }
+    }
+    void sendExtents(
+        const PolicyPlan &plan, int fd, uint64_t size, uint32_t blockSize, PeerSession::Stream &hostSock,
+        std::function<void (string)> statusFn
+    ) {
+        this->block.data.resize(0);
+        this->block.data.reserve(blockSize);
+        this->block.hole = 0;
+
+        auto sendBlock = [this, &plan, &hostSock, &statusFn] (uint64_t pos) {
+            statusFn("Transfer - " + plan.file.path.string() + " - " + to_string(pos) + " - send");
+            RETHROW_NESTED(hostSock.send(this->block), "sending xfr file block");
+            StatusLine::Add("essentialOut", this->block.data.size());
+            StatusLine::Add("holesOut", this->block.hole);
+            this->block.data.resize(0);
+            this->block.hole = 0;
+        };
+
+        uint64_t pos = 0;
+        bool shrunk = false;
+        for (const Extent &extent : dataExtents(fd, size)) {
+            if (extent.offset > pos) {
+                // Holes ride along with whatever data came before them.
+                this->block.hole = extent.offset - pos;
+                pos = extent.offset;
+                sendBlock(pos);
+            }
+
+            uint64_t end = extent.offset + extent.length;
+            while (pos < end) {
+                size_t filled = this->block.data.size();
+                size_t sz = min<uint64_t>(blockSize - filled, end - pos);
+                ssize_t n = pread(fd, this->block.data.data() + filled, sz, pos);
+                if (n < 0) {
+                    StatusLine::Add("fileReadErr", 1);
+                    throw runtime_error("Failed to read file " + plan.file.path.string() + ": " + strerror(errno));
+                }
+                if (n == 0) {
+                    // Shrunk since the stat, and that change will have been queued too.
+                    shrunk = true;
+                    break;
+                }
+                this->block.data.resize(filled + n);
+                pos += n;
+
+                if (this->block.data.size() == blockSize) {
+                    sendBlock(pos);
+                }
+            }
+            if (shrunk) {
+                break;
+            }
+        }
+        if (!shrunk && size > pos) {
+            this->block.hole = size - pos;
+            pos = size;
+            sendBlock(pos);
+        }
+
+        // Whatever is left is non-full and has no hole, which closes the transfer.
+        sendBlock(pos);
+    }
+    void transferRename(const PolicyPlan &plan, PeerSession::Stream &hostSock, std::function<void (string)> statusFn) {
+        statusFn("Rename - " + plan.file.renamedFrom.string() + " -> " + plan.file.path.string());
+
+        MSG::XfrEstablishReq req;
+        req.plan = plan;
+        req.journalId = this->journalId;
+        RETHROW_NESTED(hostSock.send(req), "rename");
+
+        MSG::Ptr<MSG::XfrRenameResp> resp;
+        RETHROW_NESTED(resp = hostSock.awaitWithType<MSG::XfrRenameResp>(MSG::Type::XFR_RENAME_RESP), "awaiting rename response");
+        if (!resp) {
+            throw runtime_error("Expected XFR_RENAME_RESP for " + plan.file.path.string());
+        }
+        if (resp->renamed) {
+            StatusLine::Add("renamesOut", 1);
+            return;
         }
+
+        // Replica didn't have the source, so it gets the content after all.
+        StatusLine::Add("renameFallbacks", 1);
+        PolicyPlan contentPlan = plan;
+        contentPlan.file.renamedFrom.clear();
+
+        if (plan.file.type == FileRecord::Type::DIRECTORY) {
+            error_code ec;
+            std::filesystem::recursive_directory_iterator it(this->root / plan.file.path, ec), end;
+            for (; !ec && it != end; it.increment(ec)) {
+                if (!this->filterFn(it->path())) {
+                    it.disable_recursion_pending();
+                    continue;
+                }
+
+                std::filesystem::file_status status = it->symlink_status(ec);
+                PolicyFile file = { it->path().lexically_relative(this->root), "", FileRecord::Type::FILE };
+                if (std::filesystem::is_symlink(status)) {
+                    file.type = FileRecord::Type::SYMLINK;
+                    file.targetPath = std::filesystem::read_symlink(it->path(), ec);
+                } else if (std::filesystem::is_directory(status)) {
+                    file.type = FileRecord::Type::DIRECTORY;
+                }
+                // Part of the same change as far as the journal goes.
+                file.seq = plan.file.seq;
+                this->policy->push(this->host, file);
+            }
+        }
+
+        this->transfer(contentPlan, hostSock, statusFn);
+    }
+    void transferLink(const PolicyPlan &plan, PeerSession::Stream &hostSock, std::function<void (string)> statusFn) {
+        PolicyPlan contentPlan = plan;
+
+        error_code ec;
+        if (std::filesystem::equivalent(this->root / plan.file.path, this->root / plan.file.linkTo, ec)) {
+            statusFn("Link - " + plan.file.path.string() + " -> " + plan.file.linkTo.string());
+
+            MSG::XfrEstablishReq req;
+            req.plan = plan;
+            req.journalId = this->journalId;
+            RETHROW_NESTED(hostSock.send(req), "link");
+
+            MSG::Ptr<MSG::XfrLinkResp> resp;
+            RETHROW_NESTED(resp = hostSock.awaitWithType<MSG::XfrLinkResp>(MSG::Type::XFR_LINK_RESP), "awaiting link response");
+            if (!resp) {
+                throw runtime_error("Expected XFR_LINK_RESP for " + plan.file.path.string());
+            }
+            if (resp->linked) {
+                StatusLine::Add("linksOut", 1);
+                return;
+            }
+
+            // The policy held this back until linkTo was through, so waiting won't help. Still
+            // linked, so the replica writes through to whatever it has linked already.
+            StatusLine::Add("linkFallbacks", 1);
+            contentPlan.file.linkTo = plan.file.path;
+        } else {
+            // Not the same file anymore, so its own content it is.
+            contentPlan.file.linkTo.clear();
+        }
+
+        this->transfer(contentPlan, hostSock, statusFn);
     }
 private:
     thread th;
     std::filesystem::path root;
     Policy *policy;
     PolicyHost host;
+    PeerSession *session;
+    std::function<bool (const std::filesystem::path &)> filterFn;
+    uint64_t journalId;
     // We reuse a block instead of freeing and reallocing over and over again.
     MSG::XfrBlock block;
 };
@@ -185,8 +357,9 @@ private:
 //////////////
 
 TransferProcess::TransferProcess(
-    const std::filesystem::path &root, const PolicyHost &us, Policy &policy, const vector<PolicyHost> &peers
-) : root(root), policy(&policy), us(us), peers(peers) {
+    const std::filesystem::path &root, const PolicyHost &us, Policy &policy, const vector<PolicyHost> &peers,
+    const vector<PeerSession*> &sessions, function<bool (const std::filesystem::path &)> filterFn, uint64_t journalId
+) : root(root), policy(&policy), us(us), peers(peers), sessions(sessions), filterFn(filterFn), journalId(journalId) {
     this->th = thread([this] () {
         this->main();
     });
@@ -203,7 +376,10 @@ void TransferProcess::main() {
     size_t npeers = this->peers.size();
     vector<TransferWorker> workers(WORKERS_PER_PEER * npeers);
     for (int i=0, n=workers.size(); i < n; i++) {
-        workers[i].bind(this->root, this->policy, this->peers[i % npeers], this->xfrCounter);
+        workers[i].bind(
+            this->root, this->policy, this->peers[i % npeers], this->sessions[i % npeers],
+            this->xfrCounter, this->filterFn, this->journalId
+        );
     }
 
     for (;;) {
@@ -2,6 +2,7 @@
 #define PROCESS_TRANSFER_PROCESS_H
 
 #include <condition_variable>
+#include <functional>
 #include <mutex>
 #include <queue>
 #include <string>
@@ -9,6 +10,7 @@
 #include "../index.h"
 #include "../util.h"
 #include "../net/inet-client.h"
+#include "../net/peer-session.h"
 #include "../net/protocol.h"
 #include "policy/policy.h"
 
@@ -60,7 +62,10 @@ class TransferProcess : public Process<TransferProcessMessageType> {
 public:
 	TransferProcess(
 		const std::filesystem::path &root, const PolicyHost &us, Policy &policy,
-		const std::vector<PolicyHost> &peers
+		const std::vector<PolicyHost> &peers,
+		const std::vector<PeerSession*> &sessions,
+		std::function<bool (const std::filesystem::path &)> filterFn,
+		uint64_t journalId
 	);
 
 	///////////////////////////////////////
@@ -82,6 +87,12 @@ private:
 	Policy *policy;
 	PolicyHost us;
 	std::vector<PolicyHost> peers;
+	// One per peer, in the same order.
+	std::vector<PeerSession*> sessions;
+	// For when a replica can't apply a directory rename and needs its contents sent instead.
+	std::function<bool (const std::filesystem::path &)> filterFn;
+	// Sent along with every transfer, so replicas can tell which journal its seq refers to.
+	uint64_t journalId;
 };
 
 #endif
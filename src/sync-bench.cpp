@@ -0,0 +1,300 @@
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <iostream>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/socket.h>
+
+#include "net/inet-client.h"
+#include "net/inet-server.h"
+#include "net/peer-session.h"
+#include "net/protocol.h"
+#include "net/socket.h"
+#include "util/log.h"
+
+using namespace std;
+
+void usageAndExit(string progname) {
+    cout << "Usage: " << progname << " command" << endl;
+    cout << "Available commands:" << endl;
+    cout << "    crypto             Encrypt+decrypt throughput of one connection, on one core." << endl;
+    cout << "    socket             Throughput of XfrBlocks through a pair of Sockets over a socketpair." << endl;
+    cout << "    pipeline           Diff queries answered per second over loopback, by RTT, requests in flight and batch size." << endl;
+    cout << "    serialize          Serialize+deserialize throughput of a typical DiffReq, without the Socket." << endl;
+    exit(0);
+}
+
+// Round-trips messages of a few typical sizes through a SocketCrypto, the way a Socket would
+// on each end of a connection.
+void benchCrypto() {
+    Socket::CryptoInit("0123456789abcdef0123456789abcdef");
+    SocketCrypto sender, receiver;
+
+    const size_t TOTAL_BYTES = 256 * 1024 * 1024;
+    for (size_t size : { 256, 4 * 1024, 32 * 1024 }) {
+        vector<unsigned char> plaintext(size, 'x');
+        vector<unsigned char> ciphertext(size + 64);
+        vector<unsigned char> decrypted(size + 64);
+        int ciphertextLen, decryptedLen;
+
+        size_t iterations = TOTAL_BYTES / size;
+        auto start = chrono::steady_clock::now();
+        for (size_t i = 0; i < iterations; i++) {
+            sender.encrypt(plaintext.data(), size, ciphertext.data(), &ciphertextLen);
+            receiver.decrypt(ciphertext.data(), ciphertextLen, decrypted.data(), &decryptedLen);
+        }
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+        cout << "crypto " << size << "B messages: "
+             << static_cast<uint64_t>(TOTAL_BYTES / seconds / 1e6) << " MB/s, "
+             << static_cast<uint64_t>(iterations / seconds) << " msg/s" << endl;
+    }
+}
+
+// Where a diff of a deep tree finds its ith path: a few dozen files to a directory, several
+// directories down.
+string benchPath(uint32_t i) {
+    return "deploy/releases/2026-10-17/assets/images/" + to_string(i / 32)
+        + "/thumbnail-" + to_string(i) + ".png";
+}
+
+// Queries in a DiffReq when there's nothing to size it by.
+const uint32_t TYPICAL_QUERIES = 256;
+
+// What a Socket does with a DiffReq before compressing it, and after decompressing it.
+void benchSerialize() {
+    MSG::DiffReq req;
+    req.epoch = 1;
+    for (uint32_t i = 0; i < TYPICAL_QUERIES; i++) {
+        req.queries.push_back({ benchPath(i), i * 2654435761u });
+    }
+
+    OutputBuffer buf;
+    MSG::DiffReq received;
+    const size_t ITERATIONS = 20000;
+    size_t bytes = 0;
+    auto start = chrono::steady_clock::now();
+    for (size_t i = 0; i < ITERATIONS; i++) {
+        buf.reset(0);
+        buf.reserve(wireSize(req));
+        Writer out(buf);
+        req.serialize(out);
+        bytes += buf.size();
+
+        Reader in(buf.data(), buf.size());
+        received.deserialize(in);
+    }
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    if (wireSize(req) != buf.size()) {
+        throw runtime_error("wireSize " + to_string(wireSize(req)) + " != " + to_string(buf.size()));
+    }
+
+    const vector<MSG::DiffReq::Query> &uncoded = req.queries;
+    cout << "serialize " << bytes / ITERATIONS << "B DiffReqs ("
+         << wireSize(req) - wireSize(req.queries) + wireSize(uncoded) << "B without front coding): "
+         << static_cast<uint64_t>(bytes / seconds / 1e6) << " MB/s, "
+         << static_cast<uint64_t>(ITERATIONS / seconds) << " msg/s" << endl;
+}
+
+// A Socket over one end of a socketpair.
+class PairSocket : public Socket {
+public:
+    PairSocket(int fd) {
+        this->sock = fd;
+    }
+};
+
+// Sends file blocks from one thread and receives them on another, through the whole framing,
+// compression and encryption stack.
+void benchSocket() {
+    Socket::CryptoInit("0123456789abcdef0123456789abcdef");
+
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) {
+        throw system_error(errno, system_category(), "socketpair");
+    }
+    PairSocket sender(fds[0]), receiver(fds[1]);
+
+    // The same 256 MB at each block size a transfer might pick.
+    const size_t TOTAL_BYTES = 256 * 1024 * 1024;
+    for (size_t size = MSG::XfrBlock::MIN_SIZE; size <= MSG::XfrBlock::MAX_SIZE; size *= 2) {
+        MSG::XfrBlock block;
+        block.data.resize(size);
+        for (size_t i = 0; i < size; i++) {
+            // Incompressible enough that snappy can't shortcut it.
+            block.data.data()[i] = static_cast<uint8_t>(i * 2654435761u >> 13);
+        }
+
+        size_t blocks = TOTAL_BYTES / size;
+        auto start = chrono::steady_clock::now();
+        thread th([&sender, &block, blocks] () {
+            for (size_t i = 0; i < blocks; i++) {
+                sender.send(block);
+            }
+        });
+        for (size_t i = 0; i < blocks; i++) {
+            receiver.awaitWithType<MSG::XfrBlock>(MSG::Type::XFR_BLOCK);
+        }
+        th.join();
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+        cout << "socket " << size << "B blocks: "
+             << static_cast<uint64_t>(TOTAL_BYTES / seconds / 1e6) << " MB/s, "
+             << static_cast<uint64_t>(blocks / seconds) << " msg/s" << endl;
+    }
+}
+
+// Holds replies back for a while before sending them, like a slow link would. Requests go
+// through at loopback speed, so the whole round trip is spent here.
+class DelayLine {
+public:
+    DelayLine() {
+        thread([this] () {
+            this->run();
+        }).detach();
+    }
+
+    void setDelay(chrono::milliseconds delay) {
+        lock_guard<mutex> lock(this->m);
+        this->delay = delay;
+    }
+
+    void push(Socket &remote, uint32_t stream, MSG::DiffResp &&resp) {
+        lock_guard<mutex> lock(this->m);
+        this->queue.push_back({ chrono::steady_clock::now() + this->delay, &remote, stream, std::move(resp) });
+        this->cv.notify_one();
+    }
+
+private:
+    struct Delayed {
+        chrono::steady_clock::time_point due;
+        Socket *remote;
+        uint32_t stream;
+        MSG::DiffResp resp;
+    };
+
+    void run() {
+        unique_lock<mutex> lock(this->m);
+        for (;;) {
+            this->cv.wait(lock, [this] { return !this->queue.empty(); });
+            // Same delay for everything, so the front is always due first.
+            if (this->cv.wait_until(lock, this->queue.front().due) == cv_status::no_timeout) {
+                continue;
+            }
+            Delayed delayed = std::move(this->queue.front());
+            this->queue.pop_front();
+            delayed.remote->send(delayed.resp, delayed.stream);
+        }
+    }
+
+    mutex m;
+    condition_variable cv;
+    deque<Delayed> queue;
+    chrono::milliseconds delay{0};
+};
+
+// Answers DiffReqs the way a replica that's mostly in sync would, through a DelayLine.
+class DiffSession : public InetServer::Session {
+public:
+    DiffSession(DelayLine &delayLine) : delayLine(delayLine) {}
+
+    bool onMessage(Socket &remote, uint32_t stream, MSG::Type type, MSG::Base *msg) override {
+        MSG::DiffReq *req = dynamic_cast<MSG::DiffReq*>(msg);
+        MSG::DiffResp resp;
+        resp.requestId = req->requestId;
+        for (size_t i = 0; i < req->queries.size(); i += 16) {
+            resp.answers.push_back(req->firstId + i);
+        }
+        this->delayLine.push(remote, stream, std::move(resp));
+        return true;
+    }
+
+private:
+    DelayLine &delayLine;
+};
+
+// Runs DiffReqs of a few sizes through a PeerSession and an InetServer on loopback, keeping up
+// to depth of them in flight the way SyncClientProcess does.
+void benchPipeline() {
+    Socket::CryptoInit("0123456789abcdef0123456789abcdef");
+    logSilent(true);
+
+    const string PORT = "17999";
+    DelayLine delayLine;
+    thread([&delayLine, PORT] () {
+        InetServer srv("127.0.0.1", PORT, [&delayLine] () {
+            return unique_ptr<InetServer::Session>(new DiffSession(delayLine));
+        });
+    }).detach();
+    this_thread::sleep_for(chrono::milliseconds(100));
+
+    PeerSession session([PORT] () {
+        return Socket(InetClient("127.0.0.1", PORT));
+    });
+
+    const size_t QUERIES = 64 * 1024;
+    for (int rtt : { 0, 10, 50 }) {
+        delayLine.setDelay(chrono::milliseconds(rtt));
+        for (size_t depth : { 4, 16 }) {
+            for (uint32_t batch : { 64u, TYPICAL_QUERIES, 1024u, MSG::DiffReq::MAX_RECORDS }) {
+                MSG::DiffReq req;
+                req.epoch = 1;
+                for (uint32_t i = 0; i < batch; i++) {
+                    req.queries.push_back({ benchPath(i), i * 2654435761u });
+                }
+
+                unique_ptr<PeerSession::Stream> stream = session.open();
+                deque<uint32_t> inFlight;
+                uint32_t nextRequestId = 1;
+                size_t requests = QUERIES / batch;
+
+                auto start = chrono::steady_clock::now();
+                for (size_t i = 0; i < requests || !inFlight.empty(); ) {
+                    if (i < requests && inFlight.size() < depth) {
+                        req.requestId = nextRequestId++;
+                        stream->send(req);
+                        inFlight.push_back(req.requestId);
+                        i++;
+                        continue;
+                    }
+                    MSG::Ptr<MSG::DiffResp> resp = stream->awaitWithType<MSG::DiffResp>(MSG::Type::DIFF_RESP);
+                    if (!resp || resp->requestId != inFlight.front()) {
+                        throw runtime_error("DIFF_RESP out of order");
+                    }
+                    inFlight.pop_front();
+                }
+                double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+                cout << "pipeline rtt=" << rtt << "ms depth=" << depth << " batch=" << batch << ": "
+                     << static_cast<uint64_t>(requests / seconds) << " req/s, "
+                     << static_cast<uint64_t>(QUERIES / seconds) << " queries/s" << endl;
+            }
+        }
+    }
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        usageAndExit(argv[0]);
+    }
+
+    string command = argv[1];
+    if (command == "crypto") {
+        benchCrypto();
+    } else if (command == "socket") {
+        benchSocket();
+    } else if (command == "pipeline") {
+        benchPipeline();
+    } else if (command == "serialize") {
+        benchSerialize();
+    } else {
+        usageAndExit(argv[0]);
+    }
+
+    return 0;
+}
@@ -42,7 +42,7 @@ int main(int argc, char **argv) {
         MSG::InfoReq msg;
         client.send(msg);
 
-        unique_ptr<MSG::InfoResp> resp = client.awaitWithType<MSG::InfoResp>(MSG::Type::INFO_RESP);
+        MSG::Ptr<MSG::InfoResp> resp = client.awaitWithType<MSG::InfoResp>(MSG::Type::INFO_RESP);
         LOG("");
         for (const auto &response : resp->payloads) {
             cout << "Payload" << endl;
@@ -61,7 +61,7 @@ int main(int argc, char **argv) {
         msg.path = arg;
         client.send(msg);
 
-        unique_ptr<MSG::InspectResp> resp = client.awaitWithType<MSG::InspectResp>(MSG::Type::INSPECT_RESP);
+        MSG::Ptr<MSG::InspectResp> resp = client.awaitWithType<MSG::InspectResp>(MSG::Type::INSPECT_RESP);
         LOG("");
         cout << "Payload" << endl;
         cout << "    Path: " << resp->path << endl;
@@ -75,7 +75,7 @@ int main(int argc, char **argv) {
         MSG::LogReq msg;
         client.send(msg);
 
-        unique_ptr<MSG::LogResp> resp = client.awaitWithType<MSG::LogResp>(MSG::Type::LOG_RESP);
+        MSG::Ptr<MSG::LogResp> resp = client.awaitWithType<MSG::LogResp>(MSG::Type::LOG_RESP);
         // As a side-effect, this populates StatusLine
 
         StatusLine::PrintAll(std::cout);
@@ -3,21 +3,25 @@
 #include <cstdlib>
 #include <functional>
 #include <iostream>
-#include <regex>
+#include <map>
+#include <set>
 #include <signal.h>
 #include <thread>
 
 #include "fs/scanner.h"
 #include "fs/watcher.h"
 #include "fs/util.h"
+#include "net/compression.h"
 #include "net/unix-server.h"
 #include "net/inet-client.h"
+#include "net/peer-session.h"
 #include "process/command-process.h"
 #include "process/sync-client-process.h"
 #include "process/transfer-process.h"
 #include "process/policy/chain.h"
 #include "process/policy/fanout.h"
 #include "index.h"
+#include "journal.h"
 #include "util.h"
 #include "util/log.h"
 
@@ -34,12 +38,41 @@ void shutdownHandler(int signal) {
     std::exit(0);
 }
 
+// One fullsync for each group of replicas whose indexes hash the same, diffed against the first
+// of them and sent to them all. infos lines up with syncThreads; a replica whose INFO has no
+// payload, or that has other excludes than ours (and so is about to change), goes on its own.
+void castFullsyncs(
+    const vector<unique_ptr<SyncClientProcess>> &syncThreads, const vector<MSG::InfoResp> &infos,
+    uint64_t excludesFingerprint
+) {
+    map<uint64_t, vector<SyncClientProcess*>> groups;
+    for (size_t i = 0; i < syncThreads.size(); i++) {
+        const vector<MSG::InfoResp::Response> &payloads = infos[i].payloads;
+        if (payloads.empty() || payloads.front().excludesFingerprint != excludesFingerprint) {
+            syncThreads[i]->castFullsync();
+            continue;
+        }
+        groups[payloads.front().hash].push_back(syncThreads[i].get());
+    }
+
+    for (const auto &[hash, group] : groups) {
+        if (group.size() > 1) {
+            LOG(group.size() << " replicas have hash " << hash << ", diffing once for all of them.");
+        }
+        group.front()->castFullsync(vector<SyncClientProcess*>(group.begin() + 1, group.end()));
+    }
+}
+
 void exitWithUsage(const string &progname) {
     cout << "Usage: " << progname << " "
          << "instance-id "
          << "cookie "
          << "[--replica=<host:port>]* "
          << "[--exclude=<regex>]* "
+         << "[--watcher=inotify|fanotify] "
+         << "[--compress=auto|none|snappy|lz4|zstd[:<level>]] "
+         << "[--pipeline=<diff requests in flight>] "
+         << "[--lookahead=<speculative diff queries per round, 0 for none>] "
          << "[--verbose] "
          << "[--silent]" << endl;
     exit(0);
@@ -66,8 +99,11 @@ int main(int argc, char **argv) {
     const string COOKIE = argv[2];
     bool verbose = false, silent = false;
 
+    WatcherBackend watcherBackend = WatcherBackend::INOTIFY;
+    size_t pipelineDepth = SyncClientProcess::DEFAULT_PIPELINE_DEPTH;
+    size_t maxLookahead = SyncClientProcess::DEFAULT_MAX_LOOKAHEAD;
     vector<string> replicas;
-    vector<wregex> excludes;
+    vector<string> excludePatterns;
     for (int i=3; i < argc; i++) {
         string str = argv[i];
         if (str == "--verbose") {
@@ -89,20 +125,52 @@ int main(int argc, char **argv) {
         if (name == "replica") {
             replicas.push_back(val);
         } else if (name == "exclude") {
-            wregex r(wstring(val.begin(), val.end()));
-            excludes.push_back(r);
+            excludePatterns.push_back(val);
             LOG("Exclude " << val);
+        } else if (name == "watcher") {
+            if (val == "inotify") {
+                watcherBackend = WatcherBackend::INOTIFY;
+            } else if (val == "fanotify") {
+                watcherBackend = WatcherBackend::FANOTIFY;
+            } else {
+                exitWithUsage(argv[0]);
+            }
+        } else if (name == "compress") {
+            try {
+                CompressionPolicy::Configure(val);
+            } catch (const invalid_argument &e) {
+                cout << e.what() << endl;
+                exitWithUsage(argv[0]);
+            }
+        } else if (name == "pipeline") {
+            try {
+                pipelineDepth = stoul(val);
+            } catch (const logic_error &e) {
+                exitWithUsage(argv[0]);
+            }
+            if (pipelineDepth == 0) {
+                exitWithUsage(argv[0]);
+            }
+        } else if (name == "lookahead") {
+            try {
+                maxLookahead = stoul(val);
+            } catch (const logic_error &e) {
+                exitWithUsage(argv[0]);
+            }
         }
     }
 
     logSilent(silent);
 
+    const ExcludeSet excludes(excludePatterns);
+
 
     /////////////////////////////
     // Initialize global state //
     /////////////////////////////
 
     Index index(ROOT);
+    ChangeJournal journal;
 
     Socket::CryptoInit(COOKIE);
 
@@ -167,12 +235,24 @@ int main(int argc, char **argv) {
     PolicyHost us(INSTANCE_ID);
     // ChainPolicy policy(us);
     FanoutPolicy policy(us);
-    TransferProcess transferProc(ROOT, us, policy, policyHosts);
+    function<bool (const std::filesystem::path &)> filterFn = bind(filterPath, ref(ROOT), cref(excludes), _1);
+
+    // One connection per replica, shared by its sync sessions and transfer workers.
+    vector<unique_ptr<PeerSession>> peerSessions;
+    vector<PeerSession*> sessions;
+    for (const PolicyHost &policyHost : policyHosts) {
+        peerSessions.push_back(unique_ptr<PeerSession>(new PeerSession([policyHost] () {
+            return policyHost.connect();
+        })));
+        sessions.push_back(peerSessions.back().get());
+    }
+
+    TransferProcess transferProc(ROOT, us, policy, policyHosts, sessions, filterFn, journal.id());
 
     vector<unique_ptr<SyncClientProcess>> syncThreads;
-    for (auto policyHost : policyHosts) {
+    for (size_t i = 0; i < policyHosts.size(); i++) {
         syncThreads.push_back(unique_ptr<SyncClientProcess>(
-            new SyncClientProcess(policyHost, index, transferProc, verbose)));
+            new SyncClientProcess(policyHosts[i], *sessions[i], index, excludes, journal, transferProc, pipelineDepth, maxLookahead, verbose)));
     }
 
 
@@ -180,42 +260,92 @@ int main(int argc, char **argv) {
     // Get up to speed locally //
     /////////////////////////////
 
-    function<bool (const std::filesystem::path &)> filterFn = bind(filterPath, ref(ROOT), excludes, _1);
-
     function<void (const FileRecord &)> updateFn = [&index, &filterFn] (const FileRecord &rec) {
         if (filterFn(rec.path)) {
             index.update(rec);
         }
     };
 
+    // Journals a change and sends it to every replica.
+    function<void (PolicyFile)> publishFn = [&journal, &transferProc, &policyHosts] (PolicyFile file) {
+        file.seq = journal.append(file);
+        for (auto policyHost : policyHosts) {
+            transferProc.castTransfer(policyHost, file);
+        }
+    };
+
     function<void (const FileRecord &)> updateSingleFn =
-        [&ROOT, &index, &filterFn, &transferProc, &policyHosts] (const FileRecord &rec) {
+        [&ROOT, &index, &filterFn, &publishFn] (const FileRecord &rec) {
             if (filterFn(rec.path)) {
                 index.update(rec);
 
                 Relpath path = rec.path.lexically_relative(ROOT);
                 PolicyFile file = { path, rec.targetPath, rec.type };
-                for (auto policyHost : policyHosts) {
-                    transferProc.castTransfer(policyHost, file);
-                }
+                file.linkTo = index.linkSource(path);
+                file.version = rec.version;
+                publishFn(file);
+            }
+        };
+
+    // Moves the indexed subtree instead of rehashing it, and has replicas move theirs too.
+    function<void (const std::filesystem::path &, const std::filesystem::path &)> renameFn =
+        [&ROOT, &index, &excludes, &filterFn, &updateSingleFn, &publishFn] (
+            const std::filesystem::path &from, const std::filesystem::path &to
+        ) {
+            Relpath relFrom = from.lexically_relative(ROOT);
+            Relpath relTo = to.lexically_relative(ROOT);
+
+            bool moved = filterFn(from) && filterFn(to) &&
+                renamePreservesExcludes(ROOT, excludes, from, to) &&
+                index.rename(relFrom, relTo);
+            if (!moved) {
+                scanSingle(from, updateSingleFn);
+                performFullScan(to, updateSingleFn, filterFn);
+                return;
             }
+
+            error_code ec;
+            std::filesystem::file_status status = std::filesystem::symlink_status(to, ec);
+            PolicyFile file = { relTo, "", FileRecord::Type::FILE, relFrom };
+            if (std::filesystem::is_symlink(status)) {
+                file.type = FileRecord::Type::SYMLINK;
+                file.targetPath = std::filesystem::read_symlink(to, ec);
+            } else if (std::filesystem::is_directory(status)) {
+                file.type = FileRecord::Type::DIRECTORY;
+            }
+            publishFn(file);
         };
-    
-    thread watcherThread([ROOT, &updateSingleFn] () {
+
+    // Whatever the watcher dropped is in neither the index nor the journal. A rescan brings the
+    // index up to date, and AAE then diffs replicas against it rather than replaying.
+    function<void ()> overflowFn = [&ROOT, &index, &journal, &filterFn, &updateFn] () {
+        journal.reset();
+        index.rebuildBlock([&ROOT, &index, &filterFn, &updateFn] () {
+            set<Abspath> seen;
+            performFullScan(ROOT, [&seen, &updateFn] (const FileRecord &rec) {
+                seen.insert(rec.path);
+                updateFn(rec);
+            }, filterFn);
+            index.retain(seen);
+        });
+    };
+
+    thread watcherThread([ROOT, watcherBackend, &updateSingleFn, &renameFn, &filterFn, &overflowFn] () {
         LOG("-- Starting watcher thread.");
         StatusLine statusLine("Watcher");
         STATUS(statusLine, "Watching filesystem...");
-        Watcher watcher(ROOT, updateSingleFn);
+        Watcher watcher(ROOT, updateSingleFn, renameFn, filterFn, watcherBackend, overflowFn);
         while (!stop_requested.load()) {
             this_thread::sleep_for(chrono::milliseconds(250));
         }
     });
 
-    thread fullscanThread([ROOT, &index, &filterFn, &updateFn] () {
+    thread fullscanThread([ROOT, &index, &excludes, &filterFn, &updateFn] () {
         LOG("-- Starting fullscan thread.");
         StatusLine statusLine("Fullscan");
         STATUS(statusLine, "Scanning filesystem...");
-        index.rebuildBlock([ROOT, &filterFn, &updateFn] () {
+        index.rebuildBlock([ROOT, &index, &excludes, &filterFn, &updateFn] () {
+            index.setExcludes(excludes.fingerprint(), filterFn);
             performFullScan(ROOT, updateFn, filterFn);
         });
     });
@@ -234,16 +364,23 @@ int main(int argc, char **argv) {
     // Then get replicas up to speed //
     ///////////////////////////////////
 
-    for (auto &replica : syncThreads) {
-        replica->castFullsync();
+    vector<MSG::InfoResp> infos(syncThreads.size());
+    for (size_t i = 0; i < syncThreads.size(); i++) {
+        try {
+            infos[i] = syncThreads[i]->callInfo();
+        } catch (const exception &e) {
+            // Diffed on its own once it's reachable.
+            LOG_EXCEPTION(e, "Initial INFO");
+        }
     }
+    castFullsyncs(syncThreads, infos, excludes.fingerprint());
 
 
     // Sometimes due to an error or other unexpected condition, a re-sync may be required.
     // AAE thread performs a full-sync at regular intervals. This shouldn't carry much more
     // overhead than a ping<->pong exchange if there are no discrepancies.
 
-    thread aaeThread = thread([&policy, &syncThreads, &transferProc, &index] () {
+    thread aaeThread = thread([&policy, &syncThreads, &transferProc, &index, &excludes] () {
         StatusLine statusLine("AAE");
         std::string status = "pending";
         while (!stop_requested.load()) {
@@ -262,12 +399,18 @@ int main(int argc, char **argv) {
 
                 STATUS(statusLine, "metadata " + status);
                 bool anyDiscrepancies = false;
+                vector<MSG::InfoResp> infos;
                 for (auto &replica : syncThreads) {
-                    MSG::InfoResp remoteResp = replica->callInfo();
+                    infos.push_back(replica->callInfo());
+                    const MSG::InfoResp &remoteResp = infos.back();
 
                     stringstream ss;
                     for (const auto &payload : remoteResp.payloads) {
                         ss << payload.instanceId << " " << payload.status << " " << payload.filesIndexed << " " << payload.hash << " | " << endl;
+                        if (payload.excludesFingerprint != excludes.fingerprint()) {
+                            // The fullsync below starts a new session, which pushes our excludes first.
+                            LOG("Replica " << payload.instanceId << " has different excludes, re-establishing.");
+                        }
                         if (payload.hash != index.hash()) {
                             anyDiscrepancies = true;
                         }
@@ -277,9 +420,7 @@ int main(int argc, char **argv) {
 
                 if (anyDiscrepancies) {
                     STATUS(statusLine, "cast " + status);
-                    for (auto &replica : syncThreads) {
-                        replica->castFullsync();
-                    }
+                    castFullsyncs(syncThreads, infos, excludes.fingerprint());
                 }
             } catch (const exception &e) {
                 STATUS(statusLine, e.what());
@@ -1,4 +1,7 @@
+#include <algorithm>
+#include <atomic>
 #include <functional>
+#include <memory>
 #include <iostream>
 #include <signal.h>
 #include <thread>
@@ -39,7 +42,8 @@ int main(int argc, char **argv) {
     string HOST;
     string PORT;
 
-    vector<wregex> excludes;  // empty since not supported/needed by replica
+    // Only used until a primary connects and pushes its own.
+    vector<string> excludePatterns;
     for (int i=3; i < argc; i++) {
         string str = argv[i];
 
@@ -59,8 +63,7 @@ int main(int argc, char **argv) {
             HOST = val.substr(0, colPos);
             PORT = val.substr(colPos + 1);
         } else if (name == "exclude") {
-            wregex r(wstring(val.begin(), val.end()));
-            excludes.push_back(r);
+            excludePatterns.push_back(val);
         } else if (name == "path") {
             ROOT = val;
         } else {
@@ -89,23 +92,53 @@ int main(int argc, char **argv) {
 
     Index index(ROOT);
 
-    function<bool (const std::filesystem::path &)> filterFn = bind(filterPath, ref(ROOT), ref(excludes), _1);
+    // Swapped out whenever a primary pushes different excludes.
+    shared_ptr<const ExcludeSet> excludes = make_shared<const ExcludeSet>(excludePatterns);
+
+    function<bool (const std::filesystem::path &)> filterFn = [&ROOT, &excludes] (const std::filesystem::path &path) {
+        return filterPath(ROOT, *atomic_load(&excludes), path);
+    };
     function<void (const FileRecord &)> updateFn = [&index, &filterFn] (const FileRecord &rec) {
         if (filterFn(rec.path)) {
             index.update(rec);
         }
     };
 
-    thread fullscanThread([ROOT, &index, &filterFn, &updateFn] () {
+    thread fullscanThread([ROOT, &index, &excludes, &filterFn, &updateFn] () {
         LOG("-- Starting fullscan thread.");
         StatusLine statusLine("Fullscan");
         STATUS(statusLine, "Scanning filesystem...");
-        index.rebuildBlock([ROOT, &filterFn, &updateFn] () {
+        index.rebuildBlock([ROOT, &index, &excludes, &filterFn, &updateFn] () {
+            index.setExcludes(atomic_load(&excludes)->fingerprint(), filterFn);
             performFullScan(ROOT, updateFn, filterFn);
         });
     });
 
-    SyncServerProcess syncServer(HOST, PORT, ROOT, index, INSTANCE_ID);
+    function<void (const vector<string> &)> excludesFn =
+        [ROOT, &index, &excludes, &filterFn, &updateFn] (const vector<string> &patterns) {
+            shared_ptr<const ExcludeSet> next = make_shared<const ExcludeSet>(patterns);
+            shared_ptr<const ExcludeSet> prev = atomic_exchange(&excludes, next);
+            if (next->fingerprint() == prev->fingerprint()) {
+                return;
+            }
+
+            // If no pattern was dropped, nothing can have become included, and we can skip
+            // rescanning (and rehashing) the whole tree.
+            const vector<string> &nextPatterns = next->patterns();
+            bool narrowed = all_of(prev->patterns().begin(), prev->patterns().end(), [&nextPatterns] (const string &p) {
+                return find(nextPatterns.begin(), nextPatterns.end(), p) != nextPatterns.end();
+            });
+
+            LOG("Primary pushed " << patterns.size() << " excludes" << (narrowed ? "." : ", rescanning."));
+            index.rebuildBlock([ROOT, narrowed, &index, &next, &filterFn, &updateFn] () {
+                index.setExcludes(next->fingerprint(), filterFn);
+                if (!narrowed) {
+                    performFullScan(ROOT, updateFn, filterFn);
+                }
+            });
+        };
+
+    SyncServerProcess syncServer(HOST, PORT, ROOT, index, INSTANCE_ID, excludesFn, filterFn);
 
     vector<unique_ptr<SyncClientProcess>> emptySyncThreads;
     CommandProcess cmdProc(INSTANCE_ID, index, emptySyncThreads);
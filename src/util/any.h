@@ -7,7 +7,7 @@
 #include <stdexcept>
 
 /**
- * Only works on CopyConstructible types.
+ * Only works on CopyConstructible types. Copies of an Any share the value it holds.
  */
 
 class Any {
@@ -36,14 +36,14 @@ public:
 	template <typename T> Any(const T &value) : content(new Holder<T>(value)) {}
 
 	template <typename T> T cast() const {
-		if (Holder<T> *holder = dynamic_cast<Holder<T>*>(this->content.get())) {
+		if (const Holder<T> *holder = dynamic_cast<const Holder<T>*>(this->content.get())) {
 			return holder->held;
 		} else {
 			throw std::runtime_error("Could not cast Any.");
 		}
 	}
 
-	std::unique_ptr<TypeErased> content;
+	std::shared_ptr<const TypeErased> content;
 };
 
 #endif
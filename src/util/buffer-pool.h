@@ -0,0 +1,103 @@
+#ifndef UTIL_BUFFER_POOL_H
+#define UTIL_BUFFER_POOL_H
+
+#include <memory>
+#include <mutex>
+#include <vector>
+#include "log.h"
+
+// Memory for frames on their way in or out of a Socket, shared by all of them, so that a socket
+// only holds a buffer while it's handling a frame, and only one as big as that frame. Sizes are
+// rounded up to a power of two, and up to RETAINED_BYTES of buffers are kept for reuse.
+
+class BufferPool {
+	static const size_t MIN_SIZE = 4 * 1024;
+	// Size classes MIN_SIZE, 2 * MIN_SIZE, ... up to 4 MiB. Bigger buffers aren't kept.
+	static const size_t CLASSES = 11;
+	static const size_t RETAINED_BYTES = 64 * 1024 * 1024;
+
+public:
+	class Buffer {
+	public:
+		Buffer() : _size(0) {}
+		Buffer(const Buffer&) = delete;
+		Buffer& operator=(const Buffer&) = delete;
+		Buffer(Buffer &&other) : _data(std::move(other._data)), _size(other._size) {}
+		Buffer& operator=(Buffer &&other) {
+			std::swap(_data, other._data);
+			std::swap(_size, other._size);
+			return *this;
+		}
+		~Buffer() {
+			if (_data) {
+				BufferPool::Give(std::move(_data), _size);
+			}
+		}
+
+		char *data() const { return _data.get(); }
+		size_t size() const { return _size; }
+
+	private:
+		friend class BufferPool;
+		Buffer(std::unique_ptr<char[]> data, size_t size) : _data(std::move(data)), _size(size) {}
+
+		std::unique_ptr<char[]> _data;
+		size_t _size;
+	};
+
+	// At least size bytes, not initialized.
+	static Buffer Take(size_t size) {
+		size_t cls = ClassOf(size);
+		if (cls < CLASSES) {
+			size = MIN_SIZE << cls;
+			State &state = GetState();
+			std::lock_guard<std::mutex> lock(state.m);
+			std::vector<std::unique_ptr<char[]>> &free = state.free[cls];
+			if (!free.empty()) {
+				Buffer result(std::move(free.back()), size);
+				free.pop_back();
+				state.retained -= size;
+				return result;
+			}
+		}
+		StatusLine::Add("frameBufferAllocs", 1);
+		return Buffer(std::unique_ptr<char[]>(new char[size]), size);
+	}
+
+private:
+	struct State {
+		std::mutex m;
+		std::vector<std::unique_ptr<char[]>> free[CLASSES];
+		size_t retained = 0;
+	};
+
+	// Never destroyed, since sockets may still be giving buffers back during exit.
+	static State &GetState() {
+		static State *state = new State();
+		return *state;
+	}
+
+	static size_t ClassOf(size_t size) {
+		size_t cls = 0;
+		while (cls < CLASSES && (MIN_SIZE << cls) < size) {
+			cls++;
+		}
+		return cls;
+	}
+
+	static void Give(std::unique_ptr<char[]> data, size_t size) {
+		size_t cls = ClassOf(size);
+		if (cls >= CLASSES || (MIN_SIZE << cls) != size) {
+			return;
+		}
+		State &state = GetState();
+		std::lock_guard<std::mutex> lock(state.m);
+		if (state.retained + size > RETAINED_BYTES) {
+			return;
+		}
+		state.free[cls].push_back(std::move(data));
+		state.retained += size;
+	}
+};
+
+#endif
@@ -0,0 +1,60 @@
+#ifndef UTIL_DELTA_CODED_H
+#define UTIL_DELTA_CODED_H
+
+#include <limits>
+#include <stdexcept>
+#include <type_traits>
+#include <vector>
+#include "serialize.h"
+
+// A vector of ascending integers, sent as varint gaps between them, so that ids close together
+// cost a byte or so each.
+
+template <typename T>
+class DeltaCoded : public std::vector<T> {
+	static_assert(std::is_unsigned<T>::value, "Ids are unsigned.");
+
+public:
+	size_t wireSize() const {
+		size_t result = wire::varintSize(this->size());
+		T prev = 0;
+		for (T val : *this) {
+			result += wire::varintSize(val - prev);
+			prev = val;
+		}
+		return result;
+	}
+
+	void serialize(Writer &stream) const {
+		stream.varint(this->size());
+		T prev = 0;
+		for (T val : *this) {
+			if (val < prev) {
+				throw std::logic_error("DeltaCoded values must ascend.");
+			}
+			stream.varint(val - prev);
+			prev = val;
+		}
+	}
+
+	void deserialize(Reader &stream) {
+		uint64_t sz = stream.varint();
+		// Every gap takes at least a byte, so a bad count can't make us allocate much.
+		if (sz > stream.remaining()) {
+			throw std::runtime_error("Message ends early.");
+		}
+		this->resize(sz);
+
+		uint64_t val = 0;
+		for (size_t i = 0; i < sz; i++) {
+			uint64_t gap = stream.varint();
+			if (gap > std::numeric_limits<T>::max() - val) {
+				throw std::runtime_error("DeltaCoded value out of range.");
+			}
+			val += gap;
+			(*this)[i] = static_cast<T>(val);
+		}
+	}
+};
+
+#endif
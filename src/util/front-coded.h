@@ -0,0 +1,126 @@
+#ifndef UTIL_FRONT_CODED_H
+#define UTIL_FRONT_CODED_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <tuple>
+#include <type_traits>
+#include <vector>
+#include "serialize.h"
+
+// A vector of structs whose first field is a path, sent with each path front-coded against the
+// one before it: how many bytes it shares with the start of that one, then the rest. Sibling
+// and cousin paths, as a diff sends them, then cost little more than their leaf names. The
+// other FIELDS go as usual.
+
+template <typename T>
+class FrontCoded : public std::vector<T> {
+	using Fields = std::remove_const_t<decltype(T::FIELDS)>;
+	using RestIndices = std::make_index_sequence<std::tuple_size<Fields>::value - 1>;
+	static_assert(
+		std::is_same<decltype(schema::fieldType(std::get<0>(T::FIELDS))), std::string>::value,
+		"The first field must be the path."
+	);
+
+public:
+	size_t wireSize() const {
+		size_t result = wire::varintSize(this->size());
+		const std::string *prev = nullptr;
+		for (const T &el : *this) {
+			const std::string &path = el.*std::get<0>(T::FIELDS);
+			size_t shared = prev == nullptr ? 0 : SharedPrefix(*prev, path);
+			result += wire::varintSize(shared) + wire::varintSize(path.size() - shared);
+			result += path.size() - shared + RestWireSize(el, RestIndices());
+			prev = &path;
+		}
+		return result;
+	}
+
+	void serialize(Writer &stream) const {
+		stream.varint(this->size());
+		const std::string *prev = nullptr;
+		for (const T &el : *this) {
+			const std::string &path = el.*std::get<0>(T::FIELDS);
+			size_t shared = prev == nullptr ? 0 : SharedPrefix(*prev, path);
+			stream.varint(shared);
+			stream.varint(path.size() - shared);
+			stream.write(path.data() + shared, path.size() - shared);
+			SerializeRest(stream, el, RestIndices());
+			prev = &path;
+		}
+	}
+
+	void deserialize(Reader &stream) {
+		uint64_t sz = stream.varint();
+		// Every element takes at least two bytes, so a bad count can't make us allocate much.
+		if (sz > stream.remaining()) {
+			throw std::runtime_error("Message ends early.");
+		}
+		this->resize(sz);
+
+		for (size_t i = 0; i < sz; i++) {
+			std::string &path = (*this)[i].*std::get<0>(T::FIELDS);
+			uint64_t shared = stream.varint();
+			uint64_t rest = stream.varint();
+			if (i == 0) {
+				if (shared > 0) {
+					throw std::runtime_error("First front-coded path can't share a prefix.");
+				}
+				path.clear();
+			} else {
+				const std::string &prev = (*this)[i - 1].*std::get<0>(T::FIELDS);
+				if (shared > prev.size()) {
+					throw std::runtime_error("Front-coded path shares more than the one before.");
+				}
+				path.assign(prev, 0, shared);
+			}
+			path.append(stream.take(rest), rest);
+			DeserializeRest(stream, (*this)[i], RestIndices());
+		}
+	}
+
+private:
+	static size_t SharedPrefix(const std::string &a, const std::string &b) {
+		const char *pa = a.data(), *pb = b.data();
+		size_t n = std::min(a.size(), b.size());
+		size_t i = 0;
+		// A word at a time. In a word that differs, the first differing byte holds the lowest set bit
+		// of the XOR, or the highest on big-endian.
+		for (; i + sizeof(uint64_t) <= n; i += sizeof(uint64_t)) {
+			uint64_t wa, wb;
+			memcpy(&wa, pa + i, sizeof(uint64_t));
+			memcpy(&wb, pb + i, sizeof(uint64_t));
+			if (wa != wb) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+				return i + __builtin_ctzll(wa ^ wb) / 8;
+#else
+				return i + __builtin_clzll(wa ^ wb) / 8;
+#endif
+			}
+		}
+		while (i < n && pa[i] == pb[i]) {
+			i++;
+		}
+		return i;
+	}
+
+	template <size_t... I>
+	static size_t RestWireSize(const T &el, std::index_sequence<I...>) {
+		return (size_t(0) + ... + ::wireSize(el.*std::get<I + 1>(T::FIELDS)));
+	}
+
+	template <size_t... I>
+	static void SerializeRest(Writer &stream, const T &el, std::index_sequence<I...>) {
+		(::serialize(stream, el.*std::get<I + 1>(T::FIELDS)), ...);
+	}
+
+	template <size_t... I>
+	static void DeserializeRest(Reader &stream, T &el, std::index_sequence<I...>) {
+		(::deserialize(stream, el.*std::get<I + 1>(T::FIELDS)), ...);
+	}
+};
+
+#endif
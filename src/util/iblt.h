@@ -0,0 +1,160 @@
+#ifndef UTIL_IBLT_H
+#define UTIL_IBLT_H
+
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <tuple>
+#include <utility>
+#include <vector>
+#include "serialize.h"
+
+// An invertible Bloom lookup table of (key, value) pairs. Take one side's table away from the
+// other's and only the pairs the two don't share are left, which can be listed back out as long
+// as there are fewer of them than about two thirds of the cells. So a table the size of the
+// difference between two big sets is enough to find it.
+
+class Iblt {
+public:
+	// Cells each pair goes in, one in each of as many equal parts of the table.
+	static const size_t HASHES = 3;
+
+	struct Cell {
+		// Pairs in the cell, less those taken away, mod 2^32.
+		uint32_t count = 0;
+		// XOR of Check() of each pair, which tells a cell holding one pair from one holding a few.
+		uint32_t checkSum = 0;
+		uint64_t keySum = 0;
+		uint64_t valueSum = 0;
+
+		static constexpr auto FIELDS = std::make_tuple(
+			&Cell::count, &Cell::checkSum, &Cell::keySum, &Cell::valueSum);
+	};
+
+	Iblt() = default;
+	// Rounded up to a whole number of cells per part.
+	explicit Iblt(size_t cells) : cells((cells + HASHES - 1) / HASHES * HASHES) {}
+
+	void insert(uint64_t key, uint64_t value) {
+		this->add(key, value, 1);
+	}
+
+	// Takes other's pairs away from ours.
+	void subtract(const Iblt &other) {
+		this->validate();
+		if (other.cells.size() != this->cells.size()) {
+			throw std::runtime_error("Can't subtract IBLTs of different sizes.");
+		}
+		for (size_t i = 0; i < this->cells.size(); i++) {
+			Cell &cell = this->cells[i];
+			const Cell &theirs = other.cells[i];
+			cell.count -= theirs.count;
+			cell.checkSum ^= theirs.checkSum;
+			cell.keySum ^= theirs.keySum;
+			cell.valueSum ^= theirs.valueSum;
+		}
+	}
+
+	// After a subtract, lists the pairs only we had and those only the other side had, leaving
+	// the table empty. False if it couldn't list them all.
+	bool decode(
+		std::vector<std::pair<uint64_t, uint64_t>> &ours,
+		std::vector<std::pair<uint64_t, uint64_t>> &theirs
+	) {
+		this->validate();
+		std::vector<size_t> pure;
+		for (size_t i = 0; i < this->cells.size(); i++) {
+			if (this->isPure(i)) {
+				pure.push_back(i);
+			}
+		}
+
+		// More than this and the table was never going to decode; stop before a bad one makes
+		// us spin.
+		size_t limit = this->cells.size();
+		while (!pure.empty()) {
+			size_t i = pure.back();
+			pure.pop_back();
+			if (!this->isPure(i)) {
+				continue;
+			}
+			if (ours.size() + theirs.size() == limit) {
+				return false;
+			}
+
+			uint64_t key = this->cells[i].keySum;
+			uint64_t value = this->cells[i].valueSum;
+			bool isOurs = this->cells[i].count == 1;
+			(isOurs ? ours : theirs).emplace_back(key, value);
+			this->add(key, value, isOurs ? static_cast<uint32_t>(-1) : 1);
+			for (size_t h = 0; h < HASHES; h++) {
+				size_t j = this->cellFor(h, key, value);
+				if (this->isPure(j)) {
+					pure.push_back(j);
+				}
+			}
+		}
+
+		for (const Cell &cell : this->cells) {
+			if (cell.count != 0 || cell.keySum != 0 || cell.valueSum != 0 || cell.checkSum != 0) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+	size_t size() const { return this->cells.size(); }
+
+private:
+	void add(uint64_t key, uint64_t value, uint32_t count) {
+		uint32_t check = Check(key, value);
+		for (size_t h = 0; h < HASHES; h++) {
+			Cell &cell = this->cells[this->cellFor(h, key, value)];
+			cell.count += count;
+			cell.checkSum ^= check;
+			cell.keySum ^= key;
+			cell.valueSum ^= value;
+		}
+	}
+
+	bool isPure(size_t i) const {
+		const Cell &cell = this->cells[i];
+		return (cell.count == 1 || cell.count == static_cast<uint32_t>(-1)) &&
+			cell.checkSum == Check(cell.keySum, cell.valueSum);
+	}
+
+	// By the whole pair, not just the key, so that a key both sides have at different values
+	// doesn't land in the same cells twice and cancel out its own count.
+	size_t cellFor(size_t h, uint64_t key, uint64_t value) const {
+		size_t part = this->cells.size() / HASHES;
+		return h * part + Mix(key ^ Mix(value + h + 1)) % part;
+	}
+
+	static uint32_t Check(uint64_t key, uint64_t value) {
+		return static_cast<uint32_t>(Mix(key ^ Mix(value ^ 0x9e3779b97f4a7c15ull)) >> 32);
+	}
+
+	// splitmix64's finalizer.
+	static uint64_t Mix(uint64_t x) {
+		x ^= x >> 30;
+		x *= 0xbf58476d1ce4e5b9ull;
+		x ^= x >> 27;
+		x *= 0x94d049bb133111ebull;
+		x ^= x >> 31;
+		return x;
+	}
+
+	// Tables off the wire can be any size.
+	void validate() const {
+		if (this->cells.empty() || this->cells.size() % HASHES != 0) {
+			throw std::runtime_error("IBLT of " + std::to_string(this->cells.size()) + " cells.");
+		}
+	}
+
+	std::vector<Cell> cells;
+
+public:
+	static constexpr auto FIELDS = std::make_tuple(&Iblt::cells);
+};
+
+#endif
@@ -119,7 +119,7 @@ void StatusLine::print(ostream &stream) {
 	       << endl;
 }
 
-void StatusLine::serialize(std::ostream &stream) const {
+void StatusLine::serialize(Writer &stream) const {
 	// Mutex should already be held prior to calling.
 
 	::serialize(stream, this->typeStr);
@@ -134,7 +134,7 @@ void StatusLine::serialize(std::ostream &stream) const {
 	::serialize(stream, this->statusStr);
 }
 
-void StatusLine::deserialize(std::istream &stream) {
+void StatusLine::deserialize(Reader &stream) {
 	// Mutex should already be held prior to calling.
 
 	string typeStr, identStr;
@@ -293,7 +293,7 @@ void StatusLine::Refresh(ostream &stream) {
 	}
 }
 
-void StatusLine::Serialize(ostream &stream) {
+void StatusLine::Serialize(Writer &stream) {
 	lock_guard<mutex> lock(logMutex);
 
 	uint32_t size;
@@ -313,7 +313,7 @@ void StatusLine::Serialize(ostream &stream) {
 	}
 }
 
-void StatusLine::Deserialize(istream &stream, unique_ptr<StatusLine[]> &statusLines) {
+void StatusLine::Deserialize(Reader &stream, unique_ptr<StatusLine[]> &statusLines) {
 	lock_guard<mutex> lock(logMutex);
 
 	uint32_t size;
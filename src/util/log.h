@@ -116,8 +116,8 @@ public:
 	void add(std::string name, Int val);
 
 	void print(std::ostream &stream);
-	void serialize(std::ostream &stream) const;
-	void deserialize(std::istream &stream);
+	void serialize(Writer &stream) const;
+	void deserialize(Reader &stream);
 
 	static void Set(std::string name, String val);
 	static void Set(std::string name, Int val);
@@ -129,10 +129,10 @@ public:
 	static void PrintAll(std::ostream &stream);
 	static void ClearAll(std::ostream &stream);
 	static void Refresh(std::ostream &stream);
-	static void Serialize(std::ostream &stream);
+	static void Serialize(Writer &stream);
 	// statusLines is necessary because each StatusLine must be owned and lifetime must be sufficient
 	// to make it to the PrintAll call.
-	static void Deserialize(std::istream &stream, std::unique_ptr<StatusLine[]> &statusLines);
+	static void Deserialize(Reader &stream, std::unique_ptr<StatusLine[]> &statusLines);
 private:
 	static std::string VarToString(const Env &env, const Variable &var);
 
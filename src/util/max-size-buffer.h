@@ -1,28 +1,46 @@
 #ifndef UTIL_MAX_SIZE_BUFFER_H
 #define UTIL_MAX_SIZE_BUFFER_H
 
+#include <algorithm>
 #include <cassert>
+#include <cstdint>
+#include <cstring>
 #include <memory>
 
-// Like a vector, except always allocates the max given amount of memory.
-// Resize only affects size variable——no allocations or constructors.
+// Like a vector, except never holds more than Size bytes, and resize only affects the size
+// variable——no constructors. Memory is allocated as it's first needed instead of up front, and
+// kept, so a buffer that's reused settles at the size of what it carries.
 
 template <size_t Size>
 class MaxSizeBuffer {
 public:
-	MaxSizeBuffer() : _buf(new uint8_t[Size]), _allocated(Size), _size(0) {}
+	MaxSizeBuffer() : _allocated(0), _size(0) {}
 	MaxSizeBuffer(const MaxSizeBuffer&) = delete;
 	MaxSizeBuffer& operator=(const MaxSizeBuffer&) = delete;
 
 	uint8_t *data() const { return _buf.get(); }
 	size_t size() const { return _size; }
 	void resize(size_t size) {
-		assert(size <= _allocated);
+		this->reserve(size);
 		_size = size;
 	}
+	// Makes data() good for size bytes, e.g. to read into before resizing over them.
+	void reserve(size_t size) {
+		assert(size <= Size);
+		if (size <= _allocated) {
+			return;
+		}
+		size_t allocated = std::min(Size, std::max(size, _allocated * 2));
+		std::unique_ptr<uint8_t[]> buf(new uint8_t[allocated]);
+		if (_size > 0) {
+			memcpy(buf.get(), _buf.get(), _size);
+		}
+		_buf = std::move(buf);
+		_allocated = allocated;
+	}
 
 private:
-	std::unique_ptr<uint8_t> _buf;
+	std::unique_ptr<uint8_t[]> _buf;
 	size_t _allocated;
 	size_t _size;
 };
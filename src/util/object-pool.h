@@ -0,0 +1,50 @@
+#ifndef UTIL_OBJECT_POOL_H
+#define UTIL_OBJECT_POOL_H
+
+#include <memory>
+#include <mutex>
+#include <vector>
+
+// Holds on to up to capacity objects that are done with, so they can be handed out again
+// instead of allocated. They come back out as they went in, not freshly constructed.
+
+template <typename T>
+class ObjectPool {
+public:
+	ObjectPool() : _capacity(0) {}
+	ObjectPool(const ObjectPool&) = delete;
+	ObjectPool& operator=(const ObjectPool&) = delete;
+
+	void setCapacity(size_t capacity) {
+		std::lock_guard<std::mutex> lock(_m);
+		_capacity = capacity;
+	}
+
+	// nullptr if there's nothing to reuse.
+	T *take() {
+		std::lock_guard<std::mutex> lock(_m);
+		if (_free.empty()) {
+			return nullptr;
+		}
+		T *result = _free.back().release();
+		_free.pop_back();
+		return result;
+	}
+
+	// false if the pool is full, in which case obj is still the caller's.
+	bool give(T *obj) {
+		std::lock_guard<std::mutex> lock(_m);
+		if (_free.size() >= _capacity) {
+			return false;
+		}
+		_free.emplace_back(obj);
+		return true;
+	}
+
+private:
+	std::mutex _m;
+	size_t _capacity;
+	std::vector<std::unique_ptr<T>> _free;
+};
+
+#endif
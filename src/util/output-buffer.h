@@ -0,0 +1,55 @@
+#ifndef UTIL_OUTPUT_BUFFER_H
+#define UTIL_OUTPUT_BUFFER_H
+
+#include <algorithm>
+#include <cstddef>
+#include <vector>
+
+// Memory that messages are serialized into, kept between uses so that serializing a message
+// allocates nothing once the buffer has grown to fit. Space can be left at the front for
+// headers that can only be filled in once the rest is written.
+
+class OutputBuffer {
+public:
+	// Empties the buffer, then skips past headroom bytes.
+	void reset(size_t headroom) {
+		if (this->buf.size() < headroom + INITIAL_SIZE) {
+			this->buf.resize(headroom + INITIAL_SIZE);
+		}
+		this->used = headroom;
+	}
+
+	// Room for size more bytes, which count as written from here on.
+	char *append(size_t size) {
+		if (this->buf.size() - this->used < size) {
+			this->buf.resize(std::max(this->buf.size() * 2, this->used + size));
+		}
+		char *result = this->buf.data() + this->used;
+		this->used += size;
+		return result;
+	}
+
+	// Makes sure the next size bytes appended won't have to move what's already there.
+	void reserve(size_t size) {
+		if (this->buf.size() - this->used < size) {
+			this->buf.resize(this->used + size);
+		}
+	}
+
+	// Gives back the last size bytes of an append() that turned out to need less.
+	void unappend(size_t size) {
+		this->used -= size;
+	}
+
+	char *data() { return this->buf.data(); }
+	// Including headroom.
+	size_t size() const { return this->used; }
+
+private:
+	static const size_t INITIAL_SIZE = 4 * 1024;
+
+	std::vector<char> buf;
+	size_t used = 0;
+};
+
+#endif
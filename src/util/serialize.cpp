@@ -4,154 +4,31 @@
 #include <filesystem>
 #include <sys/stat.h>
 
-template <typename T>
-void serializeInteger(std::ostream &stream, const T &val) {
-	size_t sz = sizeof val;
-	// std::cout << "Serializing " << val << " of size " << sz << std::endl;
-	for (int i=sz-1; i >= 0; i--) {
-		// MSB to LSB
-		int offset = i * 8;
-		T mask = static_cast<T>(0xFF) << offset;
-		uint8_t byte = (val & mask) >> (i * 8);
-		stream.write((char*)&byte, 1);
-		// std::cout << "Byte " << std::hex << std::showbase << static_cast<uint64_t>(byte) << "." << std::endl;
-	}
+void serialize(Writer &stream, const std::wstring &str) {
+	stream.varint(str.size());
+	stream.write(str.data(), str.size() * sizeof(wchar_t));
 }
 
-template <typename T>
-T deserializeInteger(std::istream &stream) {
-	T val = 0;
-	size_t sz = sizeof val;
-	for (int i=0; i < sz; i++) {
-		// MSB to LSB
-		// First LSB will eventually become MSB
-		uint8_t lsb;
-		stream.read((char*)&lsb, 1);
-		// LOG("Byte[in] " << std::hex << std::showbase << static_cast<uint64_t>(lsb) << ".");
-		val = (val << 8) | lsb;
+void deserialize(Reader &stream, std::wstring &str) {
+	uint64_t sz = stream.varint();
+	if (sz > stream.remaining() / sizeof(wchar_t)) {
+		throw std::runtime_error("Message ends early.");
 	}
-	// LOG("Deserialized " << val << " of size " << sz);
-	return val;
-}
-
-
-void serialize(std::ostream &stream, const uint8_t &val) {
-	stream.write((char*)&val, 1);
-}
-
-void deserialize(std::istream &stream, uint8_t &val) {
-	stream.read((char*)&val, 1);
-}
-
-
-void serialize(std::ostream &stream, const uint16_t &val) {
-	serializeInteger(stream, val);
-}
-
-void deserialize(std::istream &stream, uint16_t &val) {
-	val = deserializeInteger<uint16_t>(stream);
-}
-
-
-void serialize(std::ostream &stream, const uint32_t &val) {
-	serializeInteger(stream, val);
+	str.resize(sz);
+	stream.read(&(*str.begin()), sz * sizeof(wchar_t));
 }
 
-void deserialize(std::istream &stream, uint32_t &val) {
-	val = deserializeInteger<uint32_t>(stream);
-}
-
-
-void serialize(std::ostream &stream, const uint64_t &val) {
-	serializeInteger(stream, val);
-}
-
-void deserialize(std::istream &stream, uint64_t &val) {
-	val = deserializeInteger<uint64_t>(stream);
-}
-
-
-void serialize(std::ostream &stream, const int64_t &val) {
-	serializeInteger(stream, static_cast<uint64_t>(val));
-}
-
-void deserialize(std::istream &stream, int64_t &val) {
-	val = static_cast<int64_t>(deserializeInteger<uint64_t>(stream));
-}
-
-
-void serialize(std::ostream &stream, const bool &val) {
-	serialize(stream, static_cast<uint8_t>(val));
+void serialize(Writer &stream, const std::filesystem::path &path) {
+	serialize(stream, path.native());
 }
 
-void deserialize(std::istream &stream, bool &val) {
-	uint8_t tmp;
-	deserialize(stream, tmp);
-	val = static_cast<bool>(tmp);
+void deserialize(Reader &stream, std::filesystem::path &path) {
+	uint64_t size = stream.varint();
+	const char *data = stream.take(size);
+	path.assign(data, data + size);
 }
 
-
-void serialize(std::ostream &stream, const std::string &str) {
-    uint32_t sz = str.size();
-
-    serialize(stream, sz);
-    if (sz > 0) {
-	    stream.write((char*)str.data(), sz);
-	}
-}
-
-void deserialize(std::istream &stream, std::string &str) {
-    uint32_t sz;
-    deserialize(stream, sz);
-
-    std::string s(sz, ' ');
-    if (sz > 0) {
-	    stream.read((char*)&(*s.begin()), sz);
-	}
-    swap(str, s);
-}
-
-void serialize(std::ostream &stream, const std::wstring &str) {
-	uint32_t sz = str.size();
-	serialize(stream, sz);
-	
-	if (sz > 0) {
-		stream.write(reinterpret_cast<const char*>(str.data()), sz * sizeof(wchar_t));
-	}
-}
-
-void deserialize(std::istream &stream, std::wstring &str) {
-	uint32_t sz;
-	deserialize(stream, sz);
-
-	std::wstring s(sz, L' ');
-	if (sz > 0) {
-		stream.read(reinterpret_cast<char*>(&(*s.begin())), sz * sizeof(wchar_t));
-	}
-	swap(str, s);
-}
-
-void serialize(std::ostream &stream, const std::filesystem::path &path) {
-	serialize(stream, path.string());
-}
-
-void deserialize(std::istream &stream, std::filesystem::path &path) {
-	std::string str;
-	deserialize(stream, str);
-	path = std::filesystem::path(str);
-}
-
-void serialize(std::ostream &stream, const MSG::Type &type) {
-	serialize(stream, static_cast<uint8_t>(type));
-}
-
-void deserialize(std::istream &stream, MSG::Type &type) {
-	uint8_t tmp;
-	deserialize(stream, tmp);
-	type = static_cast<MSG::Type>(tmp);
-}
-
-void serialize(std::ostream &stream, const std::filesystem::perms &p) {
+void serialize(Writer &stream, const std::filesystem::perms &p) {
 	mode_t mode = 0;
 
     if ((p & std::filesystem::perms::owner_read) != std::filesystem::perms::none) mode |= S_IRUSR;
@@ -169,7 +46,7 @@ void serialize(std::ostream &stream, const std::filesystem::perms &p) {
 	serialize(stream, static_cast<uint8_t>(mode));
 }
 
-void deserialize(std::istream &stream, std::filesystem::perms &p) {
+void deserialize(Reader &stream, std::filesystem::perms &p) {
 	uint8_t mode;
 	deserialize(stream, mode);
 
@@ -188,17 +65,13 @@ void deserialize(std::istream &stream, std::filesystem::perms &p) {
     if (mode & S_IXOTH) p |= std::filesystem::perms::others_exec;
 }
 
-void serialize(std::ostream &stream, const std::vector<uint8_t> &vec) {
-	uint64_t size = vec.size();
-	serialize(stream, size);
-
-	stream.write((char*)vec.data(), size);
+void serialize(Writer &stream, const std::vector<uint8_t> &vec) {
+	stream.varint(vec.size());
+	stream.write(vec.data(), vec.size());
 }
 
-void deserialize(std::istream &stream, std::vector<uint8_t> &vec) {
-	uint64_t size;
-	deserialize(stream, size);
-
-	vec.resize(size);
-    stream.read((char*)vec.data(), size);
+void deserialize(Reader &stream, std::vector<uint8_t> &vec) {
+	uint64_t size = stream.varint();
+	const char *data = stream.take(size);
+	vec.assign(data, data + size);
 }
@@ -2,69 +2,171 @@
 #define UTIL_SERIALIZE_H
 
 #include <filesystem>
-#include <istream>
-#include <iostream>
 #include <map>
-#include <ostream>
+#include <stdexcept>
 #include <string>
-#include <thread>
+#include <tuple>
+#include <type_traits>
+#include <utility>
 #include <vector>
 #include "max-size-buffer.h"
+#include "wire.h"
 
 namespace MSG {
 	enum class Type : uint8_t;
 }
 
 
+// Each type that can be serialized also has a wireSize(), the exact number of bytes
+// serialize() will write for it. Types that always take the same number of bytes say so in
+// FixedWireSize, at compile time.
+
+template <typename T, typename = void>
+struct FixedWireSize {
+    static constexpr bool FIXED = false;
+    static constexpr size_t SIZE = 0;
+};
+
+template <size_t Size>
+struct FixedWireSizeOf {
+    static constexpr bool FIXED = true;
+    static constexpr size_t SIZE = Size;
+};
+
+template <> struct FixedWireSize<uint8_t> : FixedWireSizeOf<1> {};
+template <> struct FixedWireSize<uint16_t> : FixedWireSizeOf<2> {};
+template <> struct FixedWireSize<uint32_t> : FixedWireSizeOf<4> {};
+template <> struct FixedWireSize<uint64_t> : FixedWireSizeOf<8> {};
+template <> struct FixedWireSize<int64_t> : FixedWireSizeOf<8> {};
+template <> struct FixedWireSize<bool> : FixedWireSizeOf<1> {};
+template <> struct FixedWireSize<MSG::Type> : FixedWireSizeOf<1> {};
+template <> struct FixedWireSize<std::filesystem::perms> : FixedWireSizeOf<1> {};
+
+// Structs can list their fields instead of serializing themselves. FIELDS holds member
+// pointers, in wire order, and serialize, deserialize and wireSize are generated from it at
+// compile time:
+//
+//   struct Child {
+//       std::string path;
+//       uint64_t hash;
+//
+//       static constexpr auto FIELDS = std::make_tuple(&Child::path, &Child::hash);
+//   };
+//
+// If every field has a fixed size, so does the struct.
+
+template <typename T, typename = void>
+struct HasFields : std::false_type {};
+
+template <typename T>
+struct HasFields<T, std::void_t<decltype(T::FIELDS)>> : std::true_type {};
+
+namespace schema {
+    template <typename Struct, typename Field>
+    Field fieldType(Field Struct::*);
+
+    template <typename Fields>
+    struct FieldsFixedWireSize;
+
+    template <typename... Fields>
+    struct FieldsFixedWireSize<std::tuple<Fields...>> {
+        static constexpr bool FIXED =
+            (FixedWireSize<decltype(fieldType(std::declval<Fields>()))>::FIXED && ...);
+        static constexpr size_t SIZE =
+            (size_t(0) + ... + FixedWireSize<decltype(fieldType(std::declval<Fields>()))>::SIZE);
+    };
+
+    template <typename T>
+    void serializeFields(Writer &stream, const T &obj);
+    template <typename T>
+    void deserializeFields(Reader &stream, T &obj);
+    template <typename T>
+    size_t fieldsWireSize(const T &obj);
+}
+
+template <typename T>
+struct FixedWireSize<T, std::enable_if_t<HasFields<T>::value>>
+    : schema::FieldsFixedWireSize<std::remove_const_t<decltype(T::FIELDS)>> {};
+
+// Other structs answer for themselves, with a wireSize() of their own.
+template <typename T>
+constexpr size_t wireSize(
+    const T &,
+    std::enable_if_t<FixedWireSize<T>::FIXED && !std::is_class<T>::value, int> = 0
+) {
+    return FixedWireSize<T>::SIZE;
+}
+
+
 /////////////////////
 // Primitive types //
 /////////////////////
 
-void serialize(std::ostream &stream, const uint8_t &val);
-void deserialize(std::istream &stream, uint8_t &val);
+inline void serialize(Writer &stream, const uint8_t &val) { stream.fixed(val); }
+inline void deserialize(Reader &stream, uint8_t &val) { val = stream.fixed<uint8_t>(); }
 
-void serialize(std::ostream &stream, const uint16_t &val);
-void deserialize(std::istream &stream, uint16_t &val);
+inline void serialize(Writer &stream, const uint16_t &val) { stream.fixed(val); }
+inline void deserialize(Reader &stream, uint16_t &val) { val = stream.fixed<uint16_t>(); }
 
-void serialize(std::ostream &stream, const uint32_t &val);
-void deserialize(std::istream &stream, uint32_t &val);
+inline void serialize(Writer &stream, const uint32_t &val) { stream.fixed(val); }
+inline void deserialize(Reader &stream, uint32_t &val) { val = stream.fixed<uint32_t>(); }
 
-void serialize(std::ostream &stream, const uint64_t &val);
-void deserialize(std::istream &stream, uint64_t &val);
+inline void serialize(Writer &stream, const uint64_t &val) { stream.fixed(val); }
+inline void deserialize(Reader &stream, uint64_t &val) { val = stream.fixed<uint64_t>(); }
 
-void serialize(std::ostream &stream, const int64_t &val);
-void deserialize(std::istream &stream, int64_t &val);
+inline void serialize(Writer &stream, const int64_t &val) { stream.fixed(static_cast<uint64_t>(val)); }
+inline void deserialize(Reader &stream, int64_t &val) { val = static_cast<int64_t>(stream.fixed<uint64_t>()); }
 
-void serialize(std::ostream &stream, const bool &val);
-void deserialize(std::istream &stream, bool &val);
+inline void serialize(Writer &stream, const bool &val) { stream.fixed(static_cast<uint8_t>(val)); }
+inline void deserialize(Reader &stream, bool &val) { val = stream.fixed<uint8_t>() != 0; }
 
 
 ///////////
 // Enums //
 ///////////
 
-void serialize(std::ostream &stream, const MSG::Type &type);
-void deserialize(std::istream &stream, MSG::Type &type);
+inline void serialize(Writer &stream, const MSG::Type &type) { stream.fixed(static_cast<uint8_t>(type)); }
+inline void deserialize(Reader &stream, MSG::Type &type) { type = static_cast<MSG::Type>(stream.fixed<uint8_t>()); }
 
-void serialize(std::ostream &stream, const std::filesystem::perms &type);
-void deserialize(std::istream &stream, std::filesystem::perms &type);
+void serialize(Writer &stream, const std::filesystem::perms &type);
+void deserialize(Reader &stream, std::filesystem::perms &type);
 
 
 /////////////////////
 // Composite types //
 /////////////////////
 
-void serialize(std::ostream &stream, const std::string &str);
-void deserialize(std::istream &stream, std::string &str);
+// Lengths and counts are varints from here on.
 
-void serialize(std::ostream &stream, const std::wstring &str);
-void deserialize(std::istream &stream, std::wstring &str);
+inline size_t wireSize(const std::string &str) {
+    return wire::varintSize(str.size()) + str.size();
+}
+inline void serialize(Writer &stream, const std::string &str) {
+    stream.varint(str.size());
+    stream.write(str.data(), str.size());
+}
+inline void deserialize(Reader &stream, std::string &str) {
+    uint64_t size = stream.varint();
+    str.assign(stream.take(size), size);
+}
 
-void serialize(std::ostream &stream, const std::filesystem::path &path);
-void deserialize(std::istream &stream, std::filesystem::path &path);
+inline size_t wireSize(const std::wstring &str) {
+    return wire::varintSize(str.size()) + str.size() * sizeof(wchar_t);
+}
+void serialize(Writer &stream, const std::wstring &str);
+void deserialize(Reader &stream, std::wstring &str);
 
-void serialize(std::ostream &stream, const std::vector<uint8_t> &vec);
-void deserialize(std::istream &stream, std::vector<uint8_t> &vec);
+inline size_t wireSize(const std::filesystem::path &path) {
+    return wireSize(path.native());
+}
+void serialize(Writer &stream, const std::filesystem::path &path);
+void deserialize(Reader &stream, std::filesystem::path &path);
+
+inline size_t wireSize(const std::vector<uint8_t> &vec) {
+    return wire::varintSize(vec.size()) + vec.size();
+}
+void serialize(Writer &stream, const std::vector<uint8_t> &vec);
+void deserialize(Reader &stream, std::vector<uint8_t> &vec);
 
 
 ///////////////////
@@ -72,50 +174,83 @@ void deserialize(std::istream &stream, std::vector<uint8_t> &vec);
 ///////////////////
 
 template <size_t Size>
-void serialize(std::ostream &stream, const MaxSizeBuffer<Size> &vec) {
-    uint64_t size = vec.size();
-    serialize(stream, size);
-
-    stream.write((char*)vec.data(), size);
+size_t wireSize(const MaxSizeBuffer<Size> &vec) {
+    return wire::varintSize(vec.size()) + vec.size();
 }
 
 template <size_t Size>
-void deserialize(std::istream &stream, MaxSizeBuffer<Size> &vec) {
-    uint64_t size;
-    deserialize(stream, size);
+void serialize(Writer &stream, const MaxSizeBuffer<Size> &vec) {
+    stream.varint(vec.size());
+    stream.write(vec.data(), vec.size());
+}
 
+template <size_t Size>
+void deserialize(Reader &stream, MaxSizeBuffer<Size> &vec) {
+    uint64_t size = stream.varint();
+    if (size > Size) {
+        throw std::runtime_error("Buffer of " + std::to_string(size) + " bytes doesn't fit.");
+    }
     vec.resize(size);
-    stream.read((char*)vec.data(), size);
+    stream.read(vec.data(), size);
 }
 
 // Classes/structs with serialize/deserialize methods
 
 template <typename T>
-void serialize(std::ostream &stream, T *obj) {
+void serialize(Writer &stream, T *obj) {
     obj->serialize(stream);
 }
 
 template <typename T>
-void deserialize(std::istream &stream, T *obj) {
+void deserialize(Reader &stream, T *obj) {
     obj->deserialize(stream);
 }
 
 
 template <typename T>
-void serialize(std::ostream &stream, const T &obj) {
-	obj.serialize(stream);
+auto wireSize(const T &obj) -> decltype(obj.wireSize()) {
+    return obj.wireSize();
+}
+
+template <typename T, std::enable_if_t<HasFields<T>::value, int> = 0>
+size_t wireSize(const T &obj) {
+    return schema::fieldsWireSize(obj);
+}
+
+template <typename T>
+void serialize(Writer &stream, const T &obj) {
+    if constexpr (HasFields<T>::value) {
+        schema::serializeFields(stream, obj);
+    } else {
+        obj.serialize(stream);
+    }
 }
 
 template <typename T>
-void deserialize(std::istream &stream, T &obj) {
-    obj.deserialize(stream);
+void deserialize(Reader &stream, T &obj) {
+    if constexpr (HasFields<T>::value) {
+        schema::deserializeFields(stream, obj);
+    } else {
+        obj.deserialize(stream);
+    }
 }
 
 
 template <typename T>
-void serialize(std::ostream &stream, const std::vector<T> &vec) {	
-    uint64_t sz = vec.size();
-    serialize(stream, sz);
+size_t wireSize(const std::vector<T> &vec) {
+    size_t result = wire::varintSize(vec.size());
+    if (FixedWireSize<T>::FIXED) {
+        return result + vec.size() * FixedWireSize<T>::SIZE;
+    }
+    for (const T &el : vec) {
+        result += wireSize(el);
+    }
+    return result;
+}
+
+template <typename T>
+void serialize(Writer &stream, const std::vector<T> &vec) {	
+    stream.varint(vec.size());
 
     for (const T &el : vec) {
     	serialize(stream, el);
@@ -123,34 +258,50 @@ void serialize(std::ostream &stream, const std::vector<T> &vec) {
 }
 
 template <typename T>
-void deserialize(std::istream &stream, std::vector<T> &vec) {
-    uint64_t sz;
-    deserialize(stream, sz);
+void deserialize(Reader &stream, std::vector<T> &vec) {
+    uint64_t sz = stream.varint();
+    // Every element takes at least a byte, so a bad count can't make us allocate much.
+    if (sz > stream.remaining()) {
+        throw std::runtime_error("Message ends early.");
+    }
     vec.resize(sz);
 
-    for (int i=0; i < sz; i++) {
+    for (size_t i=0; i < sz; i++) {
     	deserialize(stream, vec[i]);
     }
 }
 
 
 template <typename T, typename U>
-void serialize(std::ostream &stream, const std::pair<T, U> &p) {   
+size_t wireSize(const std::pair<T, U> &p) {
+    return wireSize(p.first) + wireSize(p.second);
+}
+
+template <typename T, typename U>
+void serialize(Writer &stream, const std::pair<T, U> &p) {   
     serialize(stream, p.first);
     serialize(stream, p.second);
 }
 
 template <typename T, typename U>
-void deserialize(std::istream &stream, std::pair<T, U> &p) {
+void deserialize(Reader &stream, std::pair<T, U> &p) {
     deserialize(stream, p.first);
     deserialize(stream, p.second);
 }
 
 
 template <typename T, typename U>
-void serialize(std::ostream &stream, const std::map<T, U> &m) {   
-    uint64_t sz = m.size();
-    serialize(stream, sz);
+size_t wireSize(const std::map<T, U> &m) {
+    size_t result = wire::varintSize(m.size());
+    for (const auto &el : m) {
+        result += wireSize(el);
+    }
+    return result;
+}
+
+template <typename T, typename U>
+void serialize(Writer &stream, const std::map<T, U> &m) {   
+    stream.varint(m.size());
 
     for (const auto &el : m) {
         serialize(stream, el);
@@ -158,15 +309,69 @@ void serialize(std::ostream &stream, const std::map<T, U> &m) {
 }
 
 template <typename T, typename U>
-void deserialize(std::istream &stream, std::map<T, U> &m) {
-    uint64_t sz;
-    deserialize(stream, sz);
+void deserialize(Reader &stream, std::map<T, U> &m) {
+    uint64_t sz = stream.varint();
 
-    for (int i=0; i < sz; i++) {
+    m.clear();
+    for (size_t i=0; i < sz; i++) {
         std::pair<T, U> p;
         deserialize(stream, p);
         m.emplace(p);
     }
 }
 
+
+////////////
+// Schema //
+////////////
+
+namespace schema {
+    // Indexing FIELDS with a constant gives a constant member pointer, which the compiler can
+    // resolve to an offset, where going through std::apply would leave it a variable.
+    template <typename T>
+    using FieldIndices =
+        std::make_index_sequence<std::tuple_size<std::remove_const_t<decltype(T::FIELDS)>>::value>;
+
+    template <typename T, size_t... I>
+    void serializeFields(Writer &stream, const T &obj, std::index_sequence<I...>) {
+        (serialize(stream, obj.*std::get<I>(T::FIELDS)), ...);
+    }
+
+    template <typename T, size_t... I>
+    void deserializeFields(Reader &stream, T &obj, std::index_sequence<I...>) {
+        (deserialize(stream, obj.*std::get<I>(T::FIELDS)), ...);
+    }
+
+    template <typename T, size_t... I>
+    size_t fieldsWireSize(const T &obj, std::index_sequence<I...>) {
+        return (size_t(0) + ... + wireSize(obj.*std::get<I>(T::FIELDS)));
+    }
+
+    template <typename T>
+    void serializeFields(Writer &stream, const T &obj) {
+        serializeFields(stream, obj, FieldIndices<T>());
+    }
+
+    template <typename T>
+    void deserializeFields(Reader &stream, T &obj) {
+        deserializeFields(stream, obj, FieldIndices<T>());
+    }
+
+    template <typename T>
+    size_t fieldsWireSize(const T &obj) {
+        if constexpr (FixedWireSize<T>::FIXED) {
+            return FixedWireSize<T>::SIZE;
+        } else {
+            return fieldsWireSize(obj, FieldIndices<T>());
+        }
+    }
+}
+
+template <typename T, typename = void>
+struct HasWireSize : std::false_type {};
+
+template <typename T>
+struct HasWireSize<T, std::void_t<decltype(wireSize(std::declval<const T&>()))>>
+    : std::true_type {};
+
 #endif
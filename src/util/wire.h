@@ -0,0 +1,141 @@
+#ifndef UTIL_WIRE_H
+#define UTIL_WIRE_H
+
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <type_traits>
+#include "output-buffer.h"
+
+// Integers as they go on the wire: fixed width big-endian, or LEB128 varints for lengths and
+// counts, which are nearly always small. Each is read or written straight to memory in one go.
+
+namespace wire {
+	const size_t MAX_VARINT_SIZE = 10;
+
+	template <typename T>
+	inline void putFixed(char *out, T val) {
+		static_assert(std::is_unsigned<T>::value, "Cast signed integers to unsigned first.");
+		T be = val;
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+		if (sizeof(T) == 2) {
+			be = static_cast<T>(__builtin_bswap16(static_cast<uint16_t>(val)));
+		} else if (sizeof(T) == 4) {
+			be = static_cast<T>(__builtin_bswap32(static_cast<uint32_t>(val)));
+		} else if (sizeof(T) == 8) {
+			be = static_cast<T>(__builtin_bswap64(static_cast<uint64_t>(val)));
+		}
+#endif
+		memcpy(out, &be, sizeof(T));
+	}
+
+	template <typename T>
+	inline T getFixed(const char *in) {
+		static_assert(std::is_unsigned<T>::value, "Cast signed integers to unsigned first.");
+		T be;
+		memcpy(&be, in, sizeof(T));
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+		if (sizeof(T) == 2) {
+			return static_cast<T>(__builtin_bswap16(static_cast<uint16_t>(be)));
+		} else if (sizeof(T) == 4) {
+			return static_cast<T>(__builtin_bswap32(static_cast<uint32_t>(be)));
+		} else if (sizeof(T) == 8) {
+			return static_cast<T>(__builtin_bswap64(static_cast<uint64_t>(be)));
+		}
+#endif
+		return be;
+	}
+
+	inline size_t varintSize(uint64_t val) {
+		size_t result = 1;
+		while (val >= 0x80) {
+			val >>= 7;
+			++result;
+		}
+		return result;
+	}
+
+	// Writes up to MAX_VARINT_SIZE bytes, and returns how many.
+	inline size_t putVarint(char *out, uint64_t val) {
+		size_t i = 0;
+		while (val >= 0x80) {
+			out[i++] = static_cast<char>(val | 0x80);
+			val >>= 7;
+		}
+		out[i++] = static_cast<char>(val);
+		return i;
+	}
+}
+
+// Serializes into an OutputBuffer.
+class Writer {
+public:
+	explicit Writer(OutputBuffer &buf) : buf(buf) {}
+
+	void write(const void *data, size_t size) {
+		if (size > 0) {
+			memcpy(this->buf.append(size), data, size);
+		}
+	}
+
+	template <typename T>
+	void fixed(T val) {
+		wire::putFixed(this->buf.append(sizeof(T)), val);
+	}
+
+	void varint(uint64_t val) {
+		char *out = this->buf.append(wire::MAX_VARINT_SIZE);
+		this->buf.unappend(wire::MAX_VARINT_SIZE - wire::putVarint(out, val));
+	}
+
+private:
+	OutputBuffer &buf;
+};
+
+// Deserializes from memory it doesn't own, e.g. where a message was received. Reading past the
+// end throws.
+class Reader {
+public:
+	Reader(const char *data, size_t size) : pos(data), end(data + size) {}
+
+	void read(void *out, size_t size) {
+		if (size > 0) {
+			memcpy(out, this->take(size), size);
+		}
+	}
+
+	// The next size bytes, where they are.
+	const char *take(size_t size) {
+		if (this->remaining() < size) {
+			throw std::runtime_error("Message ends early.");
+		}
+		const char *result = this->pos;
+		this->pos += size;
+		return result;
+	}
+
+	template <typename T>
+	T fixed() {
+		return wire::getFixed<T>(this->take(sizeof(T)));
+	}
+
+	uint64_t varint() {
+		uint64_t val = 0;
+		for (size_t shift = 0; shift < 7 * wire::MAX_VARINT_SIZE; shift += 7) {
+			uint8_t byte = static_cast<uint8_t>(*this->take(1));
+			val |= static_cast<uint64_t>(byte & 0x7F) << shift;
+			if ((byte & 0x80) == 0) {
+				return val;
+			}
+		}
+		throw std::runtime_error("Varint too long.");
+	}
+
+	size_t remaining() const { return this->end - this->pos; }
+
+private:
+	const char *pos;
+	const char *end;
+};
+
+#endif